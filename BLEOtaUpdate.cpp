@@ -1,18 +1,71 @@
 #include "BLEOtaUpdate.h"
+#include <algorithm>
+#include <assert.h>
+#include <time.h>
+#include <esp_partition.h>
+#if BLE_OTA_SIGNATURE
+#include <mbedtls/ecdsa.h>
+#endif
+
+#if BLE_OTA_COMPRESSION && __has_include(<rom/miniz.h>)
+#include <rom/miniz.h>
+#define OTA_HAS_ROM_MINIZ 1
+#define OTA_INFLATE_STATE_SIZE sizeof(tinfl_decompressor)
+#else
+#define OTA_INFLATE_STATE_SIZE 0
+#endif
 
 // Static instance
 BLEOtaUpdate* BLEOtaUpdate::instance = nullptr;
 
+// Build with -DBLE_OTA_STATIC_RAM_BUDGET=<bytes> to fail the build when a feature set does not fit a SKU
+#ifdef BLE_OTA_STATIC_RAM_BUDGET
+static_assert(sizeof(BLEOtaUpdate) + OTA_FOOTPRINT_TRACE <= BLE_OTA_STATIC_RAM_BUDGET,
+              "BLE OTA static RAM exceeds BLE_OTA_STATIC_RAM_BUDGET");
+#endif
+
+#if BLE_OTA_TRACE
+static_assert((BLE_OTA_TRACE_SIZE & (BLE_OTA_TRACE_SIZE - 1)) == 0, "BLE_OTA_TRACE_SIZE must be a power of two");
+OtaTraceRecord bleOtaTraceRing[BLE_OTA_TRACE_SIZE];
+uint32_t bleOtaTraceHead = 0;
+#endif
+
+// Default UUIDs, converted to binary by the compiler
+static constexpr OtaUuid defaultServiceUuid(DEFAULT_SERVICE_UUID);
+static constexpr OtaUuid defaultOtaCharUuid(DEFAULT_OTA_CHAR_UUID);
+static constexpr OtaUuid defaultCommandCharUuid(DEFAULT_COMMAND_CHAR_UUID);
+static constexpr OtaUuid defaultStatusCharUuid(DEFAULT_STATUS_CHAR_UUID);
+static constexpr OtaUuid defaultHistoryCharUuid(DEFAULT_HISTORY_CHAR_UUID);
+
+size_t otaUuidRejected(const char* text) {
+  OTA_LOG("[OTA] ERROR: OtaUuid from '%s', which is not a UUID\n", text ? text : "(null)");
+  assert(!"OtaUuid needs 8-4-4-4-12, 16-bit or 32-bit UUID text");
+  return 0;
+}
+
+// UUID strings from the sketch are parsed once; null or malformed ones keep the current UUID
+static bool assignUuid(OtaUuid& uuid, const char* text) {
+  if (!text) return false;
+  if (!otaUuidValid(text)) {
+    OTA_LOG("[OTA] ERROR: '%s' is not a UUID, keeping the previous one\n", text);
+    return false;
+  }
+  uuid = OtaUuid(text);
+  return true;
+}
+
 // Constructor implementations
 BLEOtaUpdate::BLEOtaUpdate() 
-  : BLEOtaUpdate(DEFAULT_SERVICE_UUID, DEFAULT_OTA_CHAR_UUID, DEFAULT_COMMAND_CHAR_UUID, DEFAULT_STATUS_CHAR_UUID) {
+  : BLEOtaUpdate(nullptr, nullptr, nullptr, nullptr) {
 }
 
-BLEOtaUpdate::BLEOtaUpdate(const char* serviceUUID, const char* otaCharUUID, const char* commandCharUUID, const char* statusCharUUID) {
-  this->serviceUUID = String(serviceUUID);
-  this->otaCharUUID = String(otaCharUUID);
-  this->commandCharUUID = String(commandCharUUID);
-  this->statusCharUUID = String(statusCharUUID);
+BLEOtaUpdate::BLEOtaUpdate(const char* serviceUUID, const char* otaCharUUID, const char* commandCharUUID, const char* statusCharUUID)
+  : serviceUUID(defaultServiceUuid), otaCharUUID(defaultOtaCharUuid), commandCharUUID(defaultCommandCharUuid),
+    statusCharUUID(defaultStatusCharUuid), historyCharUUID(defaultHistoryCharUuid) {
+  assignUuid(this->serviceUUID, serviceUUID);
+  assignUuid(this->otaCharUUID, otaCharUUID);
+  assignUuid(this->commandCharUUID, commandCharUUID);
+  assignUuid(this->statusCharUUID, statusCharUUID);
   
   // Initialize state
   otaInProgress = false;
@@ -20,15 +73,163 @@ BLEOtaUpdate::BLEOtaUpdate(const char* serviceUUID, const char* otaCharUUID, con
   otaReceived = 0;
   otaStatus = OtaStatus::IDLE;
   clientConnected = false;
+  uploaderConnId = OTA_NO_CONNECTION;
+#if BLE_OTA_COMMANDS
+  commandConnId = OTA_NO_CONNECTION;
+#endif
+#if BLE_OTA_COMMANDS && BLE_OTA_BENCHMARK
+  benchConnId = OTA_NO_CONNECTION;
+#endif
+#if BLE_OTA_TRACE && BLE_OTA_COMMANDS
+  traceConnId = OTA_NO_CONNECTION;
+  traceNext = 0;
+  traceEnd = 0;
+#endif
+  for (Peer& peer : peers) peer.used = false;
+  peerCount = 0;
+#if BLE_OTA_PROGRESS
+  observerProgressAtMs = 0;
+#endif
+  memset(&sessionStats, 0, sizeof(sessionStats));
+  awaitingFirstData = false;
+  setupStartedAtMs = 0;
+  lastAckOffset = 0;
+  sessionWindow = 0;
+  firstDataAtMs = 0;
+  lastDataAtMs = 0;
+  peakWindowStartMs = 0;
+  peakWindowStartOffset = 0;
+  sessionStartTime = 0;
+  sessionRecordPending = false;
+#if BLE_OTA_TUNING
+  autoTuning = false;
+  tunePeriodStartMs = 0;
+  tunePeriodStartOffset = 0;
+  tuneLastBps = 0;
+  tuneDirection = 1;
+  tuneKnob = 0;
+#endif
+#if BLE_OTA_PULL
+  pullRequested = 0;
+  pullRepairedAt = UINT32_MAX;
+  pullActivityMs = 0;
+#endif
+  sessionHeld = false;
+  heldAtMs = 0;
+#if BLE_OTA_BULK_READ
+  bulkReadEnabled = false;
+  readableLog = nullptr;
+  readableLogSize = 0;
+  readActive = false;
+  readPartition = nullptr;
+  readStart = 0;
+  readSize = 0;
+  readSent = 0;
+  readAcked = 0;
+  readAckAtMs = 0;
+  readRewind = false;
+  readCrc = 0;
+  readCrcOffset = 0;
+  readStartedAtMs = 0;
+  readResends = 0;
+  readBuffer = nullptr;
+  readChunk = 0;
+  readConnId = OTA_NO_CONNECTION;
+#endif
+#if BLE_OTA_BUNDLES
+  bundleSession = false;
+  bundleManifestFill = 0;
+  bundleCount = 0;
+  bundleItem = 0;
+  bundleItemWritten = 0;
+  memset(bundleTargets, 0, sizeof(bundleTargets));
+  memset(bundleSlots, 0, sizeof(bundleSlots));
+  mbedtls_sha256_init(&bundleDigest);
+#endif
+#if BLE_OTA_WIFI
+  wifiDataPath = false;
+  wifiServer = nullptr;
+  wifiSoftAp = false;
+  memset(wifiSsid, 0, sizeof(wifiSsid));
+  memset(wifiPsk, 0, sizeof(wifiPsk));
+  memset(wifiToken, 0, sizeof(wifiToken));
+  wifiStartPending = false;
+  wifiHeadDone = false;
+  wifiBodyRemaining = 0;
+#endif
+  longWritePending = false;
+  for (QueuedNotification& entry : notifyQueue) entry.used = false;
+  notifyLock = nullptr;
+  sessionLock = nullptr;
+  notifyOrder = 0;
+  notifyDraining = false;
+  memset(&notifyStats, 0, sizeof(notifyStats));
+  memset(&linkTestResult, 0, sizeof(linkTestResult));
+#if BLE_OTA_COMMANDS
+  echoSamples = nullptr;
+  echoTotal = 0;
+  echoSeq = 0;
+  echoSentAtUs = 0;
+#endif
+#if BLE_OTA_SIGNATURE
+  memset(signingKey, 0, sizeof(signingKey));
+  signingKeySet = false;
+  mbedtls_sha256_init(&imageDigest);
+  memset(imageSignature, 0, sizeof(imageSignature));
+  signatureReceived = false;
+#endif
+#if BLE_OTA_ENCRYPTION
+  memset(encryptionKey, 0, sizeof(encryptionKey));
+  encryptionKeyBits = 0;
+  mbedtls_aes_init(&imageCipher);
+  memset(cipherCounter, 0, sizeof(cipherCounter));
+  memset(cipherStream, 0, sizeof(cipherStream));
+  cipherOffset = 0;
+  plainBuffer = nullptr;
+  plainBufferSize = 0;
+#endif
+#if BLE_OTA_MERKLE
+  memset(merkleRoot, 0, sizeof(merkleRoot));
+  merkleBlock = nullptr;
+  merkleFill = 0;
+  merklePathLength = 0;
+#endif
+#if BLE_OTA_COMPRESSION
+  inflator = nullptr;
+  frameBuffer = nullptr;
+  inflateBuffer = nullptr;
+  frameFill = 0;
+  frameSeeking = false;
+#endif
+  skipUnchangedSectors = false;
+  sectorSinkSession = false;
+  sectorPartition = nullptr;
+  sectorBuffer = nullptr;
+  sectorFill = 0;
+  sectorOffset = 0;
+  sectorError = 0;
+  memset(&memoryReport, 0, sizeof(memoryReport));
+  bleTaskHandle = nullptr;
+  loopTaskHandle = nullptr;
   
   // Default configuration
   maxPacketSize = 512;
-  updateBufferSize = 4096;
+  updateBufferSize = OTA_DEFAULT_UPDATE_BUFFER;
+  flowControlWindow = OTA_DEFAULT_FLOW_WINDOW;
+  bondingEnabled = false;
+  
+  // Advertised OTA info (disabled until enabled by the application)
+  advertiseOtaInfo = false;
+  advCompanyId = OTA_ADV_COMPANY_ID_DEFAULT;
+  memset(fwVersion, 0, sizeof(fwVersion));
+  memset(fwHashPrefix, 0, sizeof(fwHashPrefix));
   
   // Initialize callbacks
   progressCallback = nullptr;
   statusCallback = nullptr;
+#if BLE_OTA_COMMANDS
   commandCallback = nullptr;
+#endif
   connectionCallback = nullptr;
   
   // Initialize BLE components
@@ -37,51 +238,83 @@ BLEOtaUpdate::BLEOtaUpdate(const char* serviceUUID, const char* otaCharUUID, con
   pOtaCharacteristic = nullptr;
   pCommandCharacteristic = nullptr;
   pStatusCharacteristic = nullptr;
+#if BLE_OTA_HISTORY
+  pHistoryCharacteristic = nullptr;
+#endif
+  pStatusCccd = nullptr;
 }
 
 void BLEOtaUpdate::begin(const char* deviceName) {
-  begin(deviceName, serviceUUID.c_str(), otaCharUUID.c_str(), commandCharUUID.c_str(), statusCharUUID.c_str());
+  begin(deviceName, nullptr, nullptr, nullptr, nullptr);
 }
 
 void BLEOtaUpdate::begin(const char* deviceName, const char* serviceUUID, const char* otaCharUUID, const char* commandCharUUID, const char* statusCharUUID) {
   // Set instance for callbacks
   instance = this;
+  this->deviceName = String(deviceName);
   
   // Update UUIDs if provided
-  if (serviceUUID) this->serviceUUID = String(serviceUUID);
-  if (otaCharUUID) this->otaCharUUID = String(otaCharUUID);
-  if (commandCharUUID) this->commandCharUUID = String(commandCharUUID);
-  if (statusCharUUID) this->statusCharUUID = String(statusCharUUID);
+  assignUuid(this->serviceUUID, serviceUUID);
+  assignUuid(this->otaCharUUID, otaCharUUID);
+  assignUuid(this->commandCharUUID, commandCharUUID);
+  assignUuid(this->statusCharUUID, statusCharUUID);
+  
+#if BLE_OTA_BUNDLES
+  // A bundle from the last session switches its data partitions only if its app is now running
+  promoteBundle();
+#endif
+  if (!notifyLock) notifyLock = xSemaphoreCreateMutex();
+  if (!sessionLock) sessionLock = xSemaphoreCreateRecursiveMutex();
   
   // Initialize BLE device
+  uint32_t freeHeap = ESP.getFreeHeap();
   BLEDevice::init(deviceName);
+  memoryReport.bleInitHeap = freeHeap - ESP.getFreeHeap();
+  freeHeap = ESP.getFreeHeap();
+  
+  // Just Works bonding: the first connection pairs, later ones only re-encrypt
+  if (bondingEnabled) {
+    BLESecurity* pSecurity = new BLESecurity();
+    pSecurity->setAuthenticationMode(ESP_LE_AUTH_REQ_SC_BOND);
+    pSecurity->setCapability(ESP_IO_CAP_NONE);
+    pSecurity->setInitEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+    pSecurity->setRespEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+    BLEDevice::setEncryptionLevel(ESP_BLE_SEC_ENCRYPT_NO_MITM);
+  }
   
   // Create server
   pServer = BLEDevice::createServer();
   pServer->setCallbacks(new ServerCallbacks());
+  BLEDevice::setCustomGattsHandler(gattsEventHandler);
+  BLEDevice::setCustomGapHandler(gapEventHandler);
+  memoryReport.serverHeap = freeHeap - ESP.getFreeHeap();
   
   // Initialize service
+  freeHeap = ESP.getFreeHeap();
   initializeService();
+  memoryReport.serviceHeap = freeHeap - ESP.getFreeHeap();
   
   // Start advertising
   BLEAdvertising* pAdvertising = BLEDevice::getAdvertising();
-  pAdvertising->addServiceUUID(this->serviceUUID.c_str());
+  pAdvertising->addServiceUUID(this->serviceUUID.toBLEUUID());
   pAdvertising->setScanResponse(true);
   pAdvertising->setMinPreferred(0x06);
   pAdvertising->setMinPreferred(0x12);
+  updateAdvertisingData();
   BLEDevice::startAdvertising();
   
   setOtaStatus(OtaStatus::IDLE, "BLE OTA Service Ready");
-  Serial.println("[BLE OTA] Service started and advertising");
+  OTA_LOGLN("[BLE OTA] Service started and advertising");
 }
 
 void BLEOtaUpdate::initializeService() {
-  // Create service
-  pService = pServer->createService(serviceUUID.c_str());
+  // Create service with a fixed handle range; every characteristic is always
+  // created, in the same order, so handles do not move between boots or builds
+  pService = pServer->createService(serviceUUID.toBLEUUID(), OTA_SERVICE_NUM_HANDLES);
   
   // Create OTA characteristic
   pOtaCharacteristic = pService->createCharacteristic(
-    otaCharUUID.c_str(),
+    otaCharUUID.toBLEUUID(),
     BLECharacteristic::PROPERTY_READ |
     BLECharacteristic::PROPERTY_WRITE |
     BLECharacteristic::PROPERTY_WRITE_NR |
@@ -90,21 +323,37 @@ void BLEOtaUpdate::initializeService() {
   pOtaCharacteristic->setCallbacks(new OtaCharacteristicCallbacks());
   pOtaCharacteristic->addDescriptor(new BLE2902());
   
-  // Create command characteristic
+  // Create command characteristic (a placeholder without a handler when BLE_OTA_COMMANDS is 0)
   pCommandCharacteristic = pService->createCharacteristic(
-    commandCharUUID.c_str(),
+    commandCharUUID.toBLEUUID(),
     BLECharacteristic::PROPERTY_WRITE |
     BLECharacteristic::PROPERTY_WRITE_NR
   );
+#if BLE_OTA_COMMANDS
   pCommandCharacteristic->setCallbacks(new CommandCharacteristicCallbacks());
+#endif
   
   // Create status characteristic
   pStatusCharacteristic = pService->createCharacteristic(
-    statusCharUUID.c_str(),
+    statusCharUUID.toBLEUUID(),
     BLECharacteristic::PROPERTY_READ |
     BLECharacteristic::PROPERTY_NOTIFY
   );
-  pStatusCharacteristic->addDescriptor(new BLE2902());
+  pStatusCccd = new BLE2902();
+  pStatusCharacteristic->addDescriptor(pStatusCccd);
+  
+  // Create history characteristic (last OTA_HISTORY_SIZE session records, newest first;
+  // an empty placeholder that keeps the handles in place when BLE_OTA_HISTORY is 0)
+  BLECharacteristic* pHistory = pService->createCharacteristic(
+    historyCharUUID.toBLEUUID(),
+    BLECharacteristic::PROPERTY_READ
+  );
+#if BLE_OTA_HISTORY
+  pHistoryCharacteristic = pHistory;
+  refreshHistoryCharacteristic();
+#else
+  (void)pHistory;
+#endif
   
   // Start service
   pService->start();
@@ -120,7 +369,9 @@ void BLEOtaUpdate::setOtaStatusCallback(OtaStatusCallback callback) {
 }
 
 void BLEOtaUpdate::setCommandCallback(CommandCallback callback) {
+#if BLE_OTA_COMMANDS
   commandCallback = callback;
+#endif
 }
 
 void BLEOtaUpdate::setConnectionCallback(ConnectionCallback callback) {
@@ -137,20 +388,28 @@ void BLEOtaUpdate::stop() {
 
 void BLEOtaUpdate::restart() {
   if (pServer) {
+    updateAdvertisingData();
     BLEDevice::startAdvertising();
     setOtaStatus(OtaStatus::IDLE, "Service restarted");
   }
 }
 
 void BLEOtaUpdate::abortUpdate() {
-  if (otaInProgress) {
-    Update.end(false);
+  // Also called from the sketch; the BLE task and loop() may be feeding the session meanwhile
+  xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+  if (otaInProgress && (sessionStats.features & OTA_FEATURE_SINK)) {
+    otaInProgress = false;
+    setOtaStatus(OtaStatus::ABORTED, "Link test aborted");
+  } else if (otaInProgress) {
+    recordSession(OtaStatus::ABORTED);
+    flashAbort();
     otaInProgress = false;
     otaFileSize = 0;
     otaReceived = 0;
     setOtaStatus(OtaStatus::ABORTED, "Update aborted by user");
     ESP.restart();
   }
+  xSemaphoreGiveRecursive(sessionLock);
 }
 
 // Status methods
@@ -158,6 +417,10 @@ bool BLEOtaUpdate::isConnected() const {
   return clientConnected;
 }
 
+uint8_t BLEOtaUpdate::getConnectionCount() const {
+  return peerCount;
+}
+
 bool BLEOtaUpdate::isUpdateInProgress() const {
   return otaInProgress;
 }
@@ -179,21 +442,53 @@ uint8_t BLEOtaUpdate::getUpdatePercentage() const {
   return (otaReceived * 100) / otaFileSize;
 }
 
+const OtaSessionStats& BLEOtaUpdate::getSessionStats() const {
+  return sessionStats;
+}
+
+const OtaLinkTestResult& BLEOtaUpdate::getLinkTestResult() const {
+  return linkTestResult;
+}
+
 // Configuration methods
-void BLEOtaUpdate::setServiceUUID(const char* uuid) {
-  serviceUUID = String(uuid);
+bool BLEOtaUpdate::setServiceUUID(const char* uuid) {
+  return assignUuid(serviceUUID, uuid);
+}
+
+void BLEOtaUpdate::setServiceUUID(const OtaUuid& uuid) {
+  serviceUUID = uuid;
+}
+
+bool BLEOtaUpdate::setOtaCharacteristicUUID(const char* uuid) {
+  return assignUuid(otaCharUUID, uuid);
+}
+
+void BLEOtaUpdate::setOtaCharacteristicUUID(const OtaUuid& uuid) {
+  otaCharUUID = uuid;
+}
+
+bool BLEOtaUpdate::setCommandCharacteristicUUID(const char* uuid) {
+  return assignUuid(commandCharUUID, uuid);
+}
+
+void BLEOtaUpdate::setCommandCharacteristicUUID(const OtaUuid& uuid) {
+  commandCharUUID = uuid;
 }
 
-void BLEOtaUpdate::setOtaCharacteristicUUID(const char* uuid) {
-  otaCharUUID = String(uuid);
+bool BLEOtaUpdate::setStatusCharacteristicUUID(const char* uuid) {
+  return assignUuid(statusCharUUID, uuid);
 }
 
-void BLEOtaUpdate::setCommandCharacteristicUUID(const char* uuid) {
-  commandCharUUID = String(uuid);
+void BLEOtaUpdate::setStatusCharacteristicUUID(const OtaUuid& uuid) {
+  statusCharUUID = uuid;
 }
 
-void BLEOtaUpdate::setStatusCharacteristicUUID(const char* uuid) {
-  statusCharUUID = String(uuid);
+bool BLEOtaUpdate::setHistoryCharacteristicUUID(const char* uuid) {
+  return assignUuid(historyCharUUID, uuid);
+}
+
+void BLEOtaUpdate::setHistoryCharacteristicUUID(const OtaUuid& uuid) {
+  historyCharUUID = uuid;
 }
 
 void BLEOtaUpdate::setMaxPacketSize(size_t size) {
@@ -204,20 +499,574 @@ void BLEOtaUpdate::setUpdateBufferSize(size_t size) {
   updateBufferSize = size;
 }
 
-// Send status updates
-void BLEOtaUpdate::sendStatus(const String& status) {
-  if (pStatusCharacteristic && clientConnected) {
-    pStatusCharacteristic->setValue(status.c_str());
-    pStatusCharacteristic->notify();
+void BLEOtaUpdate::setFlowControlWindow(size_t bytes) {
+  flowControlWindow = bytes;
+}
+
+void BLEOtaUpdate::setSkipUnchangedSectors(bool enable) {
+  skipUnchangedSectors = enable;
+}
+
+void BLEOtaUpdate::setAutoTuning(bool enable) {
+#if BLE_OTA_TUNING
+  autoTuning = enable;
+#endif
+}
+
+// Advertised OTA info
+void BLEOtaUpdate::setAdvertiseOtaInfo(bool enable) {
+  advertiseOtaInfo = enable;
+}
+
+void BLEOtaUpdate::setAdvertisingCompanyId(uint16_t companyId) {
+  advCompanyId = companyId;
+}
+
+void BLEOtaUpdate::setFirmwareVersion(uint8_t major, uint8_t minor, uint8_t patch) {
+  fwVersion[0] = major;
+  fwVersion[1] = minor;
+  fwVersion[2] = patch;
+}
+
+void BLEOtaUpdate::setFirmwareHashPrefix(const uint8_t* prefix, size_t length) {
+  memset(fwHashPrefix, 0, sizeof(fwHashPrefix));
+  memcpy(fwHashPrefix, prefix, min(length, sizeof(fwHashPrefix)));
+}
+
+bool BLEOtaUpdate::setEncryptionKey(const uint8_t* key, size_t length) {
+#if BLE_OTA_ENCRYPTION
+  if (!key || (length != 16 && length != 32)) return false;
+  memcpy(encryptionKey, key, length);
+  encryptionKeyBits = length * 8;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool BLEOtaUpdate::setSigningKey(const uint8_t* publicKey, size_t length) {
+#if BLE_OTA_SIGNATURE
+  if (!publicKey || length != OTA_PUBLIC_KEY_SIZE || publicKey[0] != 0x04) return false;
+
+  // Reject keys that are not on the curve now rather than failing every update later
+  mbedtls_ecp_group group;
+  mbedtls_ecp_point key;
+  mbedtls_ecp_group_init(&group);
+  mbedtls_ecp_point_init(&key);
+  bool valid = mbedtls_ecp_group_load(&group, MBEDTLS_ECP_DP_SECP256R1) == 0 &&
+               mbedtls_ecp_point_read_binary(&group, &key, publicKey, length) == 0 &&
+               mbedtls_ecp_check_pubkey(&group, &key) == 0;
+  mbedtls_ecp_point_free(&key);
+  mbedtls_ecp_group_free(&group);
+  if (!valid) return false;
+
+  memcpy(signingKey, publicKey, OTA_PUBLIC_KEY_SIZE);
+  signingKeySet = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void BLEOtaUpdate::setBondingEnabled(bool enable) {
+  bondingEnabled = enable;
+}
+
+void BLEOtaUpdate::updateAdvertisingData() {
+  if (!pServer || !advertiseOtaInfo) return;
+
+  // Default the hash prefix to the app ELF SHA-256 embedded in the image header
+  static const uint8_t noHash[OTA_ADV_HASH_PREFIX_LEN] = {0};
+  if (memcmp(fwHashPrefix, noHash, sizeof(fwHashPrefix)) == 0) {
+    memcpy(fwHashPrefix, esp_app_get_description()->app_elf_sha256, sizeof(fwHashPrefix));
+  }
+
+  // Little-endian record: company ID, version, fw version, hash prefix, state, slot KB, caps
+  uint16_t slotKb = min<uint32_t>(ESP.getFreeSketchSpace() / 1024, 0xFFFF);
+  uint16_t caps = OTA_CAP_STATUS_NOTIFY | OTA_CAP_HELLO | OTA_CAP_LINK_TEST;
+  if (BLE_OTA_COMMANDS) caps |= OTA_CAP_COMMAND_CHAR;
+  if (bondingEnabled) caps |= OTA_CAP_BONDING;
+#if BLE_OTA_SIGNATURE
+  if (signingKeySet) caps |= OTA_CAP_SIGNED;
+#endif
+#if BLE_OTA_ENCRYPTION
+  if (encryptionKeyBits) caps |= OTA_CAP_ENCRYPTED;
+#endif
+#ifdef CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED
+  caps |= OTA_CAP_GATT_CACHING;
+#endif
+  uint8_t record[OTA_ADV_RECORD_SIZE];
+  size_t i = 0;
+  record[i++] = advCompanyId & 0xFF;
+  record[i++] = advCompanyId >> 8;
+  record[i++] = OTA_ADV_RECORD_VERSION;
+  memcpy(&record[i], fwVersion, sizeof(fwVersion));
+  i += sizeof(fwVersion);
+  memcpy(&record[i], fwHashPrefix, sizeof(fwHashPrefix));
+  i += sizeof(fwHashPrefix);
+  record[i++] = (uint8_t)otaStatus;
+  record[i++] = slotKb & 0xFF;
+  record[i++] = slotKb >> 8;
+  record[i++] = caps & 0xFF;
+  record[i++] = caps >> 8;
+
+  // Scan response is 31 bytes: the record takes 17, the name gets the rest
+  const size_t maxNameLen = 31 - (OTA_ADV_RECORD_SIZE + 2) - 2;
+  BLEAdvertisementData scanResponse;
+  if (deviceName.length() > maxNameLen) {
+    scanResponse.setShortName(deviceName.substring(0, maxNameLen));
+  } else {
+    scanResponse.setName(deviceName);
+  }
+  scanResponse.setManufacturerData(String((const char*)record, i));
+  BLEDevice::getAdvertising()->setScanResponseData(scanResponse);
+}
+
+#if BLE_OTA_MERKLE || BLE_OTA_BENCHMARK
+// Merkle tree over OTA_MERKLE_BLOCK_SIZE blocks of the transmitted image; leaves and nodes are
+// domain-separated and an odd node at the end of a level is promoted unchanged
+static void merkleLeafHash(const uint8_t* block, size_t length, uint8_t out[32]) {
+  static const uint8_t prefix = 0x00;
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, &prefix, 1);
+  mbedtls_sha256_update(&sha, block, length);
+  mbedtls_sha256_finish(&sha, out);
+  mbedtls_sha256_free(&sha);
+}
+
+static void merkleNodeHash(const uint8_t* left, const uint8_t* right, uint8_t out[32]) {
+  uint8_t node[65];
+  node[0] = 0x01;
+  memcpy(node + 1, left, 32);
+  memcpy(node + 33, right, 32);
+  mbedtls_sha256(node, sizeof(node), out, 0);
+}
+#endif
+
+#if BLE_OTA_BENCHMARK
+// Self-benchmark
+static uint32_t benchKBps(uint32_t bytes, uint32_t elapsedUs) {
+  return elapsedUs ? (uint64_t)bytes * 1000000 / 1024 / elapsedUs : 0;
+}
+
+static uint32_t softwareCrc32(uint32_t crc, const uint8_t* data, size_t length) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+#ifdef OTA_HAS_ROM_MINIZ
+// Fixed-Huffman deflate block with literals only: one symbol per byte, the decoder's worst case
+static size_t deflateLiterals(const uint8_t* in, size_t length, uint8_t* out) {
+  uint32_t bits = 0;
+  int count = 0;
+  size_t n = 0;
+  auto putBits = [&](uint32_t value, int len) {
+    bits |= value << count;
+    count += len;
+    while (count >= 8) {
+      out[n++] = bits & 0xFF;
+      bits >>= 8;
+      count -= 8;
+    }
+  };
+  auto putCode = [&](uint32_t code, int len) {  // Huffman codes are packed MSB first
+    uint32_t reversed = 0;
+    for (int i = 0; i < len; i++) reversed |= ((code >> i) & 1) << (len - 1 - i);
+    putBits(reversed, len);
+  };
+
+  putBits(1, 1);  // BFINAL
+  putBits(1, 2);  // BTYPE = fixed Huffman
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] < 144) putCode(0x30 + in[i], 8);
+    else putCode(0x190 + in[i] - 144, 9);
+  }
+  putCode(0, 7);  // End of block
+  if (count) out[n++] = bits & 0xFF;
+  return n;
+}
+#endif
+#endif
+
+bool BLEOtaUpdate::runSelfBenchmark(OtaBenchmarkResult& result) {
+  memset(&result, 0, sizeof(result));
+#if BLE_OTA_BENCHMARK
+  if (otaInProgress) return false;
+
+  // A scratch partition when there is one. Otherwise the inactive slot, unless it may be the
+  // image a rollback returns to (or the running image has not been confirmed yet)
+  const size_t benchBytes = OTA_BENCH_SECTORS * OTA_BENCH_BLOCK_SIZE;
+  size_t offset = 0;
+  const esp_partition_t* slot =
+    esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, OTA_BENCH_PARTITION);
+  if (!slot || slot->size < benchBytes) {
+    esp_ota_img_states_t state = ESP_OTA_IMG_UNDEFINED;
+    esp_ota_get_state_partition(esp_ota_get_running_partition(), &state);
+    if (esp_ota_check_rollback_is_possible() || state == ESP_OTA_IMG_PENDING_VERIFY) {
+      OTA_LOGLN("[OTA] Benchmark refused: the inactive slot may hold the rollback image");
+      return false;
+    }
+    slot = esp_ota_get_next_update_partition(nullptr);
+    if (!slot) return false;
+    offset = slot->size - benchBytes;
+  }
+  uint8_t* buffer = (uint8_t*)malloc(OTA_BENCH_BLOCK_SIZE * 2);  // Input block + output block
+  noteBufferHeap(OTA_FOOTPRINT_BENCH);
+  if (!buffer) return false;
+  uint8_t* output = buffer + OTA_BENCH_BLOCK_SIZE;
+
+  // Pseudo-random data so nothing benefits from repeated patterns
+  uint32_t seed = 0x12345678;
+  for (size_t i = 0; i < OTA_BENCH_BLOCK_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    buffer[i] = seed >> 24;
+  }
+
+  // Flash: erase, program and read back
+  uint32_t start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    OTA_TRACE(ERASE_BEGIN, offset + i * OTA_BENCH_BLOCK_SIZE);
+    esp_partition_erase_range(slot, offset + i * OTA_BENCH_BLOCK_SIZE, OTA_BENCH_BLOCK_SIZE);
+    OTA_TRACE(ERASE_END, offset + i * OTA_BENCH_BLOCK_SIZE);
+  }
+  result.sectorEraseUs = (micros() - start) / OTA_BENCH_SECTORS;
+
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    OTA_TRACE(PROGRAM_BEGIN, offset + i * OTA_BENCH_BLOCK_SIZE);
+    esp_partition_write(slot, offset + i * OTA_BENCH_BLOCK_SIZE, buffer, OTA_BENCH_BLOCK_SIZE);
+    OTA_TRACE(PROGRAM_END, offset + i * OTA_BENCH_BLOCK_SIZE);
+  }
+  result.flashWriteKBps = benchKBps(benchBytes, micros() - start);
+
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    esp_partition_read(slot, offset + i * OTA_BENCH_BLOCK_SIZE, output, OTA_BENCH_BLOCK_SIZE);
+  }
+  result.flashReadKBps = benchKBps(benchBytes, micros() - start);
+
+  // SHA-256 and AES-128-CTR through mbedTLS (hardware backed when enabled in the IDF config)
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  start = micros();
+  mbedtls_sha256_starts(&sha, 0);
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    mbedtls_sha256_update(&sha, buffer, OTA_BENCH_BLOCK_SIZE);
+  }
+  mbedtls_sha256_finish(&sha, digest);
+  result.sha256KBps = benchKBps(benchBytes, micros() - start);
+  mbedtls_sha256_free(&sha);
+
+  uint8_t key[16] = {0};
+  uint8_t nonce[16] = {0};
+  uint8_t stream[16];
+  size_t streamOffset = 0;
+  mbedtls_aes_context aes;
+  mbedtls_aes_init(&aes);
+  mbedtls_aes_setkey_enc(&aes, key, 128);
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    mbedtls_aes_crypt_ctr(&aes, OTA_BENCH_BLOCK_SIZE, &streamOffset, nonce, stream, buffer, output);
+  }
+  result.aesCtrKBps = benchKBps(benchBytes, micros() - start);
+
+  // Decrypt cost as the OTA data path pays it: AES-256, one MTU-sized chunk per call
+  const size_t chunk = 244;
+  uint8_t key256[32] = {0};
+  mbedtls_aes_setkey_enc(&aes, key256, 256);
+  streamOffset = 0;
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    for (size_t at = 0; at < OTA_BENCH_BLOCK_SIZE; at += chunk) {
+      size_t length = min(chunk, OTA_BENCH_BLOCK_SIZE - at);
+      mbedtls_aes_crypt_ctr(&aes, length, &streamOffset, nonce, stream, buffer + at, output + at);
+    }
+  }
+  result.decryptUsPerKB = (uint64_t)(micros() - start) * 1024 / benchBytes;
+  mbedtls_aes_free(&aes);
+
+  // Merkle: leaf hash of one block plus the 10 node hashes of a 1024-block (4 MB) tree
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    merkleLeafHash(buffer, OTA_BENCH_BLOCK_SIZE, digest);
+    for (int level = 0; level < 10; level++) {
+      merkleNodeHash(digest, output, digest);
+    }
+  }
+  result.merkleBlockUs = (micros() - start) / OTA_BENCH_SECTORS;
+
+#ifdef CONFIG_MBEDTLS_HARDWARE_SHA
+  result.sha256Hardware = true;
+#endif
+#ifdef CONFIG_MBEDTLS_HARDWARE_AES
+  result.aesHardware = true;
+#endif
+
+  // CRC-32: ROM table implementation vs plain bitwise software
+  uint32_t crc = 0;
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    crc = esp_rom_crc32_le(crc, buffer, OTA_BENCH_BLOCK_SIZE);
+  }
+  result.crc32RomKBps = benchKBps(benchBytes, micros() - start);
+
+  crc = 0;
+  start = micros();
+  for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+    crc = softwareCrc32(crc, buffer, OTA_BENCH_BLOCK_SIZE);
+  }
+  result.crc32SoftKBps = benchKBps(benchBytes, micros() - start);
+
+#ifdef OTA_HAS_ROM_MINIZ
+  // Inflate with the ROM decoder into a block-sized, non-wrapping output buffer
+  tinfl_decompressor* inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+  uint8_t* compressed = (uint8_t*)malloc(OTA_BENCH_BLOCK_SIZE * 9 / 8 + 8);
+  noteBufferHeap(OTA_FOOTPRINT_BENCH + sizeof(tinfl_decompressor) + OTA_BENCH_BLOCK_SIZE * 9 / 8 + 8);
+  if (inflator && compressed) {
+    size_t compressedSize = deflateLiterals(buffer, OTA_BENCH_BLOCK_SIZE, compressed);
+    start = micros();
+    for (size_t i = 0; i < OTA_BENCH_SECTORS; i++) {
+      size_t inSize = compressedSize;
+      size_t outSize = OTA_BENCH_BLOCK_SIZE;
+      tinfl_init(inflator);
+      tinfl_decompress(inflator, compressed, &inSize, output, output, &outSize, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    }
+    result.inflateKBps = benchKBps(benchBytes, micros() - start);
   }
+  free(compressed);
+  free(inflator);
+#endif
+
+  free(buffer);
+  OTA_LOG("[OTA] Benchmark: erase %u us/sector, write %u KB/s, read %u KB/s, SHA-256 %u KB/s%s, "
+          "AES-CTR %u KB/s%s (decrypt %u us/KB), Merkle %u us/block, CRC32 %u/%u KB/s (ROM/soft), inflate %u KB/s\n",
+          result.sectorEraseUs, result.flashWriteKBps, result.flashReadKBps,
+          result.sha256KBps, result.sha256Hardware ? " (HW)" : "",
+          result.aesCtrKBps, result.aesHardware ? " (HW)" : "", result.decryptUsPerKB, result.merkleBlockUs,
+          result.crc32RomKBps, result.crc32SoftKBps, result.inflateKBps);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Send status updates: queue, then send what the link takes now; the rest goes out when the
+// controller reports free buffers again or from loop()
+void BLEOtaUpdate::sendStatus(const String& status, OtaNotifyPriority priority) {
+  sendStatusTo(OTA_NOTIFY_ALL, status, priority);
+}
+
+void BLEOtaUpdate::sendStatusTo(uint16_t target, const String& status, OtaNotifyPriority priority) {
+  if (!pStatusCharacteristic || !clientConnected || !notifyLock || target == OTA_NO_CONNECTION) return;
+  xSemaphoreTake(notifyLock, portMAX_DELAY);
+  queueNotification(status, priority, target);
+  xSemaphoreGive(notifyLock);
+  flushNotifications();
 }
 
 void BLEOtaUpdate::sendProgress(uint32_t received, uint32_t total) {
-  if (pStatusCharacteristic && clientConnected) {
-    String progress = "PROGRESS:" + String(received) + "/" + String(total);
-    pStatusCharacteristic->setValue(progress.c_str());
-    pStatusCharacteristic->notify();
+#if BLE_OTA_PROGRESS
+  String progress = "PROGRESS:" + String(received) + "/" + String(total);
+  if (!otaInProgress || peerCount < 2) {
+    sendStatus(progress, OtaNotifyPriority::PROGRESS);
+    return;
+  }
+  // The uploader gets every frame, observers a sample (and the last one)
+  sendStatusTo(uploaderConnId, progress, OtaNotifyPriority::PROGRESS);
+  uint32_t now = millis();
+  if (now - observerProgressAtMs >= OTA_OBSERVER_PROGRESS_MS || received == total) {
+    observerProgressAtMs = now;
+    sendStatusTo(OTA_NOTIFY_OBSERVERS, progress, OtaNotifyPriority::PROGRESS);
+  }
+#endif
+}
+
+const OtaNotifyStats& BLEOtaUpdate::getNotifyStats() const {
+  return notifyStats;
+}
+
+// Cumulative frames: only the newest PROGRESS, ACK or TUNE matters, so it replaces a queued one
+static bool supersedesQueued(const String& status, OtaNotifyPriority priority, const String& queued) {
+  if (priority == OtaNotifyPriority::PROGRESS) return queued.startsWith("PROGRESS:");
+  if (priority != OtaNotifyPriority::CONTROL) return false;
+  return (status.startsWith("ACK:") && queued.startsWith("ACK:")) ||
+         (status.startsWith("TUNE:") && queued.startsWith("TUNE:"));
+}
+
+// notifyLock held
+void BLEOtaUpdate::queueNotification(const String& status, OtaNotifyPriority priority, uint16_t target) {
+  QueuedNotification* slot = nullptr;
+  QueuedNotification* victim = nullptr;
+  uint16_t depth = 0;
+  for (QueuedNotification& entry : notifyQueue) {
+    if (!entry.used) {
+      if (!slot) slot = &entry;
+      continue;
+    }
+    depth++;
+    if (entry.priority == priority && entry.target == target && supersedesQueued(status, priority, entry.text)) {
+      entry.text = status;  // Keeps its place in the queue
+      notifyStats.coalesced++;
+      return;
+    }
+    // Least urgent, then newest: the frame to give up when the queue is full
+    if (!victim || entry.priority > victim->priority ||
+        (entry.priority == victim->priority && entry.order > victim->order)) {
+      victim = &entry;
+    }
+  }
+  if (!slot) {
+    if (victim->priority <= priority) {
+      notifyStats.dropped[(uint8_t)priority]++;
+      return;
+    }
+    notifyStats.dropped[(uint8_t)victim->priority]++;
+    slot = victim;
+    depth--;
+  }
+  slot->text = status;
+  slot->order = notifyOrder++;
+  slot->priority = priority;
+  slot->target = target;
+  slot->used = true;
+  notifyStats.maxQueueDepth = max<uint16_t>(notifyStats.maxQueueDepth, depth + 1);
+}
+
+void BLEOtaUpdate::flushNotifications() {
+  if (!notifyLock) return;
+  xSemaphoreTake(notifyLock, portMAX_DELAY);
+  if (notifyDraining) {
+    xSemaphoreGive(notifyLock);  // The draining context picks up what was just queued
+    return;
   }
+  notifyDraining = true;
+  // During an upload the BLE task only serves the uploader; observer copies go out from loop()
+  bool deferObservers = otaInProgress && peerCount > 1 && xTaskGetCurrentTaskHandle() != loopTaskHandle;
+  Peer* uploader = otaInProgress ? findPeer(uploaderConnId) : nullptr;
+  while (true) {
+    QueuedNotification* next = nullptr;
+    for (QueuedNotification& entry : notifyQueue) {
+      if (!entry.used || (deferObservers && entry.target == OTA_NOTIFY_OBSERVERS)) continue;
+      // Congestion holds a frame for its main recipient; congested observers just miss their copy
+      Peer* recipient = entry.target == OTA_NOTIFY_ALL ? uploader
+                      : entry.target == OTA_NOTIFY_OBSERVERS ? nullptr : findPeer(entry.target);
+      bool congested = recipient ? recipient->congested : false;
+      if (entry.target == OTA_NOTIFY_ALL && !uploader) {
+        for (Peer& peer : peers) congested |= peer.used && peer.congested;
+      }
+      if (congested) continue;
+      if (!next || entry.priority < next->priority ||
+          (entry.priority == next->priority && entry.order < next->order)) {
+        next = &entry;
+      }
+    }
+    if (!next || !clientConnected) break;
+    String text = next->text;
+    uint16_t target = next->target;
+    if (deferObservers && target == OTA_NOTIFY_ALL) {
+      next->target = OTA_NOTIFY_OBSERVERS;
+    } else {
+      next->used = false;
+    }
+    xSemaphoreGive(notifyLock);
+    deliverNotification(text, target, !deferObservers);
+    xSemaphoreTake(notifyLock, portMAX_DELAY);
+    notifyStats.sent++;
+  }
+  notifyDraining = false;
+  xSemaphoreGive(notifyLock);
+}
+
+// One send per recipient, uploader included; observers are timed for the fan-out cost
+void BLEOtaUpdate::deliverNotification(const String& text, uint16_t target, bool observers) {
+  OTA_TRACE(NOTIFY, text.length());
+  pStatusCharacteristic->setValue(text.c_str());  // What a read returns
+  for (Peer& peer : peers) {
+    if (!peer.used) continue;
+    bool observer = isObserver(peer.connId);
+    bool wanted = target == OTA_NOTIFY_ALL ? observers || !observer
+                : target == OTA_NOTIFY_OBSERVERS ? observer : peer.connId == target;
+    if (!wanted || !peer.statusNotify) continue;
+    if (observer && peer.congested) {
+      notifyStats.observerSkipped++;
+      continue;
+    }
+    uint32_t startUs = micros();
+    sendStatusFrames(peer.connId, text);
+    if (observer) {
+      notifyStats.observerFrames++;
+      notifyStats.observerSendUs += micros() - startUs;
+    }
+  }
+}
+
+// HELLO, MEM or BENCH replies can outgrow a 23-byte MTU; split them, preferably after a comma
+void BLEOtaUpdate::sendStatusFrames(uint16_t connId, const String& text) {
+  size_t limit = min<size_t>(pServer->getPeerMTU(connId) - 3, OTA_MAX_ATT_VALUE);
+  const char* data = text.c_str();
+  size_t remaining = text.length();
+  char frame[OTA_MAX_ATT_VALUE];
+  while (remaining > limit) {
+    size_t length = limit - 1;
+    for (size_t i = length; i > length / 2; i--) {
+      if (data[i - 1] == ',') {
+        length = i;
+        break;
+      }
+    }
+    memcpy(frame, data, length);
+    frame[length] = OTA_STATUS_CONTINUED;
+    esp_ble_gatts_send_indicate(pServer->getGattsIf(), connId, pStatusCharacteristic->getHandle(),
+                                length + 1, (uint8_t*)frame, false);
+    data += length;
+    remaining -= length;
+  }
+  esp_ble_gatts_send_indicate(pServer->getGattsIf(), connId, pStatusCharacteristic->getHandle(),
+                              remaining, (uint8_t*)data, false);
+}
+
+// Frames for a central that left; everything once the last one is gone
+void BLEOtaUpdate::clearNotifications(uint16_t connId) {
+  if (!notifyLock) return;
+  xSemaphoreTake(notifyLock, portMAX_DELAY);
+  for (QueuedNotification& entry : notifyQueue) {
+    if (entry.target == connId || peerCount == 0) {
+      entry.used = false;
+      entry.text = String();
+    }
+  }
+  xSemaphoreGive(notifyLock);
+}
+
+BLEOtaUpdate::Peer* BLEOtaUpdate::findPeer(uint16_t connId) {
+  for (Peer& peer : peers) {
+    if (peer.used && peer.connId == connId) return &peer;
+  }
+  return nullptr;
+}
+
+bool BLEOtaUpdate::isObserver(uint16_t connId) const {
+  return otaInProgress && uploaderConnId != OTA_NO_CONNECTION && connId != uploaderConnId;
+}
+
+// A new uploader: session statistics start from its connection
+void BLEOtaUpdate::claimUpload(uint16_t connId) {
+  uploaderConnId = connId;
+  memset(&sessionStats, 0, sizeof(sessionStats));
+  awaitingFirstData = true;
+  Peer* peer = findPeer(connId);
+  if (!peer) return;
+  memcpy(sessionStats.peerAddress, peer->address, sizeof(sessionStats.peerAddress));
+  sessionStats.peerBonded = peer->bonded;
+  sessionStats.connectedAtMs = peer->connectedAtMs;
+  sessionStats.connIntervalUnits = peer->connIntervalUnits;
 }
 
 BLEServer* BLEOtaUpdate::getBLEServer() {
@@ -226,25 +1075,127 @@ BLEServer* BLEOtaUpdate::getBLEServer() {
 
 // Loop method
 void BLEOtaUpdate::loop() {
-  // This method can be used for periodic tasks if needed
-  // Currently empty as all work is done in callbacks
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  // BLE uploads are handled in callbacks; the echo test, pull repairs, bulk reads and Wi-Fi need the loop
+#if BLE_OTA_COMMANDS
+  if (echoSamples && micros() - echoSentAtUs > OTA_ECHO_TIMEOUT_US) {
+    linkTestResult.rttLost++;
+    advanceEchoTest();
+  }
+#endif
+#if BLE_OTA_PULL
+  if (otaInProgress && !sessionHeld && (sessionStats.features & OTA_FEATURE_PULL) &&
+      millis() - pullActivityMs > OTA_PULL_RETRY_MS) {
+    // Backstop for a gap the write path could not see (the re-request or its first write lost)
+    xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+    if (otaInProgress && !sessionHeld && otaReceived < otaFileSize && millis() - pullActivityMs > OTA_PULL_RETRY_MS) {
+      OTA_LOG("[OTA] No data for %u ms, re-requesting from %u\n", OTA_PULL_RETRY_MS, otaReceived);
+      repairPull();
+    }
+    xSemaphoreGiveRecursive(sessionLock);
+  }
+#endif
+  if (sessionHeld && millis() - heldAtMs > OTA_RESUME_HOLD_MS) {
+    // The client did not come back: end the session as an unheld disconnect would have
+    xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+    if (sessionHeld && millis() - heldAtMs > OTA_RESUME_HOLD_MS) {
+      OTA_LOGLN("[OTA] ERROR: Client did not resume the held session");
+      sessionHeld = false;
+      abortUpdate();
+    }
+    xSemaphoreGiveRecursive(sessionLock);
+  }
+#if BLE_OTA_COMMANDS && BLE_OTA_BENCHMARK
+  if (benchConnId != OTA_NO_CONNECTION) {
+    uint16_t target = benchConnId;
+    benchConnId = OTA_NO_CONNECTION;
+    sendBenchmark(target);
+  }
+#endif
+#if BLE_OTA_BULK_READ
+  serviceBulkRead();
+#endif
+#if BLE_OTA_COMMANDS
+  serviceTraceDump();
+#endif
+  serviceWifiDataPath();
+  flushNotifications();
 }
 
 // Internal methods
-void BLEOtaUpdate::handleOtaWrite(BLECharacteristic* pCharacteristic) {
-  String bleValue = pCharacteristic->getValue();
-  const uint8_t* data = (const uint8_t*)bleValue.c_str(); // Pointer to internal buffer
-  size_t length = bleValue.length();
+void BLEOtaUpdate::handleOtaWrite(BLECharacteristic* pCharacteristic, uint16_t connId) {
+  xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+  processOtaWrite(pCharacteristic, connId);
+  xSemaphoreGiveRecursive(sessionLock);
+}
+
+void BLEOtaUpdate::processOtaWrite(BLECharacteristic* pCharacteristic, uint16_t connId) {
+  // One uploader at a time; the other centrals only watch
+#if BLE_OTA_BULK_READ
+  bool reading = readActive;
+#else
+  bool reading = false;
+#endif
+  // A held session waits for a HELLO, which resumes or replaces it
+  if (sessionHeld && !reading && pCharacteristic->getLength() >= OTA_HELLO_SIZE &&
+      memcmp(pCharacteristic->getData(), OTA_CMD_HELLO, 5) == 0) {
+    resumeHeldSession(connId, pCharacteristic->getData(), pCharacteristic->getLength());
+    return;
+  }
+  // A bulk read has the OTA characteristic until it ends
+  if ((otaInProgress && connId != uploaderConnId) || reading) {
+    sessionStats.refusedWrites++;
+    sendStatusTo(connId, "BUSY", OtaNotifyPriority::ERROR);
+    return;
+  }
+  if (connId != uploaderConnId) claimUpload(connId);
+
+  // Read the characteristic's own buffer: an executed long write was reassembled there by
+  // BLECharacteristic, and it goes through the same command parsing as any other write
+  const uint8_t* data = pCharacteristic->getData();
+  size_t length = pCharacteristic->getLength();
+  OTA_TRACE(GATT_WRITE, length);
 
   if (length == 0) return;
 
+  if (longWritePending) {
+    longWritePending = false;
+    if (length > maxPacketSize) {
+      OTA_LOG("[OTA] ERROR: Long write exceeds %u bytes\n", (unsigned)maxPacketSize);
+      if (otaInProgress) {
+        setOtaStatus(OtaStatus::ERROR, "Long write too large");
+        flashAbort();
+        otaInProgress = false;
+      }
+      return;
+    }
+    if (otaInProgress && otaFileSize > 0) sessionStats.longWrites++;
+  }
+
+  if (awaitingFirstData) {
+    awaitingFirstData = false;
+    sessionStats.connectToFirstDataMs = millis() - sessionStats.connectedAtMs;
+    OTA_LOG("[BLE] Connect-to-first-data: %u ms (%s)\n", sessionStats.connectToFirstDataMs,
+            sessionStats.peerBonded ? "bonded" : "not bonded");
+  }
+
   // Handle OTA commands
+  if (!otaInProgress && length >= OTA_HELLO_SIZE && memcmp(data, OTA_CMD_HELLO, 5) == 0) {
+    handleHello(data, length);
+    return;
+  }
+
   if (!otaInProgress && length == 4) {
     if (memcmp(data, OTA_CMD_OPEN, 4) == 0) {
-      Serial.println("[OTA] Update started");
-      otaInProgress = true;
-      otaFileSize = 0;
-      otaReceived = 0;
+#if BLE_OTA_ENCRYPTION
+      if (encryptionKeyBits) {
+        // Legacy sessions cannot carry an IV
+        setOtaStatus(OtaStatus::ERROR, "Encryption required");
+        return;
+      }
+#endif
+      OTA_LOGLN("[OTA] Update started");
+      startSession(0, 0);
       setOtaStatus(OtaStatus::RECEIVING, "Update started");
       return;
     }
@@ -257,41 +1208,77 @@ if (otaInProgress) {
     if (otaFileSize == 0 && length == 4) {
       // Direct copy works here because both are little-endian systems.
       // otaFileSize should be a uint32_t or unsigned long
-      memcpy(&otaFileSize, data, 4);
-
-      Serial.printf("[OTA] Update size: %u bytes (0x%X)\n", otaFileSize, otaFileSize);
-
-      if (!Update.begin(otaFileSize)) {
-        
-        Serial.printf("[OTA] ERROR: Not enough space for %u bytes\n", otaFileSize);
-        setOtaStatus(OtaStatus::ERROR, "Not enough space");
-        otaInProgress = false;
-        ESP.restart();
-        return;
-      }
-      setOtaStatus(OtaStatus::RECEIVING, "Receiving firmware");
+      uint32_t size;
+      memcpy(&size, data, 4);
+      beginUpdate(size);
       return; // Return after handling file size
     }
 
 
+#if BLE_OTA_SIGNATURE
+    // Signature: only accepted once the whole image is in, so it cannot be mistaken for data
+    if (length == OTA_SIG_CMD_SIZE && otaFileSize > 0 && otaReceived == otaFileSize &&
+        memcmp(data, OTA_CMD_SIG, 3) == 0) {
+      memcpy(imageSignature, data + 3, OTA_SIGNATURE_SIZE);
+      signatureReceived = true;
+      return;
+    }
+#endif
+
     // Handle DONE command
     if (length == 4 && memcmp(data, OTA_CMD_DONE, 4) == 0) {
-      Serial.println("[OTA] Finalizing update...");
+      OTA_LOGLN("[OTA] Finalizing update...");
+      OTA_LOG("[OTA] Transfer: %u bytes in %u ms (%u long writes, CRC32 %08X)\n",
+              otaReceived, sessionStats.transferMs, sessionStats.longWrites, sessionStats.crc32);
+      OTA_LOG("[OTA] Notifications: %u sent, %u coalesced, dropped %u/%u/%u/%u (error/control/progress/app), "
+              "%u congestion events\n", notifyStats.sent, notifyStats.coalesced, notifyStats.dropped[0],
+              notifyStats.dropped[1], notifyStats.dropped[2], notifyStats.dropped[3], notifyStats.congestionEvents);
+      if (notifyStats.observerFrames) {
+        OTA_LOG("[OTA] Observers: %u frames at %u us each, %u skipped while congested, %u writes refused\n",
+                notifyStats.observerFrames, notifyStats.observerSendUs / notifyStats.observerFrames,
+                notifyStats.observerSkipped, sessionStats.refusedWrites);
+      }
+      releaseImageCipher();
+      releaseMerkleBlock();
+      releaseInflate();
+#if BLE_OTA_TUNING
+      if (autoTuning) savePeerTuning();
+#endif
       
+      if (sessionStats.features & OTA_FEATURE_SINK) {
+        finishLinkTest();
+        return;
+      }
+      
+      // Each outcome is reported with sendDoneReply(); the delay lets it leave before the reboot
       if (otaReceived != otaFileSize) {
-        Serial.printf("[OTA] ERROR: Size mismatch! (%u/%u)\n", otaReceived, otaFileSize);
+        OTA_LOG("[OTA] ERROR: Size mismatch! (%u/%u)\n", otaReceived, otaFileSize);
         setOtaStatus(OtaStatus::ERROR, "Size mismatch");
-        Update.end(false);
+        flashAbort();
+        sendDoneReply("size");
+        delay(1000);
         ESP.restart();
-      } else if (Update.end(true)) {
-        Serial.println("[OTA] Success. Rebooting...");
+#if BLE_OTA_SIGNATURE
+      } else if (signingKeySet && !verifyImageSignature()) {
+        // Nothing was committed: the boot partition still points at the running image
+        setOtaStatus(OtaStatus::ERROR, signatureReceived ? "Signature invalid" : "Signature missing");
+        flashAbort();
+        sendDoneReply("signature");
+        delay(1000);
+        ESP.restart();
+#endif
+      } else if (commitSession()) {
+        OTA_LOGLN("[OTA] Success. Rebooting...");
         setOtaStatus(OtaStatus::COMPLETED, "Update completed successfully");
+        sendDoneReply(nullptr);
         delay(1000);
         ESP.restart();
       } else {
-        Serial.println("[OTA] Finalize failed");
+        OTA_LOGLN("[OTA] Finalize failed");
         setOtaStatus(OtaStatus::ERROR, "Update finalization failed");
-        Update.printError(Serial);
+        if (!sectorSinkSession) Update.printError(Serial);
+        sendDoneReply("finalize");
+        delay(1000);
         ESP.restart();
       }
       otaInProgress = false;
@@ -300,99 +1287,2137 @@ if (otaInProgress) {
 
     // Handle ABORT command
     if (length == 5 && memcmp(data, OTA_CMD_ABORT, 5) == 0) {
-      Serial.println("[OTA] Update aborted by client");
+      OTA_LOGLN("[OTA] Update aborted by client");
       abortUpdate();
       return;
     }
 
+#if BLE_OTA_WIFI
+    // While an HTTP body is streaming, loop() owns the write offset
+    if (wifiHeadDone && wifiBodyRemaining > 0) return;
+#endif
+
     // Handle firmware data
     if (otaReceived < otaFileSize) {
-      size_t written = Update.write((uint8_t*)data, length);
-      delay(1);
-      if (written > 0) {
-        otaReceived += written;
-        updateProgress();
-      } else {
-        Serial.println("[OTA] ERROR: Write failed");
-        setOtaStatus(OtaStatus::ERROR, "Write failed");
-        otaInProgress = false;
-      }
+      acceptFirmwareData(data, length);
     }
   }
 }
 
-void BLEOtaUpdate::handleCommandWrite(BLECharacteristic* pCharacteristic) {
-  std::string value = pCharacteristic->getValue().c_str();
-  if (commandCallback && value.length() > 0) {
-    String command = String(value.c_str());
-    commandCallback(command);
+void BLEOtaUpdate::startSession(uint8_t protocolVersion, uint32_t features) {
+  otaInProgress = true;
+  otaFileSize = 0;
+  otaReceived = 0;
+  lastAckOffset = 0;
+  sessionStats.protocolVersion = protocolVersion;
+  sessionStats.features = features;
+  sessionStats.negotiatedMtu = pServer->getPeerMTU(uploaderConnId);
+  sessionStats.setupMs = 0;
+  sessionStats.transferMs = 0;
+  sessionStats.longWrites = 0;
+  sessionStats.crc32 = 0;
+  sessionStats.peakBytesPerSec = 0;
+  sessionStats.stalls = 0;
+  sessionStats.tuningFromCache = false;
+  sessionStats.tuneStepCount = 0;
+  sessionStats.verifyUs = 0;
+  sessionStats.signatureValid = false;
+  sessionStats.blocksRejected = 0;
+  sessionStats.sectorsWritten = 0;
+  sessionStats.sectorsSkipped = 0;
+  sessionStats.sectorWriteUs = 0;
+  sessionStats.sectorCompareUs = 0;
+  sessionStats.pullRequests = 0;
+  sessionStats.pullRepairs = 0;
+  sessionStats.pullDroppedBytes = 0;
+  sessionStats.refusedWrites = 0;
+#if BLE_OTA_PULL
+  pullRequested = 0;
+  pullRepairedAt = UINT32_MAX;
+#endif
+  sessionHeld = false;
+#if BLE_OTA_BUNDLES
+  bundleSession = features & OTA_FEATURE_BUNDLE;
+  bundleManifestFill = 0;
+  bundleCount = 0;
+  bundleItem = 0;
+#endif
+  releaseImageCipher();
+  releaseMerkleBlock();
+  releaseInflate();
+#if BLE_OTA_SIGNATURE
+  signatureReceived = false;
+  if (signingKeySet) {
+    mbedtls_sha256_free(&imageDigest);
+    mbedtls_sha256_init(&imageDigest);
+    mbedtls_sha256_starts(&imageDigest, 0);
   }
+#endif
+  setupStartedAtMs = millis();
+  sessionStartTime = time(nullptr);
+  sessionWindow = flowControlWindow;
+  sessionRecordPending = true;
+  memoryReport.largestBlockBeforeSession = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
 }
 
-void BLEOtaUpdate::onClientConnect() {
-  clientConnected = true;
-  Serial.println("[BLE] Client connected");
-  if (connectionCallback) {
-    connectionCallback(true);
+void BLEOtaUpdate::handleHello(const uint8_t* data, size_t length) {
+  uint8_t version = data[5];
+  uint32_t size;
+  uint32_t features;
+  memcpy(&size, data + 6, 4);
+  memcpy(&features, data + 10, 4);
+
+  OTA_LOG("[OTA] Update started (HELLO v%u, features 0x%X)\n", version, features);
+  startSession(min<uint8_t>(version, OTA_PROTOCOL_VERSION), features & OTA_FEATURES_SUPPORTED);
+
+  // Optional fields follow the fixed HELLO in feature order: IV, then Merkle root
+  size_t extra = OTA_HELLO_SIZE;
+  const uint8_t* iv = nullptr;
+  if (features & OTA_FEATURE_ENCRYPTED) {
+    iv = length >= extra + OTA_ENCRYPTION_IV_SIZE ? data + extra : nullptr;
+    extra += OTA_ENCRYPTION_IV_SIZE;
+  }
+  if (features & OTA_FEATURE_MERKLE) {
+    if (!startMerkleBlock(length >= extra + 32 ? data + extra : nullptr)) {
+      OTA_LOGLN("[OTA] ERROR: Merkle root missing, no memory for a block or built without BLE_OTA_MERKLE");
+      sendStatusTo(uploaderConnId, "HELLO:error=merkle", OtaNotifyPriority::ERROR);
+      setOtaStatus(OtaStatus::ERROR, "Merkle setup failed");
+      otaInProgress = false;
+      return;
+    }
   }
-  sendStatus("Connected");
-}
 
-void BLEOtaUpdate::onClientDisconnect() {
-  clientConnected = false;
-  if (otaInProgress) {
-    Serial.println("[OTA] ERROR: Client disconnected during update");
-    abortUpdate();
+  // Pull offsets are image offsets; Merkle PATHs and zblk SEEKs have their own resend mechanism
+  if ((features & OTA_FEATURE_PULL) &&
+      (!BLE_OTA_PULL || (features & (OTA_FEATURE_MERKLE | OTA_FEATURE_COMPRESSED)))) {
+    OTA_LOGLN("[OTA] ERROR: Pull mode does not combine with Merkle or zblk sessions, or built without BLE_OTA_PULL");
+    sendStatusTo(uploaderConnId, "HELLO:error=pull", OtaNotifyPriority::ERROR);
+    setOtaStatus(OtaStatus::ERROR, "Pull mode not available");
+    otaInProgress = false;
+    return;
   }
-  Serial.println("[BLE] Client disconnected. Re-advertising...");
-  if (connectionCallback) {
-    connectionCallback(false);
+
+  // Decoded blocks take the plain data path, so zblk does not combine with ciphertext or Merkle leaves
+  if ((features & OTA_FEATURE_COMPRESSED) &&
+      ((features & (OTA_FEATURE_ENCRYPTED | OTA_FEATURE_MERKLE)) || !startInflate())) {
+    OTA_LOGLN("[OTA] ERROR: zblk not available for this session (ROM inflate, memory or features)");
+    sendStatusTo(uploaderConnId, "HELLO:error=codec", OtaNotifyPriority::ERROR);
+    setOtaStatus(OtaStatus::ERROR, "Codec not available");
+    otaInProgress = false;
+    return;
   }
-  BLEDevice::startAdvertising();
-}
 
-void BLEOtaUpdate::updateProgress() {
-  uint8_t percentage = getUpdatePercentage();
-  Serial.printf("[OTA] Progress: %d%% (%u/%u)\r", percentage, otaReceived, otaFileSize);
-  
-  if (progressCallback) {
-    progressCallback(otaReceived, otaFileSize, percentage);
+  if ((features & OTA_FEATURE_BUNDLE) && !BLE_OTA_BUNDLES) {
+    OTA_LOGLN("[OTA] ERROR: Built without BLE_OTA_BUNDLES");
+    sendStatusTo(uploaderConnId, "HELLO:error=bundle", OtaNotifyPriority::ERROR);
+    setOtaStatus(OtaStatus::ERROR, "Bundles not available");
+    otaInProgress = false;
+    return;
   }
-  
-  sendProgress(otaReceived, otaFileSize);
-}
 
-void BLEOtaUpdate::setOtaStatus(OtaStatus status, const char* message) {
-  otaStatus = status;
-  if (statusCallback) {
-    statusCallback(status, message);
+  // Encrypted images need the device key and the IV
+  bool encrypted = features & OTA_FEATURE_ENCRYPTED;
+#if BLE_OTA_ENCRYPTION
+  bool keySet = encryptionKeyBits != 0;
+#else
+  bool keySet = false;
+#endif
+  if (encrypted != keySet || (encrypted && !startImageCipher(iv))) {
+    OTA_LOGLN("[OTA] ERROR: Encryption mismatch (device key, feature flag or IV)");
+    sendStatusTo(uploaderConnId, "HELLO:error=encryption", OtaNotifyPriority::ERROR);
+    setOtaStatus(OtaStatus::ERROR, "Encryption mismatch");
+    otaInProgress = false;
+    return;
   }
-  if (message) {
-    Serial.printf("[OTA Status] %s\n", message);
+#if BLE_OTA_TUNING
+  if (autoTuning) loadPeerTuning();
+#endif
+  sessionWindow = max<size_t>(sessionWindow, minimumWindow());
+
+  if (!beginUpdate(size)) return;
+  // In pull sessions REQ replaces ACK
+  if (sessionStats.features & OTA_FEATURE_PULL) {
+    sessionStats.features &= ~OTA_FEATURE_FLOW_CONTROL;
   }
-}
 
-// BLE Callback Classes Implementation
-void BLEOtaUpdate::ServerCallbacks::onConnect(BLEServer* pServer) {
-  if (instance) {
-    instance->onClientConnect();
+  if ((sessionStats.features & OTA_FEATURE_WIFI) && !offerWifiDataPath()) {
+    sessionStats.features &= ~OTA_FEATURE_WIFI;
   }
+  sendHelloReply();
 }
 
-void BLEOtaUpdate::ServerCallbacks::onDisconnect(BLEServer* pServer) {
-  if (instance) {
-    instance->onClientDisconnect();
+// Everything the client needs to pace the transfer, in one notification
+void BLEOtaUpdate::sendHelloReply() {
+  String reply = "HELLO:v=" + String(sessionStats.protocolVersion);
+  reply += ",mtu=" + String(sessionStats.negotiatedMtu);
+  reply += ",chunk=" + String(min<size_t>(sessionStats.negotiatedMtu - 3, maxPacketSize));
+  reply += ",window=" + String(sessionWindow);
+  reply += ",buf=" + String(updateBufferSize);
+  reply += ",feat=0x" + String(sessionStats.features, HEX);
+  if (sessionStats.features & OTA_FEATURE_LONG_WRITE) {
+    reply += ",lw=" + String(maxPacketSize);
+  }
+  if (sessionBlockSize()) {
+    reply += ",blk=" + String(sessionBlockSize());
+  }
+#ifdef OTA_HAS_ROM_MINIZ
+  reply += ",codecs=raw,zblk";
+#else
+  reply += ",codecs=raw";
+#endif
+#if BLE_OTA_SIGNATURE
+  if (signingKeySet) {
+    reply += ",sig=p256";
+  }
+#endif
+  reply += ",slot=" + String(ESP.getFreeSketchSpace());
+  if (sessionStats.features & OTA_FEATURE_RESUME) {
+    reply += ",resume=" + String(otaReceived);
   }
+  sendStatusTo(uploaderConnId, reply, OtaNotifyPriority::CONTROL);
+#if BLE_OTA_PULL
+  if (sessionStats.features & OTA_FEATURE_PULL) {
+    requestNextRange();
+  }
+#endif
 }
 
-void BLEOtaUpdate::OtaCharacteristicCallbacks::onWrite(BLECharacteristic* pCharacteristic) {
-  if (instance) {
-    instance->handleOtaWrite(pCharacteristic);
+// The link dropped mid-transfer. Everything up to the last whole block stays: Update or the sector
+// sink, the cipher and the signature digest continue from there once the client is back. The
+// block in progress is dropped and the client resends it from its start
+void BLEOtaUpdate::holdSession() {
+  sessionHeld = true;
+  heldAtMs = millis();
+  longWritePending = false;
+#if BLE_OTA_MERKLE
+  merkleFill = 0;
+  merklePathLength = 0;
+#endif
+#if BLE_OTA_COMPRESSION
+  frameFill = 0;
+  frameSeeking = false;
+#endif
+  OTA_LOG("[OTA] Link lost at %u bytes, holding the session for %u ms\n", otaReceived, OTA_RESUME_HOLD_MS);
+}
+
+// A HELLO while a session is held: the same image continues, anything else starts over
+void BLEOtaUpdate::resumeHeldSession(uint16_t connId, const uint8_t* data, size_t length) {
+  uint32_t size;
+  uint32_t features;
+  memcpy(&size, data + 6, 4);
+  memcpy(&features, data + 10, 4);
+  sessionHeld = false;
+  if (!(features & OTA_FEATURE_RESUME) || size != otaFileSize ||
+      (features & OTA_RESUME_MATCH) != (sessionStats.features & OTA_RESUME_MATCH)) {
+    OTA_LOGLN("[OTA] Held session replaced by a new HELLO");
+    recordSession(OtaStatus::ABORTED);
+    flashAbort();
+    otaInProgress = false;
+    claimUpload(connId);
+    handleHello(data, length);
+    return;
   }
+
+  // Same session, new link: the statistics carry on, the link parameters are the new ones
+  uploaderConnId = connId;
+  sessionStats.negotiatedMtu = pServer->getPeerMTU(connId);
+  Peer* peer = findPeer(connId);
+  if (peer) sessionStats.connIntervalUnits = peer->connIntervalUnits;
+  lastAckOffset = otaReceived;
+#if BLE_OTA_PULL
+  pullRequested = otaReceived;
+#endif
+  OTA_LOG("[OTA] Session resumed at %u bytes after %u ms\n", otaReceived, millis() - heldAtMs);
+  sendHelloReply();
 }
 
-void BLEOtaUpdate::CommandCharacteristicCallbacks::onWrite(BLECharacteristic* pCharacteristic) {
-  if (instance) {
-    instance->handleCommandWrite(pCharacteristic);
+// DONE:ok or DONE:error=<reason>, plus the byte count and CRC-32 of the data as received
+// (ciphertext for encrypted sessions, inflated data for zblk) for the client to compare
+void BLEOtaUpdate::sendDoneReply(const char* error) {
+  String reply = error ? "DONE:error=" + String(error) : String("DONE:ok");
+  reply += ",bytes=" + String(otaReceived);
+  reply += ",crc=0x" + String(sessionStats.crc32, HEX);
+  sendStatusTo(uploaderConnId, reply, error ? OtaNotifyPriority::ERROR : OtaNotifyPriority::CONTROL);
+}
+
+bool BLEOtaUpdate::beginUpdate(uint32_t size) {
+  otaFileSize = size;
+  OTA_TRACE(SESSION_BEGIN, size);
+  OTA_LOG("[OTA] Update size: %u bytes (0x%X)\n", otaFileSize, otaFileSize);
+
+  // Link test sessions never touch flash
+  if (sessionStats.features & OTA_FEATURE_SINK) {
+    setOtaStatus(OtaStatus::RECEIVING, "Link test started");
+    return true;
+  }
+
+#if BLE_OTA_BUNDLES
+  // Bundles open each target when its payload starts
+  if (bundleSession) {
+    setOtaStatus(OtaStatus::RECEIVING, "Receiving bundle");
+    return true;
   }
-}
\ No newline at end of file
+#endif
+
+  if (!flashBegin(otaFileSize)) {
+    OTA_LOG("[OTA] ERROR: Not enough space for %u bytes\n", otaFileSize);
+    setOtaStatus(OtaStatus::ERROR, "Not enough space");
+    otaInProgress = false;
+    ESP.restart();
+    return false;
+  }
+  setOtaStatus(OtaStatus::RECEIVING, "Receiving firmware");
+  return true;
+}
+
+void BLEOtaUpdate::writeFirmwareData(const uint8_t* data, size_t length) {
+  uint32_t now = millis();
+  if (sessionStats.setupMs == 0) {
+    firstDataAtMs = now;
+    lastDataAtMs = now;
+    peakWindowStartMs = now;
+    peakWindowStartOffset = otaReceived;
+    sessionStats.setupMs = firstDataAtMs - setupStartedAtMs;
+    OTA_LOG("[OTA] Session setup: %u ms\n", sessionStats.setupMs);
+  }
+  if (now - lastDataAtMs > OTA_STALL_THRESHOLD_MS) {
+    sessionStats.stalls++;
+  }
+  lastDataAtMs = now;
+
+  bool sink = sessionStats.features & OTA_FEATURE_SINK;
+  // Encrypted sessions: decrypt into the session buffer (AES peripheral when available)
+  const uint8_t* image = data;
+#if BLE_OTA_ENCRYPTION
+  if (plainBuffer) {
+    if (length > plainBufferSize) {
+      OTA_LOG("[OTA] ERROR: Encrypted write exceeds %u bytes\n", (unsigned)plainBufferSize);
+      setOtaStatus(OtaStatus::ERROR, "Write too large");
+      flashAbort();
+      otaInProgress = false;
+      return;
+    }
+    mbedtls_aes_crypt_ctr(&imageCipher, length, &cipherOffset, cipherCounter, cipherStream, data, plainBuffer);
+    image = plainBuffer;
+  }
+#endif
+  OTA_TRACE(FLASH_WRITE_BEGIN, otaReceived);
+#if BLE_OTA_BUNDLES
+  size_t written = sink ? length : bundleSession ? bundleWrite(image, length) : flashWrite(image, length);
+#else
+  size_t written = sink ? length : flashWrite(image, length);
+#endif
+  OTA_TRACE(FLASH_WRITE_END, otaReceived);
+#if BLE_OTA_SIGNATURE
+  if (signingKeySet && !sink && written > 0) {
+    mbedtls_sha256_update(&imageDigest, image, written);  // SHA accelerator when available
+  }
+#endif
+  // Update (or the sector sink) erases and programs a sector whenever its buffer fills
+  if (!sink && (otaReceived % SPI_FLASH_SEC_SIZE) + written >= SPI_FLASH_SEC_SIZE) {
+    OTA_TRACE(BUFFER_FLUSH, (otaReceived + written) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE - SPI_FLASH_SEC_SIZE);
+  }
+  if (!sink) delay(1);
+  if (written > 0) {
+    sessionStats.crc32 = esp_rom_crc32_le(sessionStats.crc32, data, written);
+    otaReceived += written;
+    sessionStats.transferMs = now - firstDataAtMs;
+    if (now - peakWindowStartMs >= 1000) {
+      uint32_t bps = (uint64_t)(otaReceived - peakWindowStartOffset) * 1000 / (now - peakWindowStartMs);
+      sessionStats.peakBytesPerSec = max(sessionStats.peakBytesPerSec, bps);
+      peakWindowStartMs = now;
+      peakWindowStartOffset = otaReceived;
+    }
+    updateProgress();
+
+    // Flow control: acknowledge every half window so the client never stalls
+    if ((sessionStats.features & OTA_FEATURE_FLOW_CONTROL) &&
+        (otaReceived - lastAckOffset >= sessionWindow / 2 || otaReceived == otaFileSize)) {
+      lastAckOffset = otaReceived;
+      sendStatusTo(uploaderConnId, "ACK:" + String(otaReceived), OtaNotifyPriority::CONTROL);
+    }
+
+#if BLE_OTA_TUNING
+    if (autoTuning && (sessionStats.features & OTA_FEATURE_FLOW_CONTROL) &&
+        otaReceived - tunePeriodStartOffset >= OTA_TUNE_PERIOD_BYTES) {
+      tuneFlowControl();
+    }
+#endif
+  } else {
+    OTA_LOGLN("[OTA] ERROR: Write failed");
+    setOtaStatus(OtaStatus::ERROR, "Write failed");
+    otaInProgress = false;
+  }
+}
+
+void BLEOtaUpdate::acceptFirmwareData(const uint8_t* data, size_t length) {
+#if BLE_OTA_PULL
+  if (sessionStats.features & OTA_FEATURE_PULL) {
+    acceptPulledData(data, length);
+    return;
+  }
+#endif
+#if BLE_OTA_COMPRESSION
+  if (frameBuffer) {
+    inflateFirmwareData(data, length);
+    return;
+  }
+#endif
+#if BLE_OTA_MERKLE
+  if (merkleBlock) {
+    acceptMerkleData(data, length);
+    return;
+  }
+#endif
+  writeFirmwareData(data, length);
+}
+
+#if BLE_OTA_MERKLE
+bool BLEOtaUpdate::startMerkleBlock(const uint8_t* root) {
+  merkleBlock = root ? (uint8_t*)malloc(OTA_MERKLE_BLOCK_SIZE) : nullptr;
+  if (!merkleBlock) return false;
+  memcpy(merkleRoot, root, sizeof(merkleRoot));
+  noteBufferHeap();
+  return true;
+}
+
+void BLEOtaUpdate::acceptMerkleData(const uint8_t* data, size_t length) {
+  // Every block starts with its PATH; anything else is data of a rejected block in flight
+  if (merklePathLength == 0) {
+    if (length < 8 || memcmp(data, OTA_CMD_PATH, 4) != 0 || (length - 8) % 32 != 0 ||
+        length - 8 > sizeof(merklePath)) {
+      return;
+    }
+    uint32_t index;
+    memcpy(&index, data + 4, 4);
+    if (index != otaReceived / OTA_MERKLE_BLOCK_SIZE) {
+      rejectMerkleBlock();
+      return;
+    }
+    memcpy(merklePath, data + 8, length - 8);
+    merklePathLength = length - 8;
+    return;
+  }
+
+  // Writes must not straddle blocks; the last block may be short
+  size_t blockLength = min<size_t>(OTA_MERKLE_BLOCK_SIZE, otaFileSize - otaReceived);
+  if (merkleFill + length > blockLength) {
+    rejectMerkleBlock();
+    return;
+  }
+  memcpy(merkleBlock + merkleFill, data, length);
+  merkleFill += length;
+  if (merkleFill < blockLength) return;
+
+  if (!verifyMerkleBlock(blockLength)) {
+    rejectMerkleBlock();
+    return;
+  }
+  merkleFill = 0;
+  merklePathLength = 0;
+  writeFirmwareData(merkleBlock, blockLength);
+}
+#else
+bool BLEOtaUpdate::startMerkleBlock(const uint8_t* root) {
+  return false;
+}
+#endif
+
+#if BLE_OTA_PULL
+// Pull sessions: only the next expected bytes of a requested range are written
+void BLEOtaUpdate::acceptPulledData(const uint8_t* data, size_t length) {
+  uint32_t offset;
+  if (length <= OTA_PULL_OFFSET_SIZE) return;
+  memcpy(&offset, data, OTA_PULL_OFFSET_SIZE);
+  length -= OTA_PULL_OFFSET_SIZE;
+  if (offset != otaReceived || length > pullRequested - otaReceived) {
+    sessionStats.pullDroppedBytes += length;  // Stale data from before a re-request
+    if (offset > otaReceived && offset < pullRequested && pullRepairedAt != otaReceived) {
+      // A write went missing: ask again from the gap now instead of waiting for the timer
+      pullRepairedAt = otaReceived;
+      repairPull();
+    }
+    return;
+  }
+  writeFirmwareData(data + OTA_PULL_OFFSET_SIZE, length);
+  if (otaInProgress) requestNextRange();
+}
+
+// Rewind the requests to the first missing byte; the client drops its queue and resumes there
+void BLEOtaUpdate::repairPull() {
+  sessionStats.pullRepairs++;
+  pullRequested = otaReceived;
+  requestNextRange();
+}
+
+// Keep about one window requested ahead of what has been written; flash stalls simply delay the next REQ
+void BLEOtaUpdate::requestNextRange() {
+  pullActivityMs = millis();
+  pullRequested = max(pullRequested, otaReceived);
+  if (otaReceived == otaFileSize) {
+    sendStatusTo(uploaderConnId, "REQ:" + String(otaFileSize) + ",0", OtaNotifyPriority::CONTROL);
+    return;
+  }
+  if (pullRequested - otaReceived > sessionWindow / 2 || pullRequested >= otaFileSize) return;
+  uint32_t length = min<uint32_t>(sessionWindow - (pullRequested - otaReceived), otaFileSize - pullRequested);
+  sessionStats.pullRequests++;
+  sendStatusTo(uploaderConnId, "REQ:" + String(pullRequested) + "," + String(length), OtaNotifyPriority::CONTROL);
+  pullRequested += length;
+}
+#endif
+
+#if BLE_OTA_MERKLE
+bool BLEOtaUpdate::verifyMerkleBlock(size_t length) {
+  uint8_t hash[32];
+  merkleLeafHash(merkleBlock, length, hash);
+
+  uint32_t index = otaReceived / OTA_MERKLE_BLOCK_SIZE;
+  uint32_t count = (otaFileSize + OTA_MERKLE_BLOCK_SIZE - 1) / OTA_MERKLE_BLOCK_SIZE;
+  size_t used = 0;
+  while (count > 1) {
+    if (index % 2 == 1 || index + 1 < count) {
+      if (used + 32 > merklePathLength) return false;
+      const uint8_t* sibling = merklePath + used;
+      if (index % 2 == 1) {
+        merkleNodeHash(sibling, hash, hash);
+      } else {
+        merkleNodeHash(hash, sibling, hash);
+      }
+      used += 32;
+    }
+    index /= 2;
+    count = (count + 1) / 2;
+  }
+  return used == merklePathLength && memcmp(hash, merkleRoot, sizeof(hash)) == 0;
+}
+#endif
+
+// Block size of a Merkle or zblk session, 0 for sessions that take data write by write
+size_t BLEOtaUpdate::sessionBlockSize() const {
+#if BLE_OTA_MERKLE
+  if (merkleBlock) return OTA_MERKLE_BLOCK_SIZE;
+#endif
+#if BLE_OTA_COMPRESSION
+  if (frameBuffer) return OTA_ZBLK_BLOCK_SIZE;
+#endif
+  return 0;
+}
+
+// Merkle and zblk sessions only ACK whole blocks, so the window must hold at least two of them
+uint32_t BLEOtaUpdate::minimumWindow() const {
+  return sessionBlockSize() ? 2 * sessionBlockSize() : OTA_TUNE_MIN_WINDOW;
+}
+
+#if BLE_OTA_MERKLE
+void BLEOtaUpdate::rejectMerkleBlock() {
+  uint32_t index = otaReceived / OTA_MERKLE_BLOCK_SIZE;
+  sessionStats.blocksRejected++;
+  merkleFill = 0;
+  merklePathLength = 0;
+  OTA_LOG("[OTA] Block %u rejected, re-requesting\n", index);
+  sendStatusTo(uploaderConnId, "NAK:" + String(index), OtaNotifyPriority::CONTROL);
+}
+#endif
+
+void BLEOtaUpdate::releaseMerkleBlock() {
+#if BLE_OTA_MERKLE
+  free(merkleBlock);
+  merkleBlock = nullptr;
+  merkleFill = 0;
+  merklePathLength = 0;
+#endif
+}
+
+bool BLEOtaUpdate::startInflate() {
+#ifdef OTA_HAS_ROM_MINIZ
+  inflator = malloc(sizeof(tinfl_decompressor));
+  frameBuffer = (uint8_t*)malloc(OTA_ZBLK_FRAME_HEADER + OTA_ZBLK_BLOCK_SIZE);
+  inflateBuffer = (uint8_t*)malloc(OTA_ZBLK_BLOCK_SIZE);
+  frameFill = 0;
+  frameSeeking = false;
+  if (inflator && frameBuffer && inflateBuffer) {
+    noteBufferHeap();
+    return true;
+  }
+  releaseInflate();
+#endif
+  return false;
+}
+
+#if BLE_OTA_COMPRESSION
+// Frames may be split across writes in any way; each one is decoded and written once complete
+void BLEOtaUpdate::inflateFirmwareData(const uint8_t* data, size_t length) {
+  if (frameSeeking) {
+    uint32_t index;
+    if (length != 8 || memcmp(data, OTA_CMD_SEEK, 4) != 0) return;
+    memcpy(&index, data + 4, 4);
+    frameSeeking = index != otaReceived / OTA_ZBLK_BLOCK_SIZE;
+    return;
+  }
+
+  while (length > 0 && otaInProgress && otaReceived < otaFileSize) {
+    size_t frameSize = OTA_ZBLK_FRAME_HEADER;
+    if (frameFill >= OTA_ZBLK_FRAME_HEADER) {
+      uint16_t payloadSize;
+      memcpy(&payloadSize, frameBuffer, 2);
+      frameSize += payloadSize;
+    }
+    size_t take = min(length, frameSize - frameFill);
+    memcpy(frameBuffer + frameFill, data, take);
+    frameFill += take;
+    data += take;
+    length -= take;
+
+    if (frameFill == OTA_ZBLK_FRAME_HEADER) {
+      uint16_t payloadSize;
+      memcpy(&payloadSize, frameBuffer, 2);
+      if (payloadSize > OTA_ZBLK_BLOCK_SIZE) {
+        rejectFrame();
+        return;
+      }
+      if (payloadSize > 0) continue;
+    } else if (frameFill < frameSize) {
+      continue;
+    }
+
+    size_t blockLength = min<size_t>(OTA_ZBLK_BLOCK_SIZE, otaFileSize - otaReceived);
+    const uint8_t* block = decodeFrame(blockLength);
+    frameFill = 0;
+    if (!block) {
+      rejectFrame();
+      return;
+    }
+    writeFirmwareData(block, blockLength);
+  }
+}
+
+// Returns the decoded block, or nullptr when the frame is malformed or fails its CRC
+const uint8_t* BLEOtaUpdate::decodeFrame(size_t length) {
+  uint16_t payloadSize;
+  uint32_t crc;
+  memcpy(&payloadSize, frameBuffer, 2);
+  memcpy(&crc, frameBuffer + 4, 4);
+  const uint8_t* payload = frameBuffer + OTA_ZBLK_FRAME_HEADER;
+  const uint8_t* block = nullptr;
+
+  if (frameBuffer[2] == OTA_ZBLK_STORED) {
+    block = payloadSize == length ? payload : nullptr;
+#ifdef OTA_HAS_ROM_MINIZ
+  } else if (frameBuffer[2] == OTA_ZBLK_DEFLATE) {
+    // Blocks are independent: a fresh decoder and the block buffer as the whole window
+    tinfl_decompressor* decoder = (tinfl_decompressor*)inflator;
+    size_t inSize = payloadSize;
+    size_t outSize = OTA_ZBLK_BLOCK_SIZE;
+    tinfl_init(decoder);
+    tinfl_status status = tinfl_decompress(decoder, payload, &inSize, inflateBuffer, inflateBuffer, &outSize,
+                                           TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    block = status == TINFL_STATUS_DONE && outSize == length ? inflateBuffer : nullptr;
+#endif
+  }
+  return block && esp_rom_crc32_le(0, block, length) == crc ? block : nullptr;
+}
+
+void BLEOtaUpdate::rejectFrame() {
+  uint32_t index = otaReceived / OTA_ZBLK_BLOCK_SIZE;
+  sessionStats.blocksRejected++;
+  frameFill = 0;
+  frameSeeking = true;
+  OTA_LOG("[OTA] Frame %u rejected, re-requesting\n", index);
+  sendStatusTo(uploaderConnId, "NAK:" + String(index), OtaNotifyPriority::CONTROL);
+}
+#endif
+
+void BLEOtaUpdate::releaseInflate() {
+#if BLE_OTA_COMPRESSION
+  free(inflator);
+  free(frameBuffer);
+  free(inflateBuffer);
+  inflator = nullptr;
+  frameBuffer = nullptr;
+  inflateBuffer = nullptr;
+  frameFill = 0;
+  frameSeeking = false;
+#endif
+}
+
+bool BLEOtaUpdate::startImageCipher(const uint8_t* iv) {
+#if BLE_OTA_ENCRYPTION
+  if (!encryptionKeyBits || !iv) return false;
+  // Merkle sessions hand over whole verified blocks instead of single writes (zblk is never encrypted)
+  plainBufferSize = max<size_t>(sessionBlockSize(), OTA_MAX_ATT_VALUE);
+  plainBuffer = (uint8_t*)malloc(plainBufferSize);
+  if (!plainBuffer) return false;
+  noteBufferHeap();
+  mbedtls_aes_setkey_enc(&imageCipher, encryptionKey, encryptionKeyBits);
+  memcpy(cipherCounter, iv, OTA_ENCRYPTION_IV_SIZE);
+  cipherOffset = 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void BLEOtaUpdate::releaseImageCipher() {
+#if BLE_OTA_ENCRYPTION
+  free(plainBuffer);
+  plainBuffer = nullptr;
+  memset(cipherStream, 0, sizeof(cipherStream));
+#endif
+}
+
+// Flash sink: Update, or with setSkipUnchangedSectors() a sector buffer that is compared
+// with the inactive slot and only erased/programmed where it differs. The boot partition
+// is switched by esp_ota_set_boot_partition(), which validates the whole image first.
+bool BLEOtaUpdate::flashBegin(uint32_t size) {
+  sectorSinkSession = skipUnchangedSectors;
+  if (!sectorSinkSession) return Update.begin(size);
+
+  sectorPartition = esp_ota_get_next_update_partition(nullptr);
+  if (!sectorPartition || size > sectorPartition->size) {
+    sectorError = sectorPartition ? UPDATE_ERROR_SPACE : UPDATE_ERROR_NO_PARTITION;
+    return false;
+  }
+  if (!sectorBuffer) {
+    sectorBuffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
+    noteBufferHeap();
+  }
+  sectorFill = 0;
+  sectorOffset = 0;
+  sectorError = 0;
+  return sectorBuffer != nullptr;
+}
+
+size_t BLEOtaUpdate::flashWrite(const uint8_t* data, size_t length) {
+  if (!sectorSinkSession) return Update.write((uint8_t*)data, length);
+
+  size_t consumed = 0;
+  while (consumed < length) {
+    size_t take = min(length - consumed, SPI_FLASH_SEC_SIZE - sectorFill);
+    memcpy(sectorBuffer + sectorFill, data + consumed, take);
+    sectorFill += take;
+    consumed += take;
+    if (sectorFill == SPI_FLASH_SEC_SIZE && !flushSector()) return 0;
+  }
+  return length;
+}
+
+bool BLEOtaUpdate::flushSector() {
+  // Compare in small reads so a mismatch is usually found after the first one
+  uint32_t start = micros();
+  uint8_t current[256];
+  bool same = true;
+  for (size_t at = 0; at < sectorFill && same; at += sizeof(current)) {
+    size_t n = min(sizeof(current), sectorFill - at);
+    same = esp_partition_read(sectorPartition, sectorOffset + at, current, n) == ESP_OK &&
+           memcmp(current, sectorBuffer + at, n) == 0;
+  }
+  sessionStats.sectorCompareUs += micros() - start;
+
+  if (same) {
+    OTA_TRACE(SECTOR_SKIPPED, sectorOffset);
+    sessionStats.sectorsSkipped++;
+  } else {
+    // Encrypted partitions are written in 16-byte units; pad the last sector with erased bytes
+    size_t length = sectorPartition->encrypted ? (sectorFill + 15) & ~(size_t)15 : sectorFill;
+    memset(sectorBuffer + sectorFill, 0xFF, length - sectorFill);
+    start = micros();
+    OTA_TRACE(ERASE_BEGIN, sectorOffset);
+    bool ok = esp_partition_erase_range(sectorPartition, sectorOffset, SPI_FLASH_SEC_SIZE) == ESP_OK;
+    OTA_TRACE(ERASE_END, sectorOffset);
+    if (!ok) {
+      sectorError = UPDATE_ERROR_ERASE;
+      return false;
+    }
+    OTA_TRACE(PROGRAM_BEGIN, sectorOffset);
+    ok = esp_partition_write(sectorPartition, sectorOffset, sectorBuffer, length) == ESP_OK;
+    OTA_TRACE(PROGRAM_END, sectorOffset);
+    if (!ok) {
+      sectorError = UPDATE_ERROR_WRITE;
+      return false;
+    }
+    sessionStats.sectorWriteUs += micros() - start;
+    sessionStats.sectorsWritten++;
+  }
+  sectorOffset += SPI_FLASH_SEC_SIZE;
+  sectorFill = 0;
+  return true;
+}
+
+bool BLEOtaUpdate::flashEnd() {
+  if (!sectorSinkSession) return Update.end(true);
+
+  bool ok = (sectorFill == 0 || flushSector());
+  free(sectorBuffer);
+  sectorBuffer = nullptr;
+  if (!ok) return false;
+
+  uint32_t savedMs = sessionStats.sectorsWritten
+      ? (uint64_t)sessionStats.sectorWriteUs / sessionStats.sectorsWritten * sessionStats.sectorsSkipped / 1000 : 0;
+  OTA_LOG("[OTA] Sectors: %u written, %u unchanged (~%u ms erase/program saved, %u ms comparing)\n",
+          sessionStats.sectorsWritten, sessionStats.sectorsSkipped, savedMs,
+          sessionStats.sectorCompareUs / 1000);
+  if (esp_ota_set_boot_partition(sectorPartition) != ESP_OK) {
+    sectorError = UPDATE_ERROR_ACTIVATE;
+    return false;
+  }
+  return true;
+}
+
+void BLEOtaUpdate::flashAbort() {
+  if (!sectorSinkSession) {
+    Update.abort();
+    return;
+  }
+  // Nothing to undo: the boot partition only changes in flashEnd()
+  free(sectorBuffer);
+  sectorBuffer = nullptr;
+  sectorFill = 0;
+  sectorError = UPDATE_ERROR_ABORT;
+}
+
+uint8_t BLEOtaUpdate::flashError() {
+  return sectorSinkSession ? sectorError : Update.getError();
+}
+
+#if BLE_OTA_SIGNATURE
+bool BLEOtaUpdate::verifyImageSignature() {
+  uint32_t start = micros();
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&imageDigest, digest);
+  mbedtls_sha256_free(&imageDigest);
+
+  bool valid = false;
+  if (signatureReceived) {
+    mbedtls_ecp_group group;
+    mbedtls_ecp_point key;
+    mbedtls_mpi r, s;
+    mbedtls_ecp_group_init(&group);
+    mbedtls_ecp_point_init(&key);
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    valid = mbedtls_ecp_group_load(&group, MBEDTLS_ECP_DP_SECP256R1) == 0 &&
+            mbedtls_ecp_point_read_binary(&group, &key, signingKey, sizeof(signingKey)) == 0 &&
+            mbedtls_mpi_read_binary(&r, imageSignature, OTA_SIGNATURE_SIZE / 2) == 0 &&
+            mbedtls_mpi_read_binary(&s, imageSignature + OTA_SIGNATURE_SIZE / 2, OTA_SIGNATURE_SIZE / 2) == 0 &&
+            mbedtls_ecdsa_verify(&group, digest, sizeof(digest), &key, &r, &s) == 0;
+    mbedtls_mpi_free(&s);
+    mbedtls_mpi_free(&r);
+    mbedtls_ecp_point_free(&key);
+    mbedtls_ecp_group_free(&group);
+  }
+
+  sessionStats.verifyUs = micros() - start;
+  sessionStats.signatureValid = valid;
+  OTA_LOG("[OTA] Signature %s in %u us (%u ms transfer)\n", valid ? "valid" : "INVALID",
+          sessionStats.verifyUs, sessionStats.transferMs);
+  sendStatus("VERIFY:ok=" + String(valid) + ",us=" + String(sessionStats.verifyUs), OtaNotifyPriority::CONTROL);
+  return valid;
+}
+#endif
+
+// NVS keys are limited to 15 characters: a prefix letter + 12 hex digits of the peer address
+static void peerNvsKey(const uint8_t* a, char key[16], char prefix = 't') {
+  snprintf(key, 16, "%c%02x%02x%02x%02x%02x%02x", prefix, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+#if BLE_OTA_TUNING
+void BLEOtaUpdate::loadPeerTuning() {
+  tunePeriodStartMs = millis();
+  tunePeriodStartOffset = 0;
+  tuneLastBps = 0;
+  tuneDirection = 1;
+  tuneKnob = 0;
+  sessionStats.tuneStepCount = 0;
+  sessionStats.tuneBest = {0, 0, sessionWindow, sessionStats.connIntervalUnits};
+  if (!sessionStats.peerBonded) return;
+
+  char key[16];
+  peerNvsKey(sessionStats.peerAddress, key);
+  Preferences prefs;
+  OtaTuneStep cached;
+  prefs.begin(OTA_NVS_NAMESPACE, true);
+  bool found = prefs.getBytes(key, &cached, sizeof(cached)) == sizeof(cached);
+  prefs.end();
+  if (!found) return;
+
+  sessionStats.tuningFromCache = true;
+  sessionWindow = constrain(cached.window, OTA_TUNE_MIN_WINDOW, OTA_TUNE_MAX_WINDOW);
+  sessionStats.tuneBest = cached;
+  requestConnInterval(cached.intervalUnits);
+  OTA_LOG("[OTA] Tune: cached window %u, interval %u (%u B/s last time)\n",
+          sessionWindow, cached.intervalUnits, cached.bytesPerSec);
+}
+
+void BLEOtaUpdate::savePeerTuning() {
+  // One NVS write per session, only for bonded peers whose address is stable
+  if (!sessionStats.peerBonded || sessionStats.tuneBest.bytesPerSec == 0) return;
+
+  char key[16];
+  peerNvsKey(sessionStats.peerAddress, key);
+  Preferences prefs;
+  prefs.begin(OTA_NVS_NAMESPACE, false);
+  prefs.putBytes(key, &sessionStats.tuneBest, sizeof(sessionStats.tuneBest));
+  prefs.end();
+}
+
+void BLEOtaUpdate::tuneFlowControl() {
+  uint32_t now = millis();
+  uint32_t elapsed = max<uint32_t>(now - tunePeriodStartMs, 1);
+  uint32_t bps = (uint64_t)(otaReceived - tunePeriodStartOffset) * 1000 / elapsed;
+  uint16_t interval = sessionStats.connIntervalUnits;
+
+  // Hill climbing, one knob at a time: keep stepping while it helps,
+  // reverse and switch knobs when the last step made things worse
+  if (bps > sessionStats.tuneBest.bytesPerSec) {
+    sessionStats.tuneBest = {otaReceived, bps, sessionWindow, interval};
+  } else if (bps < tuneLastBps) {
+    tuneDirection = -tuneDirection;
+    tuneKnob ^= 1;
+  }
+  tuneLastBps = bps;
+
+  if (tuneKnob == 0) {
+    uint32_t window = tuneDirection > 0 ? sessionWindow * 3 / 2 : sessionWindow * 2 / 3;
+    sessionWindow = constrain(window, minimumWindow(), OTA_TUNE_MAX_WINDOW);
+    sendStatusTo(uploaderConnId, "TUNE:window=" + String(sessionWindow), OtaNotifyPriority::CONTROL);
+  } else if (interval) {
+    uint32_t next = tuneDirection > 0 ? interval * 2 : interval / 2;
+    requestConnInterval(constrain(next, OTA_TUNE_MIN_INTERVAL, OTA_TUNE_MAX_INTERVAL));
+  }
+
+  OtaTuneStep& step = sessionStats.tuneLog[sessionStats.tuneStepCount++ % OTA_TUNE_LOG_SIZE];
+  step = {otaReceived, bps, sessionWindow, interval};
+  OTA_LOG("[OTA] Tune: %u B/s -> window %u, interval %u\n", bps, sessionWindow, interval);
+
+  tunePeriodStartMs = now;
+  tunePeriodStartOffset = otaReceived;
+}
+
+void BLEOtaUpdate::requestConnInterval(uint16_t intervalUnits) {
+  // The central decides; the GAP handler records what it actually picked
+  esp_bd_addr_t peer;
+  memcpy(peer, sessionStats.peerAddress, sizeof(peer));
+  pServer->updateConnParams(peer, intervalUnits, intervalUnits, 0, 400);
+}
+#endif
+
+static_assert(sizeof(OtaSessionRecord) == 40, "OtaSessionRecord is a fixed wire/NVS format");
+
+// Session history is a ring of NVS keys "h0".."h7" plus a write index, so each
+// session rewrites one 40-byte record instead of the whole history
+void BLEOtaUpdate::recordSession(OtaStatus outcome) {
+  if (!sessionRecordPending) return;
+  sessionRecordPending = false;
+  memoryReport.largestBlockAfterSession = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+  OtaSessionRecord record;
+  memset(&record, 0, sizeof(record));
+  record.startTime = sessionStartTime > 1600000000 ? sessionStartTime : 0;
+  record.startUptimeMs = setupStartedAtMs;
+  record.durationMs = millis() - setupStartedAtMs;
+  record.bytes = otaReceived;
+  record.avgBytesPerSec = sessionStats.transferMs ? (uint64_t)otaReceived * 1000 / sessionStats.transferMs : 0;
+  record.peakBytesPerSec = max(sessionStats.peakBytesPerSec, record.avgBytesPerSec);
+  record.features = sessionStats.features;
+  record.stalls = sessionStats.stalls;
+  record.mtu = sessionStats.negotiatedMtu;
+  record.connIntervalUnits = sessionStats.connIntervalUnits;
+  record.outcome = (uint8_t)outcome;
+  record.updateError = (sessionStats.features & OTA_FEATURE_SINK) ? 0 : flashError();
+  record.protocolVersion = sessionStats.protocolVersion;
+  if (sessionStats.peerBonded) record.flags |= OTA_RECORD_FLAG_BONDED;
+  if (sessionStats.features & OTA_FEATURE_SINK) record.flags |= OTA_RECORD_FLAG_LINK_TEST;
+  if (sessionStats.tuningFromCache) record.flags |= OTA_RECORD_FLAG_TUNED;
+
+  OtaSessionRecord previous;
+  if (getSessionHistory(&previous, 1) == 1 && previous.outcome != (uint8_t)OtaStatus::COMPLETED) {
+    record.retries = previous.retries + 1;
+  }
+
+  Preferences prefs;
+  prefs.begin(OTA_NVS_NAMESPACE, false);
+  uint8_t next = prefs.getUChar("hnext", 0) % OTA_HISTORY_SIZE;
+  char key[4] = {'h', (char)('0' + next), 0, 0};
+  prefs.putBytes(key, &record, sizeof(record));
+  prefs.putUChar("hnext", (next + 1) % OTA_HISTORY_SIZE);
+  prefs.end();
+
+#if BLE_OTA_HISTORY
+  refreshHistoryCharacteristic();
+#endif
+}
+
+size_t BLEOtaUpdate::getSessionHistory(OtaSessionRecord* records, size_t maxRecords) {
+  Preferences prefs;
+  size_t count = 0;
+  if (!prefs.begin(OTA_NVS_NAMESPACE, true)) return 0;
+  uint8_t next = prefs.getUChar("hnext", 0);
+  for (size_t i = 1; i <= OTA_HISTORY_SIZE && count < maxRecords; i++) {
+    char key[4] = {'h', (char)('0' + (next + OTA_HISTORY_SIZE - i) % OTA_HISTORY_SIZE), 0, 0};
+    if (prefs.getBytes(key, &records[count], sizeof(OtaSessionRecord)) == sizeof(OtaSessionRecord)) {
+      count++;
+    }
+  }
+  prefs.end();
+  return count;
+}
+
+void BLEOtaUpdate::clearSessionHistory() {
+  Preferences prefs;
+  prefs.begin(OTA_NVS_NAMESPACE, false);
+  for (size_t i = 0; i < OTA_HISTORY_SIZE; i++) {
+    char key[4] = {'h', (char)('0' + i), 0, 0};
+    prefs.remove(key);
+  }
+  prefs.remove("hnext");
+  prefs.end();
+#if BLE_OTA_HISTORY
+  refreshHistoryCharacteristic();
+#endif
+}
+
+#if BLE_OTA_HISTORY
+void BLEOtaUpdate::refreshHistoryCharacteristic() {
+  if (!pHistoryCharacteristic) return;
+  OtaSessionRecord records[OTA_HISTORY_SIZE];
+  size_t count = getSessionHistory(records, OTA_HISTORY_SIZE);
+  pHistoryCharacteristic->setValue((uint8_t*)records, count * sizeof(OtaSessionRecord));
+}
+#endif
+
+void BLEOtaUpdate::finishLinkTest() {
+  linkTestResult.bytes = otaReceived;
+  linkTestResult.durationMs = sessionStats.transferMs;
+  linkTestResult.bytesPerSec = sessionStats.transferMs ? (uint64_t)otaReceived * 1000 / sessionStats.transferMs : 0;
+  linkTestResult.lostBytes = otaFileSize - otaReceived;
+  linkTestResult.crc32 = sessionStats.crc32;
+  otaInProgress = false;
+  recordSession(OtaStatus::COMPLETED);
+
+  String result = "TEST:bytes=" + String(linkTestResult.bytes);
+  result += ",ms=" + String(linkTestResult.durationMs);
+  result += ",Bps=" + String(linkTestResult.bytesPerSec);
+  result += ",lost=" + String(linkTestResult.lostBytes);
+  result += ",crc=0x" + String(linkTestResult.crc32, HEX);
+  sendStatusTo(uploaderConnId, result, OtaNotifyPriority::CONTROL);
+  OTA_LOG("[OTA] Link test: %s\n", result.c_str());
+  setOtaStatus(OtaStatus::IDLE, "Link test complete");
+}
+
+void BLEOtaUpdate::handleGattsEvent(esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t* param) {
+  switch (event) {
+    case ESP_GATTS_WRITE_EVT:
+      // BLE2902 keeps one value for all links; remember each central's own subscription
+      if (!param->write.is_prep && pStatusCccd && param->write.handle == pStatusCccd->getHandle() &&
+          param->write.len >= 1) {
+        Peer* peer = findPeer(param->write.conn_id);
+        if (peer) peer->statusNotify = param->write.value[0] & 0x01;
+      }
+      // BLECharacteristic appends the fragment to its value; only note that one is queued
+      if (param->write.is_prep && pOtaCharacteristic && param->write.handle == pOtaCharacteristic->getHandle()) {
+        OTA_TRACE(LONG_WRITE_FRAGMENT, param->write.len);
+        longWritePending = true;
+      }
+      break;
+    case ESP_GATTS_EXEC_WRITE_EVT:
+      // Executed writes went through onWrite() already; this drops cancelled ones
+      longWritePending = false;
+      break;
+    case ESP_GATTS_MTU_EVT:
+      OTA_TRACE(MTU, param->mtu.mtu);
+      break;
+    case ESP_GATTS_CONGEST_EVT: {
+      // Out of controller buffers for this link: hold its notifications instead of losing them
+      Peer* peer = findPeer(param->congest.conn_id);
+      if (!peer) break;
+      peer->congested = param->congest.congested;
+      if (peer->congested) {
+        notifyStats.congestionEvents++;
+      } else {
+        flushNotifications();
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void BLEOtaUpdate::handleGapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+  if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT && param->update_conn_params.status == 0) {
+    for (Peer& peer : peers) {
+      if (peer.used && memcmp(peer.address, param->update_conn_params.bda, sizeof(peer.address)) == 0) {
+        peer.connIntervalUnits = param->update_conn_params.conn_int;
+      }
+    }
+    if (memcmp(sessionStats.peerAddress, param->update_conn_params.bda, sizeof(sessionStats.peerAddress)) == 0) {
+      sessionStats.connIntervalUnits = param->update_conn_params.conn_int;
+    }
+    OTA_TRACE(CONN_PARAMS, param->update_conn_params.conn_int);
+  }
+  if (event == ESP_GAP_BLE_AUTH_CMPL_EVT && param->ble_security.auth_cmpl.success) {
+    for (Peer& peer : peers) {
+      if (peer.used && memcmp(peer.address, param->ble_security.auth_cmpl.bd_addr, sizeof(peer.address)) == 0) {
+        peer.encrypted = true;
+      }
+    }
+    indicateServiceChanged(param->ble_security.auth_cmpl.bd_addr);
+  }
+}
+
+// Bonded centrals keep their cached attribute table across our OTA updates. Whatever the
+// new image changed (another service, a different handle range), each bonded peer gets one
+// Service Changed indication per image, once its link is encrypted again.
+void BLEOtaUpdate::indicateServiceChanged(const uint8_t* peerAddress) {
+  uint32_t image;
+  memcpy(&image, esp_app_get_description()->app_elf_sha256, sizeof(image));
+  char key[16];
+  peerNvsKey(peerAddress, key, 's');
+  Preferences prefs;
+  if (!prefs.begin(OTA_NVS_NAMESPACE, false)) return;
+  if (prefs.getUInt(key, 0) != image) {
+    esp_bd_addr_t bda;
+    memcpy(bda, peerAddress, sizeof(bda));
+    if (esp_ble_gatts_send_service_change_indication(pServer->getGattsIf(), bda) == ESP_OK) {
+      prefs.putUInt(key, image);
+      OTA_LOGLN("[BLE] Service Changed sent to bonded peer");
+    }
+  }
+  prefs.end();
+}
+
+#if BLE_OTA_COMMANDS
+void BLEOtaUpdate::handleCommandWrite(BLECharacteristic* pCharacteristic, uint16_t connId) {
+  if (isObserver(connId)) {
+    sendStatusTo(connId, "BUSY", OtaNotifyPriority::ERROR);
+    return;
+  }
+  commandConnId = connId;
+  std::string value = pCharacteristic->getValue().c_str();
+  if (value.length() > 0 && value[0] == OTA_SYS_CMD_PREFIX[0] && handleSystemCommand(String(value.c_str()))) {
+    return;
+  }
+  if (commandCallback && value.length() > 0) {
+    String command = String(value.c_str());
+    OTA_TRACE(CALLBACK_BEGIN, (uint8_t)OtaTraceCallback::COMMAND);
+    commandCallback(command);
+    OTA_TRACE(CALLBACK_END, (uint8_t)OtaTraceCallback::COMMAND);
+  }
+}
+
+#if BLE_OTA_BENCHMARK
+void BLEOtaUpdate::sendBenchmark(uint16_t target) {
+  OtaBenchmarkResult bench;
+  if (!runSelfBenchmark(bench)) {
+    sendStatusTo(target, "BENCH:error", OtaNotifyPriority::ERROR);
+    return;
+  }
+  String result = "BENCH:erase_us=" + String(bench.sectorEraseUs);
+  result += ",write=" + String(bench.flashWriteKBps);
+  result += ",read=" + String(bench.flashReadKBps);
+  result += ",sha256=" + String(bench.sha256KBps);
+  result += ",sha_hw=" + String(bench.sha256Hardware);
+  result += ",aes=" + String(bench.aesCtrKBps);
+  result += ",aes_hw=" + String(bench.aesHardware);
+  result += ",crc=" + String(bench.crc32RomKBps);
+  result += ",crc_sw=" + String(bench.crc32SoftKBps);
+  result += ",inflate=" + String(bench.inflateKBps);
+  result += ",dec_us_kb=" + String(bench.decryptUsPerKB);
+  result += ",merkle_us=" + String(bench.merkleBlockUs);
+  sendStatusTo(target, result, OtaNotifyPriority::CONTROL);
+}
+#endif
+
+bool BLEOtaUpdate::handleSystemCommand(const String& command) {
+  if (command.startsWith(OTA_SYS_CMD_PING)) {
+    sendStatusTo(commandConnId, "PONG:" + command.substring(strlen(OTA_SYS_CMD_PING)), OtaNotifyPriority::CONTROL);
+    return true;
+  }
+  if (command.startsWith(OTA_SYS_CMD_ECHO)) {
+    startEchoTest(command.substring(strlen(OTA_SYS_CMD_ECHO)).toInt());
+    return true;
+  }
+  if (command == OTA_SYS_CMD_BENCH) {
+#if BLE_OTA_BENCHMARK
+    // Seconds of flash and crypto work: never on the BLE task, loop() runs it
+    benchConnId = commandConnId;
+#else
+    sendStatusTo(commandConnId, "BENCH:error=disabled", OtaNotifyPriority::ERROR);
+#endif
+    return true;
+  }
+  if (command == OTA_SYS_CMD_TRACE) {
+    startTraceDump();
+    return true;
+  }
+  if (command == OTA_SYS_CMD_MEM) {
+    OtaMemoryReport mem;
+    getMemoryReport(mem);
+    String result = "MEM:heap=" + String(mem.freeHeap);
+    result += ",min=" + String(mem.minFreeHeap);
+    result += ",largest_before=" + String(mem.largestBlockBeforeSession);
+    result += ",largest_after=" + String(mem.largestBlockAfterSession);
+    result += ",ble_init=" + String(mem.bleInitHeap);
+    result += ",server=" + String(mem.serverHeap);
+    result += ",service=" + String(mem.serviceHeap);
+    result += ",buffers=" + String(mem.bufferHeap);
+    result += ",buffers_peak=" + String(mem.peakBufferHeap);
+    result += ",static=" + String(mem.staticRam);
+    result += ",ble_stack=" + String(mem.bleTaskStackFree);
+    result += ",loop_stack=" + String(mem.loopTaskStackFree);
+    sendStatusTo(commandConnId, result, OtaNotifyPriority::CONTROL);
+    return true;
+  }
+#if BLE_OTA_BULK_READ
+  if (command.startsWith(OTA_SYS_CMD_READ)) {
+    startBulkRead(command.substring(strlen(OTA_SYS_CMD_READ)));
+    return true;
+  }
+  if (command.startsWith(OTA_SYS_CMD_RACK)) {
+    acknowledgeBulkRead(command.substring(strlen(OTA_SYS_CMD_RACK)).toInt(), command.endsWith(",gap"));
+    return true;
+  }
+#else
+  if (command.startsWith(OTA_SYS_CMD_READ)) {
+    sendStatusTo(commandConnId, "READ:error=disabled", OtaNotifyPriority::ERROR);
+    return true;
+  }
+#endif
+  if (command.startsWith(OTA_SYS_CMD_PONG)) {
+    // Late replies to pings that already timed out are ignored
+    if (echoSamples && command.substring(strlen(OTA_SYS_CMD_PONG)).toInt() == echoSeq) {
+      echoSamples[linkTestResult.rttSamples++] = micros() - echoSentAtUs;
+      advanceEchoTest();
+    }
+    return true;
+  }
+  return false;
+}
+#endif
+
+#if BLE_OTA_BULK_READ
+// #READ:<object>[,<offset>,<length>]; the reply announces the size, then loop() streams the data
+void BLEOtaUpdate::startBulkRead(const String& request) {
+  if (!bulkReadEnabled) {
+    sendStatusTo(commandConnId, "READ:error=disabled", OtaNotifyPriority::ERROR);
+    return;
+  }
+  if (otaInProgress || readActive) {
+    sendStatusTo(commandConnId, "READ:error=busy", OtaNotifyPriority::ERROR);
+    return;
+  }
+  // Core dumps and images can carry secrets; like the SoftAP credentials, only over an encrypted link
+  Peer* reader = findPeer(commandConnId);
+  if (!reader || !reader->encrypted) {
+    sendStatusTo(commandConnId, "READ:error=auth", OtaNotifyPriority::ERROR);
+    return;
+  }
+
+  int comma = request.indexOf(',');
+  String object = comma < 0 ? request : request.substring(0, comma);
+  uint32_t objectSize = 0;
+  readPartition = nullptr;
+  if (object == OTA_READ_OBJECT_COREDUMP) {
+    readPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, nullptr);
+  } else if (object.startsWith(OTA_READ_OBJECT_PARTITION)) {
+    String label = object.substring(strlen(OTA_READ_OBJECT_PARTITION));
+    // App slots only: data partitions such as nvs hold the bond keys
+    readPartition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
+  } else if (object == OTA_READ_OBJECT_LOG && readableLog) {
+    objectSize = readableLogSize;
+  }
+  if (readPartition) objectSize = readPartition->size;
+  if (objectSize == 0) {
+    sendStatusTo(commandConnId, "READ:error=object", OtaNotifyPriority::ERROR);
+    return;
+  }
+
+  uint32_t offset = 0;
+  uint32_t length = objectSize;
+  if (comma >= 0) {
+    int second = request.indexOf(',', comma + 1);
+    offset = request.substring(comma + 1).toInt();
+    length = second < 0 ? objectSize - min(offset, objectSize) : request.substring(second + 1).toInt();
+  }
+  if (offset >= objectSize || length == 0 || length > objectSize - offset) {
+    sendStatusTo(commandConnId, "READ:error=range", OtaNotifyPriority::ERROR);
+    return;
+  }
+
+  readConnId = commandConnId;
+  readChunk = pServer->getPeerMTU(readConnId) - 3 - OTA_PULL_OFFSET_SIZE;
+  readBuffer = (uint8_t*)malloc(OTA_PULL_OFFSET_SIZE + readChunk);
+  if (!readBuffer) {
+    sendStatusTo(commandConnId, "READ:error=memory", OtaNotifyPriority::ERROR);
+    return;
+  }
+  noteBufferHeap();
+  readStart = offset;
+  readSize = length;
+  readSent = 0;
+  readAcked = 0;
+  readRewind = false;
+  readCrc = 0;
+  readCrcOffset = 0;
+  readResends = 0;
+  readStartedAtMs = millis();
+  readAckAtMs = readStartedAtMs;
+  readActive = true;
+  OTA_LOG("[OTA] Bulk read: %s, %u bytes from offset %u\n", object.c_str(), length, offset);
+  sendStatusTo(readConnId,
+               "READ:size=" + String(length) + ",chunk=" + String(readChunk) + ",window=" + String(flowControlWindow),
+               OtaNotifyPriority::CONTROL);
+}
+
+void BLEOtaUpdate::acknowledgeBulkRead(uint32_t offset, bool gap) {
+  if (!readActive || offset > readSize) return;
+  readAcked = max<uint32_t>(readAcked, offset);
+  readAckAtMs = millis();
+  if (gap) readRewind = true;
+}
+
+// Fill the window with notifications on the OTA characteristic, same framing as pull writes.
+// The characteristic's value is left alone: the BLE task reads it for incoming writes
+void BLEOtaUpdate::serviceBulkRead() {
+  if (!readActive) return;
+  Peer* peer = findPeer(readConnId);
+  if (!peer) {
+    releaseBulkRead();
+    return;
+  }
+  // Nothing goes out while the controller is out of buffers; loop() resumes once CONGEST_EVT clears it.
+  // A silent client is expected meanwhile, so congestion does not count toward the resend timer
+  if (peer->congested) {
+    readAckAtMs = millis();
+    return;
+  }
+  uint32_t acked = readAcked;
+  if (acked >= readSize) {
+    finishBulkRead();
+    return;
+  }
+  bool waiting = readSent == readSize || readSent - acked >= flowControlWindow;
+  if (readRewind || (waiting && millis() - readAckAtMs > OTA_READ_RETRY_MS)) {
+    readRewind = false;
+    readAckAtMs = millis();
+    readSent = acked;
+    readResends++;
+  }
+
+  while (readSent < readSize && readSent - acked < flowControlWindow && !peer->congested) {
+    size_t length = min<size_t>(readChunk, readSize - readSent);
+    memcpy(readBuffer, &readSent, OTA_PULL_OFFSET_SIZE);
+    uint8_t* payload = readBuffer + OTA_PULL_OFFSET_SIZE;
+    if (readPartition) {
+      esp_partition_read(readPartition, readStart + readSent, payload, length);
+    } else {
+      memcpy(payload, readableLog + readStart + readSent, length);
+    }
+    if (esp_ble_gatts_send_indicate(pServer->getGattsIf(), readConnId, pOtaCharacteristic->getHandle(),
+                                    OTA_PULL_OFFSET_SIZE + length, readBuffer, false) != ESP_OK) {
+      break;  // Not queued: the same chunk goes out again on the next loop()
+    }
+    OTA_TRACE(NOTIFY, length);
+    // Resent ranges were already counted
+    if (readSent == readCrcOffset) {
+      readCrc = esp_rom_crc32_le(readCrc, payload, length);
+      readCrcOffset += length;
+    }
+    readSent += length;
+  }
+}
+
+// Reported like the link test (TEST:) so both directions compare directly
+void BLEOtaUpdate::finishBulkRead() {
+  uint32_t ms = millis() - readStartedAtMs;
+  String result = "READ:end,bytes=" + String(readSize);
+  result += ",ms=" + String(ms);
+  result += ",Bps=" + String(ms ? (uint32_t)((uint64_t)readSize * 1000 / ms) : 0);
+  result += ",resent=" + String(readResends);
+  result += ",crc=0x" + String(readCrc, HEX);
+  sendStatusTo(commandConnId, result, OtaNotifyPriority::CONTROL);
+  OTA_LOG("[OTA] Bulk read: %s\n", result.c_str());
+  releaseBulkRead();
+}
+
+void BLEOtaUpdate::releaseBulkRead() {
+  free(readBuffer);
+  readBuffer = nullptr;
+  readActive = false;
+}
+#endif
+
+void BLEOtaUpdate::setBulkReadEnabled(bool enable) {
+#if BLE_OTA_BULK_READ
+  bulkReadEnabled = enable;
+#endif
+}
+
+void BLEOtaUpdate::setReadableLog(const uint8_t* data, size_t length) {
+#if BLE_OTA_BULK_READ
+  readableLog = data;
+  readableLogSize = data ? length : 0;
+#endif
+}
+
+#if BLE_OTA_BUNDLES
+static const esp_partition_t* findBundlePartition(const char* target, uint8_t slot) {
+  char label[OTA_BUNDLE_NAME_SIZE + 3];
+  snprintf(label, sizeof(label), "%s_%u", target, slot);
+  return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+}
+
+static int findBundleTarget(const OtaBundleSlots& slots, const char* target) {
+  for (int i = 0; i < OTA_BUNDLE_MAX_ITEMS; i++) {
+    if (strncmp(slots.targets[i], target, OTA_BUNDLE_NAME_SIZE) == 0) return i;
+  }
+  return -1;
+}
+
+static uint8_t activeBundleSlot(const char* target) {
+  OtaBundleSlots active;
+  Preferences prefs;
+  if (!prefs.begin(OTA_NVS_NAMESPACE, true)) return 0;
+  bool found = prefs.getBytes("bactive", &active, sizeof(active)) == sizeof(active);
+  prefs.end();
+  int index = found ? findBundleTarget(active, target) : -1;
+  return index < 0 ? 0 : active.slots[index];
+}
+
+// Bundles: split the stream into the manifest and the payloads, each streamed to its target
+size_t BLEOtaUpdate::bundleWrite(const uint8_t* data, size_t length) {
+  size_t consumed = 0;
+  while (consumed < length) {
+    if (bundleCount == 0) {
+      size_t need = OTA_BUNDLE_HEADER_SIZE;
+      if (bundleManifestFill >= OTA_BUNDLE_HEADER_SIZE) need += bundleManifest[5] * OTA_BUNDLE_ENTRY_SIZE;
+      size_t take = min(length - consumed, need - bundleManifestFill);
+      memcpy(bundleManifest + bundleManifestFill, data + consumed, take);
+      bundleManifestFill += take;
+      consumed += take;
+      if (bundleManifestFill == OTA_BUNDLE_HEADER_SIZE) {
+        if (memcmp(bundleManifest, OTA_BUNDLE_MAGIC, 4) != 0 || bundleManifest[4] != OTA_BUNDLE_VERSION ||
+            bundleManifest[5] == 0 || bundleManifest[5] > OTA_BUNDLE_MAX_ITEMS) {
+          OTA_LOGLN("[OTA] ERROR: Bad bundle header");
+          return 0;
+        }
+      } else if (bundleManifestFill == need && (!parseBundleManifest() || !beginBundleItem())) {
+        return 0;
+      }
+      continue;
+    }
+    if (bundleItem == bundleCount) return 0;  // Data past the last payload
+
+    const uint8_t* entry = bundleManifest + OTA_BUNDLE_HEADER_SIZE + bundleItem * OTA_BUNDLE_ENTRY_SIZE;
+    uint32_t itemSize;
+    memcpy(&itemSize, entry + OTA_BUNDLE_NAME_SIZE, 4);
+    size_t take = min<size_t>(length - consumed, itemSize - bundleItemWritten);
+    const uint8_t* chunk = data + consumed;
+    const esp_partition_t* target = bundleTargets[bundleItem];
+    if (!target) {
+      if (flashWrite(chunk, take) != take) return 0;
+    } else {
+      for (size_t done = 0; done < take;) {
+        uint32_t at = bundleItemWritten + done;
+        // Erase sector by sector as data arrives; a whole-partition erase would block the BLE task
+        if (at % SPI_FLASH_SEC_SIZE == 0) {
+          OTA_TRACE(ERASE_BEGIN, at);
+          esp_err_t err = esp_partition_erase_range(target, at, SPI_FLASH_SEC_SIZE);
+          OTA_TRACE(ERASE_END, at);
+          if (err != ESP_OK) return 0;
+        }
+        size_t n = min<size_t>(take - done, SPI_FLASH_SEC_SIZE - at % SPI_FLASH_SEC_SIZE);
+        if (esp_partition_write(target, at, chunk + done, n) != ESP_OK) return 0;
+        done += n;
+      }
+    }
+    mbedtls_sha256_update(&bundleDigest, chunk, take);
+    bundleItemWritten += take;
+    consumed += take;
+    if (bundleItemWritten == itemSize && !finishBundleItem()) return 0;
+  }
+  return length;
+}
+
+bool BLEOtaUpdate::parseBundleManifest() {
+  uint8_t count = bundleManifest[5];
+  uint64_t total = OTA_BUNDLE_HEADER_SIZE + count * OTA_BUNDLE_ENTRY_SIZE;
+  bool hasApp = false;
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t* entry = bundleManifest + OTA_BUNDLE_HEADER_SIZE + i * OTA_BUNDLE_ENTRY_SIZE;
+    char target[OTA_BUNDLE_NAME_SIZE + 1];
+    memcpy(target, entry, OTA_BUNDLE_NAME_SIZE);
+    target[OTA_BUNDLE_NAME_SIZE] = '\0';
+    uint32_t size;
+    memcpy(&size, entry + OTA_BUNDLE_NAME_SIZE, 4);
+    total += size;
+
+    // Each target once; data targets are written to the copy that is not in use
+    bool duplicate = false;
+    for (uint8_t j = 0; j < i; j++) {
+      duplicate |= strncmp(target, (const char*)bundleManifest + OTA_BUNDLE_HEADER_SIZE + j * OTA_BUNDLE_ENTRY_SIZE,
+                           OTA_BUNDLE_NAME_SIZE) == 0;
+    }
+    uint32_t capacity = 0;
+    bundleTargets[i] = nullptr;
+    if (strcmp(target, OTA_BUNDLE_APP) == 0) {
+      const esp_partition_t* next = esp_ota_get_next_update_partition(nullptr);
+      capacity = next ? next->size : 0;
+      hasApp = true;
+    } else if (target[0]) {
+      bundleSlots[i] = activeBundleSlot(target) ^ 1;
+      bundleTargets[i] = findBundlePartition(target, bundleSlots[i]);
+      capacity = bundleTargets[i] ? bundleTargets[i]->size : 0;
+    }
+    if (duplicate || size == 0 || size > capacity) {
+      OTA_LOG("[OTA] ERROR: Bundle target '%s' (%u bytes) has no free slot\n", target, size);
+      return false;
+    }
+  }
+  if (total != otaFileSize) {
+    OTA_LOG("[OTA] ERROR: Bundle payloads do not add up to %u bytes\n", otaFileSize);
+    return false;
+  }
+  bundleCount = count;
+  bundleItem = 0;
+  OTA_LOG("[OTA] Bundle: %u payloads%s\n", count, hasApp ? " including the app" : "");
+  return true;
+}
+
+bool BLEOtaUpdate::beginBundleItem() {
+  bundleItemWritten = 0;
+  mbedtls_sha256_free(&bundleDigest);
+  mbedtls_sha256_init(&bundleDigest);
+  mbedtls_sha256_starts(&bundleDigest, 0);
+  if (bundleTargets[bundleItem]) return true;
+
+  uint32_t size;
+  memcpy(&size, bundleManifest + OTA_BUNDLE_HEADER_SIZE + bundleItem * OTA_BUNDLE_ENTRY_SIZE + OTA_BUNDLE_NAME_SIZE, 4);
+  return flashBegin(size);
+}
+
+// Per-payload progress: BUNDLE:item=<n>/<count>,target=<name>,ok (or error=digest)
+bool BLEOtaUpdate::finishBundleItem() {
+  const uint8_t* entry = bundleManifest + OTA_BUNDLE_HEADER_SIZE + bundleItem * OTA_BUNDLE_ENTRY_SIZE;
+  char target[OTA_BUNDLE_NAME_SIZE + 1];
+  memcpy(target, entry, OTA_BUNDLE_NAME_SIZE);
+  target[OTA_BUNDLE_NAME_SIZE] = '\0';
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&bundleDigest, digest);
+  bool ok = memcmp(digest, entry + OTA_BUNDLE_NAME_SIZE + 4, sizeof(digest)) == 0;
+
+  String status = "BUNDLE:item=" + String(bundleItem + 1) + "/" + String(bundleCount) + ",target=" + String(target);
+  sendStatus(status + (ok ? ",ok" : ",error=digest"), ok ? OtaNotifyPriority::CONTROL : OtaNotifyPriority::ERROR);
+  if (!ok) {
+    OTA_LOG("[OTA] ERROR: Bundle payload '%s' digest mismatch\n", target);
+    return false;
+  }
+  OTA_LOG("[OTA] Bundle payload '%s' verified (%u bytes)\n", target, bundleItemWritten);
+  bundleItem++;
+  return bundleItem == bundleCount || beginBundleItem();
+}
+
+// Nothing has switched yet. The data slots go to NVS as pending, then the boot partition switch
+// is the single commit point (without an app payload, the pending record itself is)
+bool BLEOtaUpdate::commitBundle() {
+  if (bundleCount == 0 || bundleItem != bundleCount) return false;
+
+  OtaBundleSlots pending;
+  memset(&pending, 0, sizeof(pending));
+  bool hasApp = false;
+  for (uint8_t i = 0, used = 0; i < bundleCount; i++) {
+    if (!bundleTargets[i]) {
+      hasApp = true;
+      continue;
+    }
+    memcpy(pending.targets[used], bundleManifest + OTA_BUNDLE_HEADER_SIZE + i * OTA_BUNDLE_ENTRY_SIZE,
+           OTA_BUNDLE_NAME_SIZE);
+    pending.slots[used++] = bundleSlots[i];
+  }
+  const esp_partition_t* next = esp_ota_get_next_update_partition(nullptr);
+  pending.appAddress = hasApp && next ? next->address : 0;
+
+  Preferences prefs;
+  prefs.begin(OTA_NVS_NAMESPACE, false);
+  bool saved = prefs.putBytes("bpending", &pending, sizeof(pending)) == sizeof(pending);
+  prefs.end();
+  if (!saved) return false;
+
+  if (hasApp && !flashEnd()) {
+    prefs.begin(OTA_NVS_NAMESPACE, false);
+    prefs.remove("bpending");
+    prefs.end();
+    return false;
+  }
+  if (!hasApp) promoteBundle();
+  return true;
+}
+
+// Runs at begin(): idempotent, so a reset halfway through simply repeats it
+void BLEOtaUpdate::promoteBundle() {
+  Preferences prefs;
+  if (!prefs.begin(OTA_NVS_NAMESPACE, false)) return;
+  OtaBundleSlots pending;
+  if (prefs.getBytes("bpending", &pending, sizeof(pending)) != sizeof(pending)) {
+    prefs.end();
+    return;
+  }
+
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (pending.appAddress == 0 || (running && running->address == pending.appAddress)) {
+    OtaBundleSlots active;
+    if (prefs.getBytes("bactive", &active, sizeof(active)) != sizeof(active)) {
+      memset(&active, 0, sizeof(active));
+    }
+    for (int i = 0; i < OTA_BUNDLE_MAX_ITEMS && pending.targets[i][0]; i++) {
+      int index = findBundleTarget(active, pending.targets[i]);
+      if (index < 0) index = findBundleTarget(active, "");
+      if (index < 0) continue;
+      memcpy(active.targets[index], pending.targets[i], OTA_BUNDLE_NAME_SIZE);
+      active.slots[index] = pending.slots[i];
+    }
+    prefs.putBytes("bactive", &active, sizeof(active));
+    OTA_LOGLN("[OTA] Bundle committed: data partitions switched");
+  } else {
+    OTA_LOGLN("[OTA] Bundle not committed (app did not switch), keeping the previous data partitions");
+  }
+  prefs.remove("bpending");
+  prefs.end();
+}
+
+#endif
+
+const esp_partition_t* BLEOtaUpdate::getBundlePartition(const char* target) {
+#if BLE_OTA_BUNDLES
+  promoteBundle();
+  return findBundlePartition(target, activeBundleSlot(target));
+#else
+  return nullptr;
+#endif
+}
+
+// flashEnd(), or for bundles the commit of every payload
+bool BLEOtaUpdate::commitSession() {
+#if BLE_OTA_BUNDLES
+  if (bundleSession) return commitBundle();
+#endif
+  return flashEnd();
+}
+
+#if BLE_OTA_WIFI
+static void sendHttpResponse(WiFiClient& client, const char* status, uint32_t offset) {
+  client.printf("HTTP/1.1 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\noffset=%u\n", status, offset);
+  client.stop();
+}
+#endif
+
+// Decided in HELLO on the BLE task; the radio and the server are brought up by loop()
+bool BLEOtaUpdate::offerWifiDataPath() {
+#if BLE_OTA_WIFI
+  // Merkle, zblk and pull sessions interleave control messages with the data
+  if (!wifiDataPath || wifiServer || wifiStartPending ||
+      (sessionStats.features & (OTA_FEATURE_MERKLE | OTA_FEATURE_COMPRESSED | OTA_FEATURE_PULL))) {
+    return false;
+  }
+  static const char alphabet[] = "abcdefghijkmnpqrstuvwxyz23456789";
+  wifiSoftAp = WiFi.status() != WL_CONNECTED;
+  if (wifiSoftAp) {
+    // The SoftAP credentials are only handed over a link that is encrypted
+    Peer* peer = findPeer(uploaderConnId);
+    if (!peer || !peer->encrypted) {
+      OTA_LOGLN("[OTA] Wi-Fi SoftAP needs an encrypted link, staying on BLE");
+      return false;
+    }
+    snprintf(wifiSsid, sizeof(wifiSsid), "BLEOTA-%06X", (unsigned)(esp_random() & 0xFFFFFF));
+    for (size_t i = 0; i < 12; i++) {
+      wifiPsk[i] = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+    }
+    wifiPsk[12] = '\0';
+  }
+  // Anyone on a shared network can reach the endpoint, so PUT /ota must carry this
+  for (size_t i = 0; i < OTA_WIFI_TOKEN_SIZE; i++) {
+    wifiToken[i] = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+  }
+  wifiToken[OTA_WIFI_TOKEN_SIZE] = '\0';
+  wifiStartPending = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// WIFI:ready tells the client where to PUT; WIFI:closed sends it back to BLE from the start
+void BLEOtaUpdate::startWifiDataPath() {
+#if BLE_OTA_WIFI
+  wifiStartPending = false;
+  if (!otaInProgress) return;
+  IPAddress address;
+  if (wifiSoftAp) {
+    if (!WiFi.softAP(wifiSsid, wifiPsk)) {
+      OTA_LOGLN("[OTA] Wi-Fi SoftAP failed, staying on BLE");
+      sendStatusTo(uploaderConnId, "WIFI:closed,offset=" + String(otaReceived), OtaNotifyPriority::CONTROL);
+      return;
+    }
+    address = WiFi.softAPIP();
+  } else {
+    address = WiFi.localIP();
+  }
+  wifiRequest = "";
+  wifiHeadDone = false;
+  wifiBodyRemaining = 0;
+  wifiServer = new WiFiServer(OTA_WIFI_PORT);
+  wifiServer->begin();
+
+  String ready = "WIFI:ready,wifi=" + address.toString() + ":" + String(OTA_WIFI_PORT);
+  ready += ",token=" + String(wifiToken);
+  if (wifiSoftAp) {
+    ready += ",ssid=" + String(wifiSsid) + ",psk=" + String(wifiPsk);
+  }
+  sendStatusTo(uploaderConnId, ready, OtaNotifyPriority::CONTROL);
+  OTA_LOG("[OTA] Wi-Fi data path on %s:%u (%s)\n", address.toString().c_str(), OTA_WIFI_PORT,
+          wifiSoftAp ? wifiSsid : "station");
+#endif
+}
+
+// One HTTP PUT per connection; the body goes through the same pipeline as BLE data
+void BLEOtaUpdate::serviceWifiDataPath() {
+#if BLE_OTA_WIFI
+  if (wifiStartPending) startWifiDataPath();
+  if (!wifiServer) return;
+  if (!otaInProgress) {
+    stopWifiDataPath();
+    return;
+  }
+  if (!wifiClient) {
+    wifiClient = wifiServer->available();
+    wifiRequest = "";
+    wifiHeadDone = false;
+    wifiBodyRemaining = 0;
+    return;
+  }
+
+  // Request head: "PUT /ota" with the session token and a Content-Length equal to what is still missing
+  while (!wifiHeadDone && wifiClient.available()) {
+    wifiRequest += (char)wifiClient.read();
+    if (wifiRequest.length() >= OTA_WIFI_HEADER_MAX) {
+      sendHttpResponse(wifiClient, "431 Request Header Fields Too Large", otaReceived);
+      return;
+    }
+    if (!wifiRequest.endsWith("\r\n\r\n")) continue;
+    wifiHeadDone = true;
+    wifiRequest.toLowerCase();
+    int field = wifiRequest.indexOf("content-length:");
+    wifiBodyRemaining = field < 0 ? 0 : wifiRequest.substring(field + strlen("content-length:")).toInt();
+    field = wifiRequest.indexOf(OTA_WIFI_TOKEN_HEADER);
+    String token = field < 0 ? "" : wifiRequest.substring(field + strlen(OTA_WIFI_TOKEN_HEADER),
+                                                          wifiRequest.indexOf('\r', field));
+    token.trim();
+    if (token != wifiToken) {
+      // No second guess: the endpoint closes and the session stays on BLE
+      OTA_LOGLN("[OTA] Wi-Fi request without the session token, closing the endpoint");
+      sendHttpResponse(wifiClient, "403 Forbidden", otaReceived);
+      sendStatusTo(uploaderConnId, "WIFI:closed,offset=" + String(otaReceived), OtaNotifyPriority::CONTROL);
+      stopWifiDataPath();
+      return;
+    }
+    if (!wifiRequest.startsWith("put /ota ") || wifiBodyRemaining == 0 ||
+        wifiBodyRemaining != otaFileSize - otaReceived) {
+      // The reply tells the client where to resume
+      sendHttpResponse(wifiClient, "409 Conflict", otaReceived);
+      return;
+    }
+  }
+
+  // The BLE task handles DONE, ABORT and disconnects meanwhile; the session lock keeps them out
+  // of the middle of a chunk
+  uint8_t chunk[OTA_MAX_ATT_VALUE];  // Decryption works on at most one ATT value at a time
+  xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+  while (wifiHeadDone && wifiBodyRemaining > 0 && otaInProgress && wifiClient.available()) {
+    int length = wifiClient.read(chunk, min<size_t>(sizeof(chunk), wifiBodyRemaining));
+    if (length <= 0) break;
+    acceptFirmwareData(chunk, length);
+    wifiBodyRemaining -= length;
+  }
+  xSemaphoreGiveRecursive(sessionLock);
+  if (wifiHeadDone && wifiBodyRemaining == 0 && otaReceived == otaFileSize) {
+    sendHttpResponse(wifiClient, "200 OK", otaReceived);
+    OTA_LOGLN("[OTA] Image received over Wi-Fi");
+    stopWifiDataPath();
+  } else if (!wifiClient.connected() && !wifiClient.available()) {
+    OTA_LOG("[OTA] Wi-Fi stream closed at %u bytes, continuing over BLE\n", otaReceived);
+    sendStatusTo(uploaderConnId, "WIFI:closed,offset=" + String(otaReceived), OtaNotifyPriority::CONTROL);
+    stopWifiDataPath();
+  }
+#endif
+}
+
+// Only called from loop(), which also owns the server while it exists
+void BLEOtaUpdate::stopWifiDataPath() {
+#if BLE_OTA_WIFI
+  if (!wifiServer) return;
+  wifiClient.stop();
+  wifiServer->end();
+  delete wifiServer;
+  wifiServer = nullptr;
+  if (wifiSoftAp) {
+    WiFi.softAPdisconnect(true);
+  }
+  wifiRequest = "";
+  wifiHeadDone = false;
+  wifiBodyRemaining = 0;
+#endif
+}
+
+void BLEOtaUpdate::setWifiDataPath(bool enable) {
+#if BLE_OTA_WIFI
+  wifiDataPath = enable;
+#endif
+}
+
+size_t BLEOtaUpdate::libraryBufferBytes() const {
+  size_t bytes = sectorBuffer ? SPI_FLASH_SEC_SIZE : 0;
+#if BLE_OTA_COMMANDS
+  bytes += echoSamples ? echoTotal * sizeof(uint32_t) : 0;
+#endif
+#if BLE_OTA_ENCRYPTION
+  bytes += plainBuffer ? plainBufferSize : 0;
+#endif
+#if BLE_OTA_MERKLE
+  bytes += merkleBlock ? OTA_MERKLE_BLOCK_SIZE : 0;
+#endif
+#if BLE_OTA_COMPRESSION
+  bytes += frameBuffer ? OTA_INFLATE_STATE_SIZE + OTA_ZBLK_FRAME_HEADER + 2 * OTA_ZBLK_BLOCK_SIZE : 0;
+#endif
+#if BLE_OTA_BULK_READ
+  bytes += readBuffer ? OTA_PULL_OFFSET_SIZE + readChunk : 0;
+#endif
+  return bytes;
+}
+
+void BLEOtaUpdate::noteBufferHeap(size_t transient) {
+  memoryReport.peakBufferHeap = max(memoryReport.peakBufferHeap, (uint32_t)(libraryBufferBytes() + transient));
+}
+
+void BLEOtaUpdate::getMemoryReport(OtaMemoryReport& report) {
+  report = memoryReport;
+  report.bufferHeap = libraryBufferBytes();
+  report.staticRam = sizeof(BLEOtaUpdate) + OTA_FOOTPRINT_TRACE;
+  // ESP-IDF reports stack high-water marks in bytes
+  report.bleTaskStackFree = bleTaskHandle ? uxTaskGetStackHighWaterMark(bleTaskHandle) : 0;
+  report.loopTaskStackFree = loopTaskHandle ? uxTaskGetStackHighWaterMark(loopTaskHandle) : 0;
+  report.freeHeap = ESP.getFreeHeap();
+  report.minFreeHeap = ESP.getMinFreeHeap();
+}
+
+void BLEOtaUpdate::printMemoryReport(Print& out) {
+  OtaMemoryReport report;
+  getMemoryReport(report);
+  out.printf("[OTA] Heap: %u free, %u minimum, largest block %u before / %u after last session\n",
+             report.freeHeap, report.minFreeHeap, report.largestBlockBeforeSession, report.largestBlockAfterSession);
+  out.printf("[OTA] Library heap: BLE init %u, server %u, service %u, buffers %u (peak %u)\n",
+             report.bleInitHeap, report.serverHeap, report.serviceHeap, report.bufferHeap, report.peakBufferHeap);
+  out.printf("[OTA] Stack free (high-water): BLE task %u, loop task %u\n",
+             report.bleTaskStackFree, report.loopTaskStackFree);
+  out.printf("[OTA] Static footprint: object %u, trace ring %u; on demand: history %u, echo %u, benchmark %u\n",
+             (unsigned)sizeof(BLEOtaUpdate), (unsigned)OTA_FOOTPRINT_TRACE, (unsigned)OTA_FOOTPRINT_HISTORY,
+             (unsigned)OTA_FOOTPRINT_ECHO, (unsigned)OTA_FOOTPRINT_BENCH);
+}
+
+#if BLE_OTA_TRACE
+static String traceBeginLine(uint32_t head, uint32_t count) {
+  return "TRACE:begin,mhz=" + String(getCpuFrequencyMhz()) + ",n=" + String(count) + ",lost=" + String(head - count);
+}
+
+// As many records from `next` as fit in maxLength characters
+static String traceRecordsLine(uint32_t& next, uint32_t end, size_t maxLength) {
+  String line = "TRACE:";
+  for (; next < end && line.length() + 16 <= maxLength; next++) {
+    const OtaTraceRecord& record = bleOtaTraceRing[next & (BLE_OTA_TRACE_SIZE - 1)];
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%08x%08x", record.cycles, record.eventArg);
+    line += hex;
+  }
+  return line;
+}
+#endif
+
+// Oldest record first
+void BLEOtaUpdate::dumpTrace(Print& out) {
+#if BLE_OTA_TRACE
+  uint32_t head = __atomic_load_n(&bleOtaTraceHead, __ATOMIC_RELAXED);
+  uint32_t count = min(head, (uint32_t)BLE_OTA_TRACE_SIZE);
+  out.println(traceBeginLine(head, count));
+  for (uint32_t next = head - count; next < head;) {
+    out.println(traceRecordsLine(next, head, 6 + 16 * OTA_TRACE_RECORDS_PER_LINE));
+  }
+  out.println("TRACE:end");
+#else
+  out.println("TRACE:disabled");
+#endif
+}
+
+#if BLE_OTA_COMMANDS
+// #TRACE: the begin line now, the records from loop() while the link has room
+void BLEOtaUpdate::startTraceDump() {
+#if BLE_OTA_TRACE
+  if (pServer->getPeerMTU(commandConnId) - 3 < 6 + 16) {
+    sendStatusTo(commandConnId, "TRACE:error=mtu", OtaNotifyPriority::ERROR);  // Not even one record fits
+    return;
+  }
+  traceEnd = __atomic_load_n(&bleOtaTraceHead, __ATOMIC_RELAXED);
+  uint32_t count = min(traceEnd, (uint32_t)BLE_OTA_TRACE_SIZE);
+  traceNext = traceEnd - count;
+  traceConnId = commandConnId;
+  sendStatusTo(traceConnId, traceBeginLine(traceEnd, count), OtaNotifyPriority::CONTROL);
+#else
+  sendStatusTo(commandConnId, "TRACE:disabled", OtaNotifyPriority::CONTROL);
+#endif
+}
+
+void BLEOtaUpdate::serviceTraceDump() {
+#if BLE_OTA_TRACE
+  if (traceConnId == OTA_NO_CONNECTION) return;
+  Peer* peer = findPeer(traceConnId);
+  if (!peer) {
+    traceConnId = OTA_NO_CONNECTION;
+    return;
+  }
+  size_t maxLength = pServer->getPeerMTU(traceConnId) - 3;
+  // A few lines per call, and none while the link is congested; the rest waits for the next loop()
+  for (int lines = 0; lines < OTA_NOTIFY_QUEUE_SIZE / 2 && !peer->congested; lines++) {
+    // Recording goes on during the dump: records overwritten before they were sent are skipped
+    uint32_t head = __atomic_load_n(&bleOtaTraceHead, __ATOMIC_RELAXED);
+    if (head - traceNext > BLE_OTA_TRACE_SIZE) traceNext = head - BLE_OTA_TRACE_SIZE;
+    if (traceNext >= traceEnd) {
+      sendStatusTo(traceConnId, "TRACE:end", OtaNotifyPriority::CONTROL);
+      traceConnId = OTA_NO_CONNECTION;
+      return;
+    }
+    sendStatusTo(traceConnId, traceRecordsLine(traceNext, traceEnd, maxLength), OtaNotifyPriority::CONTROL);
+  }
+#endif
+}
+
+void BLEOtaUpdate::startEchoTest(uint16_t count) {
+  free(echoSamples);
+  echoTotal = constrain(count, 1, OTA_ECHO_MAX_SAMPLES);
+  echoSamples = (uint32_t*)malloc(echoTotal * sizeof(uint32_t));
+  if (!echoSamples) return;
+  noteBufferHeap();
+  echoSeq = 0;
+  linkTestResult.rttSamples = 0;
+  linkTestResult.rttLost = 0;
+  OTA_LOG("[OTA] Echo test: %u pings\n", echoTotal);
+  sendEchoPing();
+}
+
+void BLEOtaUpdate::sendEchoPing() {
+  echoSentAtUs = micros();
+  sendStatusTo(commandConnId, "PING:" + String(echoSeq), OtaNotifyPriority::CONTROL);
+}
+
+void BLEOtaUpdate::advanceEchoTest() {
+  if (++echoSeq < echoTotal) {
+    sendEchoPing();
+  } else {
+    finishEchoTest();
+  }
+}
+
+void BLEOtaUpdate::finishEchoTest() {
+  uint16_t n = linkTestResult.rttSamples;
+  std::sort(echoSamples, echoSamples + n);
+  linkTestResult.rttP50Us = n ? echoSamples[(n - 1) * 50 / 100] : 0;
+  linkTestResult.rttP90Us = n ? echoSamples[(n - 1) * 90 / 100] : 0;
+  linkTestResult.rttP99Us = n ? echoSamples[(n - 1) * 99 / 100] : 0;
+  linkTestResult.rttMaxUs = n ? echoSamples[n - 1] : 0;
+  free(echoSamples);
+  echoSamples = nullptr;
+
+  String result = "RTT:n=" + String(n);
+  result += ",p50=" + String(linkTestResult.rttP50Us);
+  result += ",p90=" + String(linkTestResult.rttP90Us);
+  result += ",p99=" + String(linkTestResult.rttP99Us);
+  result += ",max=" + String(linkTestResult.rttMaxUs);
+  result += ",lost=" + String(linkTestResult.rttLost);
+  sendStatusTo(commandConnId, result, OtaNotifyPriority::CONTROL);
+  OTA_LOG("[OTA] Echo test: %s (us)\n", result.c_str());
+}
+#endif
+
+void BLEOtaUpdate::onClientConnect(uint16_t connId, const uint8_t* peerAddress, uint16_t connInterval) {
+  OTA_TRACE(CONNECT, connId);
+  bleTaskHandle = xTaskGetCurrentTaskHandle();
+  Peer* peer = nullptr;
+  for (Peer& slot : peers) {
+    if (!slot.used) {
+      peer = &slot;
+      break;
+    }
+  }
+  if (!peer) {
+    OTA_LOGLN("[BLE] Connection table full, disconnecting");
+    pServer->disconnect(connId);
+    return;
+  }
+  memset(peer, 0, sizeof(Peer));
+  peer->connId = connId;
+  memcpy(peer->address, peerAddress, sizeof(peer->address));
+  peer->connectedAtMs = millis();
+  peer->connIntervalUnits = connInterval;
+  peer->used = true;
+  peerCount++;
+  bool first = !clientConnected;
+  clientConnected = true;
+  
+  // Bonded peers can skip service discovery using their cached attribute table
+  int bondCount = esp_ble_get_bond_device_num();
+  if (bondCount > 0) {
+    esp_ble_bond_dev_t* bonds = new esp_ble_bond_dev_t[bondCount];
+    esp_ble_get_bond_device_list(&bondCount, bonds);
+    for (int i = 0; i < bondCount; i++) {
+      if (memcmp(bonds[i].bd_addr, peerAddress, sizeof(esp_bd_addr_t)) == 0) {
+        peer->bonded = true;
+        break;
+      }
+    }
+    delete[] bonds;
+  }
+  
+  OTA_LOG("[BLE] Client connected (%u of %u)\n", peerCount, OTA_MAX_CONNECTIONS);
+  if (first && connectionCallback) {
+    OTA_TRACE(CALLBACK_BEGIN, (uint8_t)OtaTraceCallback::CONNECTION);
+    connectionCallback(true);
+    OTA_TRACE(CALLBACK_END, (uint8_t)OtaTraceCallback::CONNECTION);
+  }
+  // Advertising stops on connect; keep it up while there is room for an observer
+  if (peerCount < OTA_MAX_CONNECTIONS) {
+    BLEDevice::startAdvertising();
+  }
+  sendStatusTo(connId, "Connected", OtaNotifyPriority::APP);
+}
+
+void BLEOtaUpdate::onClientDisconnect(uint16_t connId) {
+  OTA_TRACE(DISCONNECT, connId);
+  Peer* peer = findPeer(connId);
+  if (!peer) return;
+  peer->used = false;
+  peerCount--;
+  clientConnected = peerCount > 0;
+  clearNotifications(connId);
+#if BLE_OTA_BULK_READ
+  if (connId == readConnId) {
+    releaseBulkRead();
+  }
+#endif
+#if BLE_OTA_COMMANDS && BLE_OTA_BENCHMARK
+  if (connId == benchConnId) {
+    benchConnId = OTA_NO_CONNECTION;
+  }
+#endif
+#if BLE_OTA_COMMANDS
+  if (connId == commandConnId) {
+    free(echoSamples);
+    echoSamples = nullptr;
+    commandConnId = OTA_NO_CONNECTION;
+  }
+#endif
+  if (connId == uploaderConnId) {
+    xSemaphoreTakeRecursive(sessionLock, portMAX_DELAY);
+    // Wi-Fi sessions and link tests are not held: the data path or the measurement went with the link
+    if (otaInProgress && !sessionHeld && (sessionStats.features & OTA_FEATURE_RESUME) &&
+        !(sessionStats.features & (OTA_FEATURE_SINK | OTA_FEATURE_WIFI))) {
+      holdSession();
+    } else {
+      longWritePending = false;
+      releaseImageCipher();
+      releaseMerkleBlock();
+      releaseInflate();
+      if (otaInProgress) {
+        OTA_LOGLN("[OTA] ERROR: Client disconnected during update");
+        abortUpdate();
+      }
+    }
+    uploaderConnId = OTA_NO_CONNECTION;
+    xSemaphoreGiveRecursive(sessionLock);
+  }
+  OTA_LOGLN("[BLE] Client disconnected. Re-advertising...");
+  if (!clientConnected && connectionCallback) {
+    OTA_TRACE(CALLBACK_BEGIN, (uint8_t)OtaTraceCallback::CONNECTION);
+    connectionCallback(false);
+    OTA_TRACE(CALLBACK_END, (uint8_t)OtaTraceCallback::CONNECTION);
+  }
+  updateAdvertisingData();
+  BLEDevice::startAdvertising();
+}
+
+void BLEOtaUpdate::updateProgress() {
+  uint8_t percentage = getUpdatePercentage();
+  OTA_LOG("[OTA] Progress: %d%% (%u/%u)\r", percentage, otaReceived, otaFileSize);
+  
+  if (progressCallback) {
+    OTA_TRACE(CALLBACK_BEGIN, (uint8_t)OtaTraceCallback::PROGRESS);
+    progressCallback(otaReceived, otaFileSize, percentage);
+    OTA_TRACE(CALLBACK_END, (uint8_t)OtaTraceCallback::PROGRESS);
+  }
+  
+  sendProgress(otaReceived, otaFileSize);
+}
+
+void BLEOtaUpdate::setOtaStatus(OtaStatus status, const char* message) {
+  otaStatus = status;
+  if (status == OtaStatus::COMPLETED || status == OtaStatus::ERROR || status == OtaStatus::ABORTED) {
+    OTA_TRACE(SESSION_END, (uint8_t)status);
+    recordSession(status);
+  }
+  if (statusCallback) {
+    OTA_TRACE(CALLBACK_BEGIN, (uint8_t)OtaTraceCallback::STATUS);
+    statusCallback(status, message);
+    OTA_TRACE(CALLBACK_END, (uint8_t)OtaTraceCallback::STATUS);
+  }
+  if (message) {
+    OTA_LOG("[OTA Status] %s\n", message);
+  }
+}
+
+// BLE Callback Classes Implementation
+void BLEOtaUpdate::gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param) {
+  if (instance) {
+    instance->handleGattsEvent(event, param);
+  }
+}
+
+void BLEOtaUpdate::gapEventHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+  if (instance) {
+    instance->handleGapEvent(event, param);
+  }
+}
+
+void BLEOtaUpdate::ServerCallbacks::onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+  if (instance) {
+    instance->onClientConnect(param->connect.conn_id, param->connect.remote_bda, param->connect.conn_params.interval);
+  }
+}
+
+void BLEOtaUpdate::ServerCallbacks::onDisconnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+  if (instance) {
+    instance->onClientDisconnect(param->disconnect.conn_id);
+  }
+}
+
+// exec_write carries conn_id at the same offset, so executed long writes resolve too
+void BLEOtaUpdate::OtaCharacteristicCallbacks::onWrite(BLECharacteristic* pCharacteristic,
+                                                       esp_ble_gatts_cb_param_t* param) {
+  if (instance) {
+    instance->handleOtaWrite(pCharacteristic, param->write.conn_id);
+  }
+}
+
+#if BLE_OTA_COMMANDS
+void BLEOtaUpdate::CommandCharacteristicCallbacks::onWrite(BLECharacteristic* pCharacteristic,
+                                                           esp_ble_gatts_cb_param_t* param) {
+  if (instance) {
+    instance->handleCommandWrite(pCharacteristic, param->write.conn_id);
+  }
+}
+#endif
\ No newline at end of file
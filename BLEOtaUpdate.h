@@ -6,18 +6,360 @@
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLE2902.h>
+#include <BLESecurity.h>
+#include <Preferences.h>
 #include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/aes.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
-// Default UUIDs - can be overridden
+// Wi-Fi data path: build with -DBLE_OTA_WIFI=1 on chips with Wi-Fi (see setWifiDataPath())
+#ifndef BLE_OTA_WIFI
+#define BLE_OTA_WIFI 0
+#endif
+#if BLE_OTA_WIFI
+#include <WiFi.h>
+#endif
+
+// Compile-time feature set: build with -DBLE_OTA_<NAME>=0 to leave a feature out. A disabled feature's
+// members and code are preprocessed away, its public setters become no-ops that report failure, and
+// HELLO refuses its stages.
+#ifndef BLE_OTA_LOG
+#define BLE_OTA_LOG                 1       // [OTA]/[BLE] messages on Serial
+#endif
+#ifndef BLE_OTA_COMMANDS
+#define BLE_OTA_COMMANDS            1       // Command characteristic: commands, # system commands, bulk read
+#endif
+#ifndef BLE_OTA_PROGRESS
+#define BLE_OTA_PROGRESS            1       // PROGRESS:<received>/<total> notifications
+#endif
+#ifndef BLE_OTA_HISTORY
+#define BLE_OTA_HISTORY             1       // Session history characteristic (records stay in NVS either way)
+#endif
+#ifndef BLE_OTA_ENCRYPTION
+#define BLE_OTA_ENCRYPTION          1       // OTA_FEATURE_ENCRYPTED sessions
+#endif
+#ifndef BLE_OTA_MERKLE
+#define BLE_OTA_MERKLE              1       // OTA_FEATURE_MERKLE sessions
+#endif
+#ifndef BLE_OTA_COMPRESSION
+#define BLE_OTA_COMPRESSION         1       // OTA_FEATURE_COMPRESSED (zblk) sessions, needs ROM inflate
+#endif
+#ifndef BLE_OTA_SIGNATURE
+#define BLE_OTA_SIGNATURE           1       // setSigningKey(): ECDSA P-256 image signatures
+#endif
+#ifndef BLE_OTA_PULL
+#define BLE_OTA_PULL                1       // OTA_FEATURE_PULL sessions
+#endif
+#ifndef BLE_OTA_BUNDLES
+#define BLE_OTA_BUNDLES             1       // OTA_FEATURE_BUNDLE sessions and getBundlePartition()
+#endif
+#ifndef BLE_OTA_TUNING
+#define BLE_OTA_TUNING              1       // setAutoTuning(): per-session window/interval tuner
+#endif
+#ifndef BLE_OTA_BENCHMARK
+#define BLE_OTA_BENCHMARK           1       // runSelfBenchmark() and #BENCH
+#endif
+#ifndef BLE_OTA_BULK_READ
+#define BLE_OTA_BULK_READ           BLE_OTA_COMMANDS  // #READ bulk reads (requested on the command characteristic)
+#endif
+#if BLE_OTA_BULK_READ && !BLE_OTA_COMMANDS
+#error "BLE_OTA_BULK_READ needs BLE_OTA_COMMANDS"
+#endif
+
+#if BLE_OTA_LOG
+#define OTA_LOG(...) Serial.printf(__VA_ARGS__)
+#define OTA_LOGLN(msg) Serial.println(msg)
+#else
+#define OTA_LOG(...) do { if (0) Serial.printf(__VA_ARGS__); } while (0)
+#define OTA_LOGLN(msg) do { if (0) Serial.println(msg); } while (0)
+#endif
+
+// Default UUIDs - can be overridden (at build time, or at runtime with the set*UUID() methods)
+#ifndef DEFAULT_SERVICE_UUID
 #define DEFAULT_SERVICE_UUID        "12345678-1234-5678-9ABC-DEF012345678"
+#endif
+#ifndef DEFAULT_OTA_CHAR_UUID
 #define DEFAULT_OTA_CHAR_UUID       "87654321-4321-8765-CBA9-FEDCBA987654"
+#endif
+#ifndef DEFAULT_COMMAND_CHAR_UUID
 #define DEFAULT_COMMAND_CHAR_UUID   "11111111-2222-3333-4444-555555555555"
+#endif
+#ifndef DEFAULT_STATUS_CHAR_UUID
 #define DEFAULT_STATUS_CHAR_UUID    "AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEEE"
+#endif
+#ifndef DEFAULT_HISTORY_CHAR_UUID
+#define DEFAULT_HISTORY_CHAR_UUID   "AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEE1"
+#endif
+
+// 128-bit UUIDs as 16 bytes, least significant first like esp_bt_uuid_t. The parser is constexpr
+// (C++11 rules), so literals are converted by the compiler. It takes "8-4-4-4-12" text and the
+// 16-bit ("180D") and 32-bit ("0000180D") short forms, which expand on the Bluetooth Base UUID.
+// A malformed literal in a constexpr OtaUuid fails the build; check strings that arrive at runtime
+// with otaUuidValid() first, or use the set*UUID() methods, which return false for them.
+#define OTA_UUID_BASE "00000000-0000-1000-8000-00805F9B34FB"
+
+constexpr uint8_t otaHexNibble(char c) {
+  return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 0xFF;
+}
+constexpr bool otaUuidDashAt(size_t i) { return i == 8 || i == 13 || i == 18 || i == 23; }
+constexpr bool otaUuidValidFrom(const char* text, size_t i) {
+  return i == 36 ? text[i] == '\0'
+                 : (otaUuidDashAt(i) ? text[i] == '-' : otaHexNibble(text[i]) != 0xFF) && otaUuidValidFrom(text, i + 1);
+}
+// Stops at 37, so a long string is never walked to its end
+constexpr size_t otaUuidLength(const char* text, size_t i = 0) {
+  return i < 37 && text[i] != '\0' ? otaUuidLength(text, i + 1) : i;
+}
+constexpr bool otaUuidHex(const char* text, size_t count) {
+  return count == 0 || (otaHexNibble(text[count - 1]) != 0xFF && otaUuidHex(text, count - 1));
+}
+constexpr bool otaUuidValidLength(const char* text, size_t length) {
+  return length == 36 ? otaUuidValidFrom(text, 0) : (length == 4 || length == 8) && otaUuidHex(text, length);
+}
+constexpr bool otaUuidValid(const char* text) {
+  return text != nullptr && otaUuidValidLength(text, otaUuidLength(text));
+}
+// Not constexpr on purpose: reaching it while the compiler evaluates a constexpr OtaUuid is a build
+// error. At runtime it logs and fails an assert(), which aborts the device unless assertions are
+// compiled out (NDEBUG); only then does the constructor go on to yield the Base UUID.
+size_t otaUuidRejected(const char* text);
+
+struct OtaUuid {
+  uint8_t bytes[16];
+
+  constexpr OtaUuid() : bytes{} {}
+  explicit constexpr OtaUuid(const char* text)
+    : OtaUuid(text, otaUuidValid(text) ? otaUuidLength(text) : otaUuidRejected(text)) {}
+
+  BLEUUID toBLEUUID() const { return BLEUUID(const_cast<uint8_t*>(bytes), sizeof(bytes), false); }
+
+private:
+  constexpr OtaUuid(const char* text, size_t length)
+    : bytes{byteAt(text, length, 15), byteAt(text, length, 14), byteAt(text, length, 13), byteAt(text, length, 12),
+            byteAt(text, length, 11), byteAt(text, length, 10), byteAt(text, length, 9), byteAt(text, length, 8),
+            byteAt(text, length, 7), byteAt(text, length, 6), byteAt(text, length, 5), byteAt(text, length, 4),
+            byteAt(text, length, 3), byteAt(text, length, 2), byteAt(text, length, 1), byteAt(text, length, 0)} {}
+
+  // Byte n in reading order sits at 2n in the text, plus one for each dash before it
+  static constexpr size_t textIndex(size_t n) { return 2 * n + (n >= 4) + (n >= 6) + (n >= 8) + (n >= 10); }
+  static constexpr uint8_t hexByte(const char* text, size_t i) {
+    return otaHexNibble(text[i]) << 4 | otaHexNibble(text[i + 1]);
+  }
+  // Short forms fill the low end of the first four bytes; the rest comes from the Base UUID
+  static constexpr uint8_t byteAt(const char* text, size_t length, size_t n) {
+    return length == 36 ? hexByte(text, textIndex(n))
+         : n < 4 && 2 * n + length >= 8 ? hexByte(text, 2 * n + length - 8)
+         : hexByte(OTA_UUID_BASE, textIndex(n));
+  }
+};
+
+static_assert(otaUuidValid(DEFAULT_SERVICE_UUID), "DEFAULT_SERVICE_UUID is not a UUID");
+static_assert(otaUuidValid(DEFAULT_OTA_CHAR_UUID), "DEFAULT_OTA_CHAR_UUID is not a UUID");
+static_assert(otaUuidValid(DEFAULT_COMMAND_CHAR_UUID), "DEFAULT_COMMAND_CHAR_UUID is not a UUID");
+static_assert(otaUuidValid(DEFAULT_STATUS_CHAR_UUID), "DEFAULT_STATUS_CHAR_UUID is not a UUID");
+static_assert(otaUuidValid(DEFAULT_HISTORY_CHAR_UUID), "DEFAULT_HISTORY_CHAR_UUID is not a UUID");
+static_assert(OtaUuid("180D").bytes[12] == 0x0D && OtaUuid("180D").bytes[13] == 0x18 &&
+              OtaUuid("180D").bytes[14] == 0 && OtaUuid("180D").bytes[0] == 0xFB,
+              "16-bit UUIDs expand on the Bluetooth Base UUID");
 
 // OTA Commands
 #define OTA_CMD_OPEN    "OPEN"
 #define OTA_CMD_DONE    "DONE"
 #define OTA_CMD_ABORT   "ABORT"
+#define OTA_CMD_HELLO   "HELLO"
+
+// HELLO handshake: "HELLO" + version (1) + image size (4, LE) + requested features (4, LE).
+// Replaces OPEN + size in a single write; the device answers with a HELLO: status line.
+#define OTA_PROTOCOL_VERSION        1
+#define OTA_HELLO_SIZE              14
+
+// Signed images: after the last data byte the client writes "SIG" + r || s (big-endian),
+// an ECDSA P-256 signature over the SHA-256 of the image
+#define OTA_CMD_SIG                 "SIG"
+#define OTA_SIGNATURE_SIZE          64
+#define OTA_SIG_CMD_SIZE            (3 + OTA_SIGNATURE_SIZE)
+#define OTA_PUBLIC_KEY_SIZE         65      // Uncompressed P-256 point: 0x04 || X || Y
+
+// Merkle sessions: each block is preceded by "PATH" + block index (4 bytes LE) + sibling hashes,
+// verified against the root from HELLO before it is written; rejected blocks are answered NAK:<index>
+#define OTA_CMD_PATH                "PATH"
+#define OTA_MERKLE_BLOCK_SIZE       4096
+#define OTA_MERKLE_MAX_DEPTH        15      // 128 MB images; a full PATH still fits one 512-byte write
+
+// Block-compressed sessions (codec "zblk"): the data is a sequence of frames, an 8-byte header
+// (compressed size u16, method u8, reserved u8, CRC32 of the decoded block u32, LE) plus the payload.
+// Blocks decode independently; a bad frame is answered NAK:<index> and the client resumes with
+// "SEEK" + block index (4 bytes LE) followed by that block's frame
+#define OTA_CMD_SEEK                "SEEK"
+#define OTA_ZBLK_BLOCK_SIZE         4096    // Decoded block size, also the tinfl window
+#define OTA_ZBLK_FRAME_HEADER       8
+#define OTA_ZBLK_STORED             0
+#define OTA_ZBLK_DEFLATE            1       // Raw deflate, no zlib header
+
+// Pull sessions: the device asks for data with REQ:<offset>,<length> (REQ:<size>,0 when it has
+// everything) and each data write starts with its image offset (4 bytes LE). Writes at any other
+// offset are dropped. A write past the next expected byte means one was lost, and the device
+// re-requests from the gap at once; OTA_PULL_RETRY_MS without progress is the backstop
+#define OTA_PULL_OFFSET_SIZE        4
+#define OTA_PULL_RETRY_MS           500
+
+// Resume: when a session that requested OTA_FEATURE_RESUME loses its link, the device keeps the
+// flash session, cipher, digest and block state for OTA_RESUME_HOLD_MS instead of aborting. A HELLO
+// with the flag, the same size and the same data format continues it (reply resume=<offset>, the
+// start of the first incomplete block); any other HELLO replaces it
+#ifndef OTA_RESUME_HOLD_MS
+#define OTA_RESUME_HOLD_MS          30000
+#endif
+#define OTA_RESUME_MATCH            (OTA_FEATURE_ENCRYPTED | OTA_FEATURE_MERKLE | OTA_FEATURE_COMPRESSED | \
+                                     OTA_FEATURE_PULL | OTA_FEATURE_BUNDLE)
+
+// Bulk reads: objects are streamed as OTA characteristic notifications framed like pull writes
+// (offset + data). The client acknowledges with #RACK every half window and reports a gap with
+// #RACK:<offset>,gap; a gap, or no RACK for OTA_READ_RETRY_MS, makes the device resend from there
+#define OTA_READ_RETRY_MS           1000
+#define OTA_READ_OBJECT_COREDUMP    "coredump"
+#define OTA_READ_OBJECT_LOG         "log"       // Buffer registered with setReadableLog()
+#define OTA_READ_OBJECT_PARTITION   "part:"     // part:<label>
+
+// Wi-Fi data path: once loop() has the endpoint up the device notifies WIFI:ready,wifi=<ip>:<port>,
+// token=<t> (plus ssid= and psk= for a temporary SoftAP, only over an encrypted link) and the client
+// may PUT the image to http://<ip>:<port>/ota with an X-OTA-Token header instead of writing it over BLE.
+// If the endpoint fails or the TCP stream ends early the device notifies WIFI:closed,offset=<n> and
+// BLE takes over from there
+#define OTA_WIFI_PORT               8080
+#define OTA_WIFI_HEADER_MAX         512
+#define OTA_WIFI_TOKEN_HEADER       "x-ota-token:"  // Matched against the lowercased request head
+#define OTA_WIFI_TOKEN_SIZE         16
+
+// Bundles: the data starts with a manifest ("OTAB", version 1, item count, 2 reserved bytes, then per
+// item the target name NUL-padded to 12 bytes, size u32 LE and SHA-256) and the payloads follow in
+// order. "app" goes to the next OTA slot; any other target <name> to the inactive one of the data
+// partitions <name>_0 / <name>_1. At DONE the new data slots are recorded as pending in NVS before the
+// boot partition switches; the next boot promotes them only if it runs the new app
+#define OTA_BUNDLE_MAGIC            "OTAB"
+#define OTA_BUNDLE_VERSION          1
+#define OTA_BUNDLE_MAX_ITEMS        4
+#define OTA_BUNDLE_NAME_SIZE        12
+#define OTA_BUNDLE_HEADER_SIZE      8
+#define OTA_BUNDLE_ENTRY_SIZE       (OTA_BUNDLE_NAME_SIZE + 4 + 32)
+#define OTA_BUNDLE_APP              "app"
+
+// Feature flags requested in HELLO and granted in the reply
+#define OTA_FEATURE_FLOW_CONTROL    0x00000001  // Device sends ACK:<offset> every half window
+#define OTA_FEATURE_LONG_WRITE      0x00000002  // Data may arrive as ATT long writes up to lw= bytes
+#define OTA_FEATURE_SINK            0x00000004  // Link test: run the protocol but discard the data
+#define OTA_FEATURE_ENCRYPTED       0x00000008  // Data is AES-CTR encrypted; HELLO carries the 16-byte IV
+#define OTA_FEATURE_MERKLE          0x00000010  // Per-block authentication; HELLO carries the Merkle root
+#define OTA_FEATURE_COMPRESSED      0x00000020  // Data is zblk frames; the HELLO size is the decoded size
+#define OTA_FEATURE_PULL            0x00000040  // Device requests ranges (REQ:) instead of ACKing pushed data
+#define OTA_FEATURE_WIFI            0x00000080  // Image data may arrive over HTTP; BLE stays the control channel
+#define OTA_FEATURE_BUNDLE          0x00000100  // Data is a bundle: manifest + payloads, committed together
+#define OTA_FEATURE_RESUME          0x00000200  // Session is held across a dropped link; the reply carries resume=
+#define OTA_FEATURES_SUPPORTED      (OTA_FEATURE_FLOW_CONTROL | OTA_FEATURE_LONG_WRITE | OTA_FEATURE_SINK | \
+                                     OTA_FEATURE_ENCRYPTED | OTA_FEATURE_MERKLE | OTA_FEATURE_COMPRESSED | \
+                                     OTA_FEATURE_PULL | OTA_FEATURE_WIFI | OTA_FEATURE_BUNDLE | OTA_FEATURE_RESUME)
+#define OTA_ENCRYPTION_IV_SIZE      16
+#define OTA_MAX_ATT_VALUE           512     // Largest single GATT write, sizes the decrypt buffer
+
+// System commands on the command characteristic (handled by the library, not forwarded)
+#define OTA_SYS_CMD_PREFIX          "#"
+#define OTA_SYS_CMD_PING            "#PING:"    // #PING:<token> -> PONG:<token>
+#define OTA_SYS_CMD_ECHO            "#ECHO:"    // #ECHO:<count> starts a device-timed RTT test
+#define OTA_SYS_CMD_PONG            "#PONG:"    // Client reply to PING:<seq> during the RTT test
+#define OTA_SYS_CMD_BENCH           "#BENCH"    // Run the self-benchmark, reply BENCH:...
+#define OTA_SYS_CMD_TRACE           "#TRACE"    // Dump the event trace as TRACE: lines
+#define OTA_SYS_CMD_MEM             "#MEM"      // Memory report, reply MEM:...
+#define OTA_SYS_CMD_READ            "#READ:"    // #READ:<object>[,<offset>,<length>] streams it back
+#define OTA_SYS_CMD_RACK            "#RACK:"    // #RACK:<bytes received in order>, the read-direction ACK
+#ifndef OTA_ECHO_MAX_SAMPLES
+#define OTA_ECHO_MAX_SAMPLES        64
+#endif
+#define OTA_ECHO_TIMEOUT_US         1000000
+
+// Status notification queue: drained by priority, held while the controller reports congestion
+#ifndef OTA_NOTIFY_QUEUE_SIZE
+#define OTA_NOTIFY_QUEUE_SIZE       8
+#endif
+#define OTA_NOTIFY_PRIORITIES       4
+// A status text longer than the recipient's MTU - 3 is sent as several frames; every frame but
+// the last ends with this character, and the client joins them before parsing
+#define OTA_STATUS_CONTINUED        '+'
+
+// Several centrals at once: the first to start a session holds the upload lock, the others observe
+// (status and throttled progress, delivered from loop() while an upload runs)
+#ifndef OTA_MAX_CONNECTIONS
+#define OTA_MAX_CONNECTIONS         3       // Keep within CONFIG_BT_ACL_CONNECTIONS
+#endif
+#define OTA_OBSERVER_PROGRESS_MS    250     // Observers get PROGRESS at most this often
+#define OTA_NO_CONNECTION           0xFFFF
+#define OTA_NOTIFY_ALL              0xFFFE  // Notification targets besides a conn ID
+#define OTA_NOTIFY_OBSERVERS        0xFFFD
+
+// Throughput auto-tuner: hill-climbs the flow-control window and connection interval
+#define OTA_TUNE_PERIOD_BYTES       32768
+#define OTA_TUNE_MIN_WINDOW         2048
+#define OTA_TUNE_MAX_WINDOW         32768
+#define OTA_TUNE_MIN_INTERVAL       6       // 7.5 ms (1.25 ms units)
+#define OTA_TUNE_MAX_INTERVAL       48      // 60 ms
+#define OTA_TUNE_LOG_SIZE           8
+
+// Buffer defaults, overridable at build time or with setUpdateBufferSize() / setFlowControlWindow()
+#ifndef OTA_DEFAULT_UPDATE_BUFFER
+#define OTA_DEFAULT_UPDATE_BUFFER   4096
+#endif
+#ifndef OTA_DEFAULT_FLOW_WINDOW
+#define OTA_DEFAULT_FLOW_WINDOW     8192
+#endif
+#define OTA_NVS_NAMESPACE           "bleota"
+
+// Session history: the last N session records survive the post-update reboot (one NVS write each)
+#ifndef OTA_HISTORY_SIZE
+#define OTA_HISTORY_SIZE            8
+#endif
+#define OTA_STALL_THRESHOLD_MS      250     // Gap between data packets counted as a stall
+
+// Self-benchmark: 16 sectors are erased and rewritten, at the start of a data partition labelled
+// OTA_BENCH_PARTITION when the table has one, else at the end of the inactive OTA slot
+#define OTA_BENCH_BLOCK_SIZE        4096
+#define OTA_BENCH_SECTORS           16
+#ifndef OTA_BENCH_PARTITION
+#define OTA_BENCH_PARTITION         "otabench"
+#endif
+
+// Event trace: build with -DBLE_OTA_TRACE=1 to record timestamped events into a RAM ring.
+// Disabled (the default), OTA_TRACE() expands to nothing and the ring is not allocated.
+#ifndef BLE_OTA_TRACE
+#define BLE_OTA_TRACE               0
+#endif
+#ifndef BLE_OTA_TRACE_SIZE
+#define BLE_OTA_TRACE_SIZE          512     // Records (8 bytes each), power of two
+#endif
+#define OTA_TRACE_RECORDS_PER_LINE  12      // dumpTrace() lines; #TRACE lines are sized from the peer MTU
+
+// Advertised OTA info (manufacturer data record in the scan response)
+#define OTA_ADV_COMPANY_ID_DEFAULT  0xFFFF  // Bluetooth SIG reserved ID for testing
+#define OTA_ADV_RECORD_VERSION      1
+#define OTA_ADV_HASH_PREFIX_LEN     4
+#define OTA_ADV_RECORD_SIZE         15      // company ID + record, see README
+
+// Capability flags (advertised to scanners)
+#define OTA_CAP_COMMAND_CHAR        0x0001
+#define OTA_CAP_STATUS_NOTIFY       0x0002
+#define OTA_CAP_BONDING             0x0004
+#define OTA_CAP_GATT_CACHING        0x0008
+#define OTA_CAP_HELLO               0x0010
+#define OTA_CAP_LINK_TEST           0x0020
+#define OTA_CAP_SIGNED              0x0040  // Images must carry a valid signature
+#define OTA_CAP_ENCRYPTED           0x0080  // Images must be encrypted with the device key
+
+// Fixed handle budget for the OTA service so the attribute table stays stable
+// across firmware versions and clients can reuse cached handles
+#define OTA_SERVICE_NUM_HANDLES     32
 
 // OTA Status
 enum class OtaStatus {
@@ -28,6 +370,201 @@ enum class OtaStatus {
   ABORTED
 };
 
+// One auto-tuner decision: settings in effect after the step and the throughput that led to it
+struct OtaTuneStep {
+  uint32_t atOffset;
+  uint32_t bytesPerSec;
+  uint32_t window;
+  uint16_t intervalUnits;
+};
+
+// Per-session statistics
+struct OtaSessionStats {
+  uint8_t peerAddress[6];
+  bool peerBonded;
+  uint32_t connectedAtMs;
+  uint32_t connectToFirstDataMs;  // Connection to first OTA write, 0 until it arrives
+  uint8_t protocolVersion;        // 0 for legacy OPEN sessions
+  uint32_t features;              // Granted OTA_FEATURE_* flags
+  uint16_t negotiatedMtu;
+  uint32_t setupMs;               // OPEN/HELLO to first firmware byte
+  uint32_t transferMs;            // First to last firmware byte
+  uint32_t longWrites;            // Data packets that arrived as ATT prepared writes
+  uint32_t crc32;                 // CRC-32 of the data received so far
+  uint32_t peakBytesPerSec;       // Best one-second throughput
+  uint16_t stalls;                // Gaps longer than OTA_STALL_THRESHOLD_MS between data packets
+  uint16_t connIntervalUnits;     // Current connection interval (1.25 ms units)
+  bool tuningFromCache;           // Session started from this peer's remembered settings
+  uint16_t tuneStepCount;         // Tuning decisions so far; the last OTA_TUNE_LOG_SIZE are in tuneLog
+  OtaTuneStep tuneLog[OTA_TUNE_LOG_SIZE];
+  OtaTuneStep tuneBest;           // Best settings seen, saved for bonded peers at DONE
+  uint32_t verifyUs;              // Signature check at DONE (digest finish + ECDSA verify)
+  bool signatureValid;
+  uint16_t blocksRejected;        // Merkle blocks or zblk frames that failed and were re-requested
+  uint16_t sectorsWritten;        // With setSkipUnchangedSectors(): sectors erased and programmed
+  uint16_t sectorsSkipped;        // Sectors that already held the incoming bytes
+  uint32_t sectorWriteUs;         // Erase + program time of the written sectors
+  uint32_t sectorCompareUs;       // Time spent comparing against the slot
+  uint16_t pullRequests;          // Pull sessions: REQ notifications sent
+  uint16_t pullRepairs;           // Ranges re-requested after OTA_PULL_RETRY_MS without progress
+  uint32_t pullDroppedBytes;      // Data that arrived at an unexpected offset and was ignored
+  uint16_t refusedWrites;         // OTA writes from observers while this session held the upload lock
+};
+
+// Link-only test results (sink sessions and the echo RTT test)
+struct OtaLinkTestResult {
+  uint32_t bytes;
+  uint32_t durationMs;
+  uint32_t bytesPerSec;
+  uint32_t lostBytes;
+  uint32_t crc32;
+  uint16_t rttSamples;
+  uint16_t rttLost;
+  uint32_t rttP50Us;
+  uint32_t rttP90Us;
+  uint32_t rttP99Us;
+  uint32_t rttMaxUs;
+};
+
+// Status notification classes, most urgent first; a full queue evicts the least urgent frame
+enum class OtaNotifyPriority : uint8_t {
+  ERROR,      // Refused sessions and failed requests
+  CONTROL,    // Flow control (ACK/REQ/NAK/TUNE), echo pings and protocol replies
+  PROGRESS,   // PROGRESS:<received>/<total>
+  APP         // sendStatus() from the sketch, e.g. periodic heartbeats
+};
+
+// Notification scheduler counters since begin()
+struct OtaNotifyStats {
+  uint32_t sent;
+  uint32_t coalesced;                       // Queued PROGRESS/ACK/TUNE frames replaced by a newer one
+  uint32_t dropped[OTA_NOTIFY_PRIORITIES];  // Per OtaNotifyPriority, lost to a full queue
+  uint32_t congestionEvents;                // Times the controller ran out of buffers
+  uint16_t maxQueueDepth;
+  uint32_t observerFrames;                  // Frames delivered to observers during uploads
+  uint32_t observerSendUs;                  // Time spent on those; / observerFrames = fan-out cost
+  uint32_t observerSkipped;                 // Observer copies skipped while that link was congested
+};
+
+// Data partition slots chosen by bundles (NVS "bactive"; "bpending" until the new app boots)
+struct OtaBundleSlots {
+  char targets[OTA_BUNDLE_MAX_ITEMS][OTA_BUNDLE_NAME_SIZE];  // Empty = unused
+  uint8_t slots[OTA_BUNDLE_MAX_ITEMS];
+  uint32_t appAddress;            // Pending only: OTA slot that must be running to promote, 0 for none
+};
+
+// Persistent session record (40 bytes, little-endian, as read from the history characteristic)
+#define OTA_RECORD_FLAG_BONDED      0x01
+#define OTA_RECORD_FLAG_LINK_TEST   0x02
+#define OTA_RECORD_FLAG_TUNED       0x04
+
+struct OtaSessionRecord {
+  uint32_t startTime;             // Unix time if the clock was set, else 0
+  uint32_t startUptimeMs;
+  uint32_t durationMs;            // Session start to outcome
+  uint32_t bytes;
+  uint32_t avgBytesPerSec;
+  uint32_t peakBytesPerSec;
+  uint32_t features;
+  uint16_t stalls;
+  uint16_t retries;               // Failed sessions immediately before this one
+  uint16_t mtu;
+  uint16_t connIntervalUnits;
+  uint8_t outcome;                // OtaStatus
+  uint8_t updateError;            // Update.getError(), 0 if none
+  uint8_t protocolVersion;
+  uint8_t flags;                  // OTA_RECORD_FLAG_*
+};
+
+// Self-benchmark results (throughputs in KB/s)
+struct OtaBenchmarkResult {
+  uint32_t sectorEraseUs;
+  uint32_t flashWriteKBps;
+  uint32_t flashReadKBps;
+  uint32_t sha256KBps;
+  bool sha256Hardware;
+  uint32_t aesCtrKBps;
+  bool aesHardware;
+  uint32_t crc32RomKBps;
+  uint32_t crc32SoftKBps;
+  uint32_t inflateKBps;           // Literal-only deflate (worst case), 0 without ROM miniz
+  uint32_t decryptUsPerKB;        // OTA data path: AES-256-CTR in 244-byte chunks
+  uint32_t merkleBlockUs;         // Verify one 4 KB block with a 10-level path (4 MB image)
+};
+
+// Trace event IDs, at most 127 (the 24-bit argument is noted per event)
+enum class OtaTraceEvent : uint8_t {
+  CONNECT = 1,          // conn ID
+  DISCONNECT,           // 0
+  CONN_PARAMS,          // Connection interval (1.25 ms units)
+  MTU,                  // Negotiated MTU
+  GATT_WRITE,           // Value length
+  LONG_WRITE_FRAGMENT,  // Fragment length
+  FLASH_WRITE_BEGIN,    // Offset
+  FLASH_WRITE_END,      // Offset
+  BUFFER_FLUSH,         // Offset of the sector Update erased and programmed in this write
+  ERASE_BEGIN,          // Partition offset
+  ERASE_END,
+  PROGRAM_BEGIN,        // Partition offset
+  PROGRAM_END,
+  NOTIFY,               // Value length
+  CALLBACK_BEGIN,       // OtaTraceCallback
+  CALLBACK_END,
+  SESSION_BEGIN,        // Image size
+  SESSION_END,          // OtaStatus
+  SECTOR_SKIPPED        // Partition offset of a sector that already held the right bytes
+};
+
+enum class OtaTraceCallback : uint8_t {
+  PROGRESS = 1,
+  STATUS,
+  COMMAND,
+  CONNECTION
+};
+
+#if BLE_OTA_TRACE
+// One trace record: the recording core's cycle counter and core << 31 | event << 24 | argument
+struct OtaTraceRecord {
+  uint32_t cycles;
+  uint32_t eventArg;
+};
+
+extern OtaTraceRecord bleOtaTraceRing[BLE_OTA_TRACE_SIZE];
+extern uint32_t bleOtaTraceHead;
+
+// Claim a slot and store two words; safe from both the BLE task and loop()
+#define OTA_TRACE(event, arg) do { \
+    uint32_t _slot = __atomic_fetch_add(&bleOtaTraceHead, 1, __ATOMIC_RELAXED) & (BLE_OTA_TRACE_SIZE - 1); \
+    bleOtaTraceRing[_slot].cycles = ESP.getCycleCount(); \
+    bleOtaTraceRing[_slot].eventArg = ((uint32_t)xPortGetCoreID() << 31) | \
+        ((uint32_t)OtaTraceEvent::event << 24) | ((uint32_t)(arg) & 0xFFFFFF); \
+  } while (0)
+#else
+#define OTA_TRACE(event, arg) do { (void)sizeof(arg); } while (0)
+#endif
+
+// RAM used by the library (bytes); stack figures are high-water marks (minimum free)
+struct OtaMemoryReport {
+  uint32_t bleInitHeap;           // BLEDevice::init(): controller and Bluedroid host
+  uint32_t serverHeap;            // Server, security and callback objects
+  uint32_t serviceHeap;           // Service, characteristics and descriptors (initializeService())
+  uint32_t bufferHeap;            // Library buffers allocated right now
+  uint32_t peakBufferHeap;        // Largest bufferHeap seen since boot
+  uint32_t staticRam;             // This object plus static buffers (trace ring)
+  uint32_t bleTaskStackFree;      // BLE callback task, 0 until the first connection
+  uint32_t loopTaskStackFree;     // Task calling loop(), 0 until loop() runs
+  uint32_t freeHeap;
+  uint32_t minFreeHeap;
+  uint32_t largestBlockBeforeSession;
+  uint32_t largestBlockAfterSession;
+};
+
+// Compile-time RAM footprint per optional feature (bytes)
+#define OTA_FOOTPRINT_TRACE         (BLE_OTA_TRACE ? BLE_OTA_TRACE_SIZE * 8 : 0)           // Static ring
+#define OTA_FOOTPRINT_HISTORY       (BLE_OTA_HISTORY ? OTA_HISTORY_SIZE * sizeof(OtaSessionRecord) : 0)  // History characteristic value
+#define OTA_FOOTPRINT_ECHO          (BLE_OTA_COMMANDS ? OTA_ECHO_MAX_SAMPLES * sizeof(uint32_t) : 0)    // Heap, during an echo test
+#define OTA_FOOTPRINT_BENCH         (BLE_OTA_BENCHMARK ? 2 * OTA_BENCH_BLOCK_SIZE : 0)     // Heap, during the self-benchmark (plus ~11 KB for inflate)
+
 // Callback function types
 typedef void (*OtaProgressCallback)(uint32_t received, uint32_t total, uint8_t percentage);
 typedef void (*OtaStatusCallback)(OtaStatus status, const char* message);
@@ -56,29 +593,85 @@ public:
   void abortUpdate();
   
   // Status methods
-  bool isConnected() const;
+  bool isConnected() const;      // Any central
+  uint8_t getConnectionCount() const;
   bool isUpdateInProgress() const;
   OtaStatus getOtaStatus() const;
   uint32_t getUpdateProgress() const;
   uint32_t getUpdateTotal() const;
   uint8_t getUpdatePercentage() const;
+  const OtaSessionStats& getSessionStats() const;
+  const OtaLinkTestResult& getLinkTestResult() const;
+  size_t getSessionHistory(OtaSessionRecord* records, size_t maxRecords);  // Newest first
+  void clearSessionHistory();
   
   // Configuration methods
-  void setServiceUUID(const char* uuid);
-  void setOtaCharacteristicUUID(const char* uuid);
-  void setCommandCharacteristicUUID(const char* uuid);
-  void setStatusCharacteristicUUID(const char* uuid);
+  bool setServiceUUID(const char* uuid);
+  bool setOtaCharacteristicUUID(const char* uuid);
+  bool setCommandCharacteristicUUID(const char* uuid);
+  bool setStatusCharacteristicUUID(const char* uuid);
+  bool setHistoryCharacteristicUUID(const char* uuid);
+  void setServiceUUID(const OtaUuid& uuid);
+  void setOtaCharacteristicUUID(const OtaUuid& uuid);
+  void setCommandCharacteristicUUID(const OtaUuid& uuid);
+  void setStatusCharacteristicUUID(const OtaUuid& uuid);
+  void setHistoryCharacteristicUUID(const OtaUuid& uuid);
   void setMaxPacketSize(size_t size);
   void setUpdateBufferSize(size_t size);
+  void setFlowControlWindow(size_t bytes);
+  void setAutoTuning(bool enable);  // Adapt window/interval per session, remember per bonded peer
+  void setSkipUnchangedSectors(bool enable);  // Compare each sector with the slot, skip erase+program if equal
+  void setWifiDataPath(bool enable);  // Offer HTTP bulk data (needs BLE_OTA_WIFI); joined STA or temporary SoftAP
+  
+  // Advertised OTA info (version, state, slot size, capabilities)
+  void setAdvertiseOtaInfo(bool enable);
+  void setAdvertisingCompanyId(uint16_t companyId);
+  void setFirmwareVersion(uint8_t major, uint8_t minor, uint8_t patch);
+  void setFirmwareHashPrefix(const uint8_t* prefix, size_t length);
+  void updateAdvertisingData();
+  
+  // Signed images: compiled-in ECDSA P-256 public key (OTA_PUBLIC_KEY_SIZE bytes, uncompressed).
+  // Once set, updates without a valid signature are rejected before the boot partition changes.
+  bool setSigningKey(const uint8_t* publicKey, size_t length);
+  
+  // Encrypted images: AES-128/256-CTR device key (16 or 32 bytes). Once set, sessions must
+  // request OTA_FEATURE_ENCRYPTED; data is decrypted chunk by chunk before it reaches flash.
+  bool setEncryptionKey(const uint8_t* key, size_t length);
+  
+  // Bonding (call before begin) so returning clients reuse keys and cached handles
+  void setBondingEnabled(bool enable);
+  
+  // Measure flash, hashing, crypto and codec throughput on this chip (blocks for ~1-2 s).
+  // Erases 64 KB of the OTA_BENCH_PARTITION scratch partition, or else the tail of the inactive
+  // OTA slot; the slot is never touched while it may hold the rollback image. Refused while an
+  // update is in progress.
+  bool runSelfBenchmark(OtaBenchmarkResult& result);
+  
+  // Write the event trace as TRACE: lines (see README "Event Trace"); no-op unless BLE_OTA_TRACE
+  void dumpTrace(Print& out);
+  
+  // RAM accounting (see README "Memory Budget")
+  void getMemoryReport(OtaMemoryReport& report);
+  void printMemoryReport(Print& out);
+  
+  // Bulk reads (#READ): core dump, a log buffer or any partition range, off by default since
+  // partitions can hold secrets; enable together with bonding. The log buffer must stay valid.
+  void setBulkReadEnabled(bool enable);
+  void setReadableLog(const uint8_t* data, size_t length);
   
-  // Send status updates
-  void sendStatus(const String& status);
+  // Bundles: the active copy (<target>_0 or <target>_1) of a data target, nullptr if neither exists
+  const esp_partition_t* getBundlePartition(const char* target);
+  
+  // Send status updates (queued by priority, sent as the link has room; see OtaNotifyPriority)
+  void sendStatus(const String& status, OtaNotifyPriority priority = OtaNotifyPriority::APP);
   void sendProgress(uint32_t received, uint32_t total);
+  const OtaNotifyStats& getNotifyStats() const;
 
   // Return the server instance
   BLEServer* getBLEServer();
   
-  // Loop method (call in main loop if needed)
+  // Call from the sketch's loop(): it sends the observer copies of status frames during uploads,
+  // repairs pull sessions and runs bulk reads, #BENCH, #TRACE and the Wi-Fi data path
   void loop();
 
 private:
@@ -88,12 +681,18 @@ private:
   BLECharacteristic* pOtaCharacteristic;
   BLECharacteristic* pCommandCharacteristic;
   BLECharacteristic* pStatusCharacteristic;
+#if BLE_OTA_HISTORY
+  BLECharacteristic* pHistoryCharacteristic;
+#endif
+  BLEDescriptor* pStatusCccd;
   
-  // UUIDs
-  String serviceUUID;
-  String otaCharUUID;
-  String commandCharUUID;
-  String statusCharUUID;
+  // Device name and UUIDs
+  String deviceName;
+  OtaUuid serviceUUID;
+  OtaUuid otaCharUUID;
+  OtaUuid commandCharUUID;
+  OtaUuid statusCharUUID;
+  OtaUuid historyCharUUID;
   
   // OTA state
   bool otaInProgress;
@@ -101,45 +700,337 @@ private:
   uint32_t otaReceived;
   OtaStatus otaStatus;
   bool clientConnected;
+  uint16_t uploaderConnId;        // Holds the upload lock while otaInProgress
+#if BLE_OTA_COMMANDS
+  uint16_t commandConnId;         // Last command writer; system command replies go there
+#endif
+#if BLE_OTA_COMMANDS && BLE_OTA_BENCHMARK
+  uint16_t benchConnId;           // #BENCH requester, served from loop()
+#endif
+  
+  // Connected centrals
+  struct Peer {
+    uint16_t connId;
+    uint8_t address[6];
+    uint32_t connectedAtMs;
+    uint16_t connIntervalUnits;
+    bool bonded;
+    bool encrypted;               // Pairing or re-encryption completed on this link
+    bool congested;
+    bool statusNotify;            // This central enabled status notifications in the CCCD
+    bool used;
+  };
+  Peer peers[OTA_MAX_CONNECTIONS];
+  uint8_t peerCount;
+#if BLE_OTA_PROGRESS
+  uint32_t observerProgressAtMs;
+#endif
+  
+  // Session statistics
+  OtaSessionStats sessionStats;
+  bool awaitingFirstData;
+  uint32_t setupStartedAtMs;
+  uint32_t lastAckOffset;
+  uint32_t sessionWindow;
+  
+  uint32_t firstDataAtMs;
+  uint32_t lastDataAtMs;
+  uint32_t peakWindowStartMs;
+  uint32_t peakWindowStartOffset;
+  uint32_t sessionStartTime;
+  bool sessionRecordPending;
+  
+#if BLE_OTA_TUNING
+  // Auto-tuner state
+  bool autoTuning;
+  uint32_t tunePeriodStartMs;
+  uint32_t tunePeriodStartOffset;
+  uint32_t tuneLastBps;
+  int8_t tuneDirection;
+  uint8_t tuneKnob;               // 0 = window, 1 = connection interval
+#endif
+  
+#if BLE_OTA_PULL
+  // Pull sessions
+  uint32_t pullRequested;         // End of the ranges requested so far
+  uint32_t pullRepairedAt;        // otaReceived at the last gap repair; one repair per gap
+  volatile uint32_t pullActivityMs; // Last request or accepted write, for the retry timer
+#endif
+  
+  // Session held for its client after the link dropped (OTA_FEATURE_RESUME)
+  volatile bool sessionHeld;
+  uint32_t heldAtMs;
+  
+#if BLE_OTA_TRACE && BLE_OTA_COMMANDS
+  // #TRACE dump, streamed from loop()
+  uint16_t traceConnId;
+  uint32_t traceNext;             // Next record to send
+  uint32_t traceEnd;              // Ring head when the dump started
+#endif
+  
+#if BLE_OTA_BULK_READ
+  // Bulk read (device to host), streamed from loop()
+  bool bulkReadEnabled;
+  const uint8_t* readableLog;
+  size_t readableLogSize;
+  volatile bool readActive;       // Checked by the BLE task to refuse OTA writes
+  uint16_t readConnId;
+  const esp_partition_t* readPartition;  // nullptr for the log buffer
+  uint32_t readStart;             // Partition offset of the object
+  uint32_t readSize;
+  uint32_t readSent;              // Next offset to notify; rewound on resend
+  volatile uint32_t readAcked;
+  volatile uint32_t readAckAtMs;
+  volatile bool readRewind;       // Set by a gap RACK, applied by the sender in loop()
+  uint32_t readCrc;               // CRC-32 of bytes [0, readCrcOffset)
+  uint32_t readCrcOffset;
+  uint32_t readStartedAtMs;
+  uint16_t readResends;
+  uint8_t* readBuffer;            // Offset + one notification of data
+  size_t readChunk;
+#endif
+  
+#if BLE_OTA_BUNDLES
+  // Bundle session
+  bool bundleSession;
+  uint8_t bundleManifest[OTA_BUNDLE_HEADER_SIZE + OTA_BUNDLE_MAX_ITEMS * OTA_BUNDLE_ENTRY_SIZE];
+  size_t bundleManifestFill;
+  uint8_t bundleCount;            // 0 until the manifest is complete
+  uint8_t bundleItem;             // Payload being received; bundleCount once all are verified
+  uint32_t bundleItemWritten;
+  const esp_partition_t* bundleTargets[OTA_BUNDLE_MAX_ITEMS];  // nullptr for the app
+  uint8_t bundleSlots[OTA_BUNDLE_MAX_ITEMS];
+  mbedtls_sha256_context bundleDigest;
+#endif
+  
+#if BLE_OTA_WIFI
+  // Wi-Fi data path, served from loop()
+  bool wifiDataPath;
+  WiFiServer* wifiServer;
+  WiFiClient wifiClient;
+  bool wifiSoftAp;                // We started the AP (and the radio) and stop it again
+  char wifiSsid[16];
+  char wifiPsk[16];
+  char wifiToken[OTA_WIFI_TOKEN_SIZE + 1];  // Per session, required on PUT /ota
+  volatile bool wifiStartPending; // Granted in HELLO, started by loop()
+  String wifiRequest;             // HTTP request head until the blank line
+  bool wifiHeadDone;
+  uint32_t wifiBodyRemaining;
+#endif
+  
+  // Set while prepared-write fragments for the OTA characteristic are queued
+  bool longWritePending;
+  
+  // Status notification queue (notifyLock guards all of it; one context drains at a time)
+  struct QueuedNotification {
+    String text;
+    uint32_t order;
+    OtaNotifyPriority priority;
+    uint16_t target;              // Conn ID, OTA_NOTIFY_ALL or OTA_NOTIFY_OBSERVERS
+    bool used;
+  };
+  QueuedNotification notifyQueue[OTA_NOTIFY_QUEUE_SIZE];
+  SemaphoreHandle_t notifyLock;
+  SemaphoreHandle_t sessionLock;  // Session state: the BLE task and loop() both drive it (recursive)
+  uint32_t notifyOrder;
+  bool notifyDraining;
+  OtaNotifyStats notifyStats;
+  
+  // Link test state (the echo test runs over the command characteristic)
+  OtaLinkTestResult linkTestResult;
+#if BLE_OTA_COMMANDS
+  uint32_t* echoSamples;
+  uint16_t echoTotal;
+  uint16_t echoSeq;
+  uint32_t echoSentAtUs;
+#endif
+  
+#if BLE_OTA_SIGNATURE
+  // Signature verification (digest accumulated as data streams in)
+  uint8_t signingKey[OTA_PUBLIC_KEY_SIZE];
+  bool signingKeySet;
+  mbedtls_sha256_context imageDigest;
+  uint8_t imageSignature[OTA_SIGNATURE_SIZE];
+  bool signatureReceived;
+#endif
+  
+#if BLE_OTA_ENCRYPTION
+  // Image decryption (AES-CTR state carried across chunks)
+  uint8_t encryptionKey[32];
+  uint16_t encryptionKeyBits;     // 0 when no key is set
+  mbedtls_aes_context imageCipher;
+  uint8_t cipherCounter[16];
+  uint8_t cipherStream[16];
+  size_t cipherOffset;
+  uint8_t* plainBuffer;
+  size_t plainBufferSize;
+#endif
+  
+#if BLE_OTA_MERKLE
+  // Merkle block verification
+  uint8_t merkleRoot[32];
+  uint8_t* merkleBlock;           // Current block, written to flash once verified
+  size_t merkleFill;
+  uint8_t merklePath[OTA_MERKLE_MAX_DEPTH * 32];
+  size_t merklePathLength;        // 0 while waiting for the next block's PATH
+#endif
+  
+#if BLE_OTA_COMPRESSION
+  // Block-compressed sessions
+  void* inflator;                 // tinfl_decompressor, allocated per session
+  uint8_t* frameBuffer;           // Frame header + compressed payload
+  uint8_t* inflateBuffer;         // Decoded block (non-wrapping tinfl output)
+  size_t frameFill;
+  bool frameSeeking;              // After a NAK: data is dropped until the client's SEEK
+#endif
+  
+  // Sector sink (replaces Update when skipping unchanged sectors)
+  bool skipUnchangedSectors;
+  bool sectorSinkSession;
+  const esp_partition_t* sectorPartition;
+  uint8_t* sectorBuffer;
+  size_t sectorFill;
+  uint32_t sectorOffset;          // Partition offset of sectorBuffer[0]
+  uint8_t sectorError;            // UPDATE_ERROR_* for the session record
+  
+  // Memory accounting (init figures, peaks and session blocks; the rest is sampled on demand)
+  OtaMemoryReport memoryReport;
+  TaskHandle_t bleTaskHandle;
+  TaskHandle_t loopTaskHandle;
   
   // Configuration
   size_t maxPacketSize;
   size_t updateBufferSize;
+  size_t flowControlWindow;
+  bool bondingEnabled;
+  
+  // Advertised OTA info
+  bool advertiseOtaInfo;
+  uint16_t advCompanyId;
+  uint8_t fwVersion[3];
+  uint8_t fwHashPrefix[OTA_ADV_HASH_PREFIX_LEN];
   
   // Callbacks
   OtaProgressCallback progressCallback;
   OtaStatusCallback statusCallback;
+#if BLE_OTA_COMMANDS
   CommandCallback commandCallback;
+#endif
   ConnectionCallback connectionCallback;
   
   // Internal methods
   void initializeService();
-  void handleOtaWrite(BLECharacteristic* pCharacteristic);
-  void handleCommandWrite(BLECharacteristic* pCharacteristic);
-  void onClientConnect();
-  void onClientDisconnect();
+  void handleOtaWrite(BLECharacteristic* pCharacteristic, uint16_t connId);
+  void processOtaWrite(BLECharacteristic* pCharacteristic, uint16_t connId);
+  void startSession(uint8_t protocolVersion, uint32_t features);
+  void recordSession(OtaStatus outcome);
+#if BLE_OTA_HISTORY
+  void refreshHistoryCharacteristic();
+#endif
+  void handleHello(const uint8_t* data, size_t length);
+  void sendHelloReply();
+  void holdSession();
+  void resumeHeldSession(uint16_t connId, const uint8_t* data, size_t length);
+  bool beginUpdate(uint32_t size);
+  void sendDoneReply(const char* error);
+  void writeFirmwareData(const uint8_t* data, size_t length);
+  bool verifyImageSignature();
+  bool startImageCipher(const uint8_t* iv);
+  void acceptFirmwareData(const uint8_t* data, size_t length);
+  bool startMerkleBlock(const uint8_t* root);
+  void acceptMerkleData(const uint8_t* data, size_t length);
+  bool verifyMerkleBlock(size_t length);
+  void rejectMerkleBlock();
+  size_t sessionBlockSize() const;
+  uint32_t minimumWindow() const;
+  bool startInflate();
+  void inflateFirmwareData(const uint8_t* data, size_t length);
+  const uint8_t* decodeFrame(size_t length);
+  void rejectFrame();
+  void releaseInflate();
+  void acceptPulledData(const uint8_t* data, size_t length);
+  void requestNextRange();
+  void repairPull();
+  void startBulkRead(const String& request);
+  void acknowledgeBulkRead(uint32_t offset, bool gap);
+  void serviceBulkRead();
+  void finishBulkRead();
+  void releaseBulkRead();
+  size_t bundleWrite(const uint8_t* data, size_t length);
+  bool parseBundleManifest();
+  bool beginBundleItem();
+  bool finishBundleItem();
+  bool commitBundle();
+  void promoteBundle();
+  bool commitSession();
+  bool offerWifiDataPath();
+  void startWifiDataPath();
+  void serviceWifiDataPath();
+  void stopWifiDataPath();
+  bool flashBegin(uint32_t size);
+  size_t flashWrite(const uint8_t* data, size_t length);
+  bool flashEnd();
+  void flashAbort();
+  uint8_t flashError();
+  bool flushSector();
+  void releaseMerkleBlock();
+  void releaseImageCipher();
+  void handleGattsEvent(esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t* param);
+  void handleGapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+  void indicateServiceChanged(const uint8_t* peerAddress);
+  static void gapEventHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+  static void gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param);
+  void finishLinkTest();
+  void loadPeerTuning();
+  void savePeerTuning();
+  void tuneFlowControl();
+  void requestConnInterval(uint16_t intervalUnits);
+  void handleCommandWrite(BLECharacteristic* pCharacteristic, uint16_t connId);
+  bool handleSystemCommand(const String& command);
+  void startTraceDump();
+  void serviceTraceDump();
+  void sendBenchmark(uint16_t target);
+  void noteBufferHeap(size_t transient = 0);
+  size_t libraryBufferBytes() const;
+  void startEchoTest(uint16_t count);
+  void sendEchoPing();
+  void advanceEchoTest();
+  void finishEchoTest();
+  void onClientConnect(uint16_t connId, const uint8_t* peerAddress, uint16_t connInterval);
+  void onClientDisconnect(uint16_t connId);
+  Peer* findPeer(uint16_t connId);
+  bool isObserver(uint16_t connId) const;
+  void claimUpload(uint16_t connId);
   void updateProgress();
+  void sendStatusTo(uint16_t target, const String& status, OtaNotifyPriority priority);
+  void queueNotification(const String& status, OtaNotifyPriority priority, uint16_t target);
+  void flushNotifications();
+  void deliverNotification(const String& text, uint16_t target, bool observers);
+  void sendStatusFrames(uint16_t connId, const String& text);
+  void clearNotifications(uint16_t connId);
   void setOtaStatus(OtaStatus status, const char* message = nullptr);
   
   // BLE callback classes
   class ServerCallbacks : public BLEServerCallbacks {
   public:
     ServerCallbacks() {}
-    void onConnect(BLEServer* pServer) override;
-    void onDisconnect(BLEServer* pServer) override;
+    void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) override;
+    void onDisconnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) override;
   };
 
   class OtaCharacteristicCallbacks : public BLECharacteristicCallbacks {
   public:
     OtaCharacteristicCallbacks() {}
-    void onWrite(BLECharacteristic* pCharacteristic) override;
+    void onWrite(BLECharacteristic* pCharacteristic, esp_ble_gatts_cb_param_t* param) override;
   };
 
+#if BLE_OTA_COMMANDS
   class CommandCharacteristicCallbacks : public BLECharacteristicCallbacks {
   public:
     CommandCharacteristicCallbacks() {}
-    void onWrite(BLECharacteristic* pCharacteristic) override;
+    void onWrite(BLECharacteristic* pCharacteristic, esp_ble_gatts_cb_param_t* param) override;
   };
+#endif
   
   // Static instance for callbacks
   static BLEOtaUpdate* instance;
@@ -42,6 +42,13 @@ void setup() {
   // Configure advanced settings
   bleOta.setMaxPacketSize(1024);  // Larger packet size for faster transfers
   bleOta.setUpdateBufferSize(8192); // Larger buffer for better performance
+  bleOta.setBondingEnabled(true);   // Returning phones skip discovery and reuse tuned settings
+  bleOta.setAutoTuning(true);       // Adapt flow control to each phone
+  bleOta.setSkipUnchangedSectors(true);  // Retries only rewrite what changed
+  
+  // Advertise firmware version and OTA readiness so scanners can skip up-to-date devices
+  bleOta.setFirmwareVersion(1, 0, 0);
+  bleOta.setAdvertiseOtaInfo(true);
   
   // Set up callbacks
   bleOta.setOtaProgressCallback(onOtaProgress);
@@ -62,7 +69,8 @@ void setup() {
 }
 
 void loop() {
-  // Main loop with advanced monitoring
+  // Main loop with advanced monitoring; uploads run in BLE callbacks, observers and retries here
+  bleOta.loop();
   delay(100);
   
   // Periodic status reporting
@@ -186,6 +194,7 @@ void onCommand(const String& command) {
   } else if (command == "MEMORY") {
     String memory = "Free heap: " + String(ESP.getFreeHeap()) + " bytes";
     bleOta.sendStatus(memory);
+    bleOta.printMemoryReport(Serial);
     
   } else {
     bleOta.sendStatus("Unknown command: " + command);
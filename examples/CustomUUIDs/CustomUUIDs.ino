@@ -52,7 +52,8 @@ void setup() {
 }
 
 void loop() {
-  // Main loop - all work is done in BLE callbacks
+  // Main loop - uploads run in BLE callbacks; observers, retries and # commands need loop()
+  bleOta.loop();
   delay(100);
   
   // Blink LED to show the device is running
@@ -1,4 +1,9 @@
+import 'dart:async';
+import 'dart:collection';
 import 'dart:convert';
+import 'dart:io' show ZLibEncoder;
+import 'dart:isolate';
+import 'dart:math' show max;
 import 'dart:typed_data';
 import 'package:flutter_blue_plus/flutter_blue_plus.dart';
 import 'package:file_picker/file_picker.dart';
@@ -6,6 +11,21 @@ import 'package:file_picker/file_picker.dart';
 // ===== UUIDs =====
 final serviceUuid = Guid("12345678-1234-5678-9ABC-DEF012345678");
 final otaCharUuid = Guid("87654321-4321-8765-CBA9-FEDCBA987654");
+final statusCharUuid = Guid("AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEEE");
+
+// ===== HELLO handshake (see README "OTA Protocol") =====
+const otaProtocolVersion = 1;
+const otaHelloSize = 14;
+const otaFeatureFlowControl = 0x00000001;
+const otaFeatureCompressed = 0x00000020;
+
+// zblk container: 4 KB blocks, each raw-deflated on its own (compress_firmware.py)
+const zblkBlockSize = 4096;
+const zblkFrameHeader = 8;
+
+// Writes handed to the plugin before awaiting the oldest; hides the platform channel round trip
+const pipelineDepth = 4;
+const progressInterval = Duration(milliseconds: 250);
 
 // Scan for device exposing the OTA service
 Future<BluetoothDevice?> scanForDevice() async {
@@ -24,17 +44,21 @@ Future<BluetoothDevice?> scanForDevice() async {
   return results.isNotEmpty ? results.first.device : null;
 }
 
-// Connect & discover OTA characteristic
-Future<(BluetoothDevice device, BluetoothCharacteristic otaChar)?>
+// Connect & discover OTA and status characteristics
+Future<(BluetoothDevice device, BluetoothCharacteristic otaChar, BluetoothCharacteristic statusChar)?>
 connectAndDiscoverOta(BluetoothDevice d) async {
   print("🔗 Connecting to ${d.platformName}...");
   await d.connect(timeout: const Duration(seconds: 15));
 
   try {
-    await d.requestMtu(247);
+    await d.requestMtu(517);
   } catch (e) {
     print("⚠️ MTU request failed: $e");
   }
+  try {
+    // Android only: short connection interval while the transfer runs
+    await d.requestConnectionPriority(connectionPriorityRequest: ConnectionPriority.high);
+  } catch (_) {}
 
   final services = await d.discoverServices();
   final s = services.firstWhere(
@@ -45,8 +69,12 @@ connectAndDiscoverOta(BluetoothDevice d) async {
     (x) => x.uuid == otaCharUuid,
     orElse: () => throw Exception("OTA characteristic not found"),
   );
+  final st = s.characteristics.firstWhere(
+    (x) => x.uuid == statusCharUuid,
+    orElse: () => throw Exception("Status characteristic not found"),
+  );
 
-  return (d, c);
+  return (d, c, st);
 }
 
 // Let user pick firmware file
@@ -58,41 +86,306 @@ Future<Uint8List?> pickFirmwareBin() async {
   return r?.files.first.bytes;
 }
 
-// OTA transfer sequence
+// Texts longer than the MTU arrive in pieces; all but the last end with '+'
+Stream<String> joinStatusFrames(Stream<String> frames) async* {
+  var pending = "";
+  await for (final frame in frames) {
+    if (frame.endsWith("+")) {
+      pending += frame.substring(0, frame.length - 1);
+      continue;
+    }
+    yield pending + frame;
+    pending = "";
+  }
+}
+
+// "HELLO:v=1,mtu=247,chunk=244,..." -> {v: 1, mtu: 247, chunk: 244, ...}
+Map<String, int> parseHelloReply(String reply) {
+  final params = <String, int>{};
+  for (final field in reply.substring("HELLO:".length).split(",")) {
+    final kv = field.split("=");
+    if (kv.length != 2) continue;
+    final value = kv[1].startsWith("0x")
+        ? int.tryParse(kv[1].substring(2), radix: 16)
+        : int.tryParse(kv[1]);
+    if (value != null) params[kv[0]] = value;
+  }
+  return params;
+}
+
+// "DONE:ok,bytes=..,crc=0x.." or "DONE:error=<reason>,bytes=..,crc=0x.." -> {ok|error, bytes, crc (hex digits)}
+Map<String, String> parseDoneReply(String reply) {
+  final fields = <String, String>{};
+  for (final field in reply.substring("DONE:".length).split(",")) {
+    final kv = field.split("=");
+    fields[kv[0]] = kv.length == 2 ? kv[1].replaceFirst("0x", "") : "";
+  }
+  return fields;
+}
+
+// ===== Image preparation (runs in a background isolate) =====
+
+// Everything the transfer loop needs, computed off the UI isolate
+class PreparedImage {
+  final Uint8List stream; // Bytes on the wire: the image, or its zblk frames
+  final Int32List chunkStarts; // Stream offset of every chunk, plus the stream length
+  final Int32List blockOffsets; // Stream offset of every 4 KB image block (frame starts)
+  final int imageSize;
+  final int crc32; // Of the image, compared with the crc= field of the device's DONE: reply
+  final bool compressed;
+
+  PreparedImage(this.stream, this.chunkStarts, this.blockOffsets, this.imageSize, this.crc32, this.compressed);
+
+  int get chunkCount => chunkStarts.length - 1;
+
+  // Zero-copy view of chunk i, starting no earlier than [from] (a resend point inside it)
+  Uint8List chunk(int i, [int from = 0]) =>
+      Uint8List.sublistView(stream, max(chunkStarts[i], from), chunkStarts[i + 1]);
+
+  // ACKs count image bytes; compressed streams map them onto frame starts
+  int streamOffset(int imageOffset) => compressed
+      ? blockOffsets[(imageOffset ~/ zblkBlockSize).clamp(0, blockOffsets.length - 1)]
+      : imageOffset;
+}
+
+final _crcTable = List<int>.generate(256, (n) {
+  var c = n;
+  for (var k = 0; k < 8; k++) {
+    c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+  }
+  return c;
+});
+
+int crc32(Uint8List data, [int start = 0, int? end]) {
+  var crc = 0xFFFFFFFF;
+  for (var i = start; i < (end ?? data.length); i++) {
+    crc = _crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+PreparedImage prepareImage(Uint8List image, int chunkSize, bool compress) {
+  final blockOffsets = <int>[];
+  Uint8List stream = image;
+  if (compress) {
+    // Each block on its own, stored when deflate does not help (see compress_firmware.py)
+    final out = BytesBuilder(copy: false);
+    final encoder = ZLibEncoder(raw: true, level: 9, windowBits: 12, memLevel: 9);
+    for (var offset = 0; offset < image.length; offset += zblkBlockSize) {
+      final end = (offset + zblkBlockSize).clamp(0, image.length);
+      final block = Uint8List.sublistView(image, offset, end);
+      var payload = Uint8List.fromList(encoder.convert(block));
+      var method = 1;
+      if (payload.length >= block.length) {
+        payload = block;
+        method = 0;
+      }
+      final header = ByteData(zblkFrameHeader)
+        ..setUint16(0, payload.length, Endian.little)
+        ..setUint8(2, method)
+        ..setUint32(4, crc32(image, offset, end), Endian.little);
+      blockOffsets.add(out.length);
+      out.add(header.buffer.asUint8List());
+      out.add(payload);
+    }
+    stream = out.takeBytes();
+  } else {
+    for (var offset = 0; offset < image.length; offset += zblkBlockSize) {
+      blockOffsets.add(offset);
+    }
+  }
+  blockOffsets.add(stream.length);
+
+  final starts = <int>[];
+  for (var offset = 0; offset < stream.length; offset += chunkSize) {
+    starts.add(offset);
+  }
+  starts.add(stream.length);
+  return PreparedImage(stream, Int32List.fromList(starts), Int32List.fromList(blockOffsets), image.length,
+      crc32(image), compress);
+}
+
+// Top level so the isolate closure captures only its arguments
+Future<PreparedImage> prepareInBackground(Uint8List image, int chunkSize, bool compress) =>
+    Isolate.run(() => prepareImage(image, chunkSize, compress));
+
+// ===== OTA transfer =====
+
+class OtaProgress {
+  final int sent; // Stream bytes written
+  final int acked; // Image bytes the device confirmed
+  final int total; // Stream bytes
+  final double bytesPerSecond; // Over the last progressInterval
+  final bool done;
+
+  OtaProgress(this.sent, this.acked, this.total, this.bytesPerSecond, {this.done = false});
+
+  double get fraction => total == 0 ? 0 : sent / total;
+}
+
+// One update: listen to [progress] for UI events, then await [run]
+class OtaSession {
+  final BluetoothDevice device;
+  final BluetoothCharacteristic otaChar;
+  final BluetoothCharacteristic statusChar;
+  final Uint8List firmware;
+  final Uint8List? signature; // From sign_firmware.py, if the device requires signed images
+  final bool compress;
+
+  final _progress = StreamController<OtaProgress>.broadcast();
+  Stream<OtaProgress> get progress => _progress.stream;
+
+  int _acked = 0;
+  int _window = 4096;
+  int? _nakBlock;
+  String? _error;
+  Completer<void>? _credit;
+
+  OtaSession(this.device, this.otaChar, this.statusChar, this.firmware, {this.signature, this.compress = false});
+
+  void _onStatus(String msg) {
+    if (msg.startsWith("ACK:")) {
+      _acked = int.tryParse(msg.substring(4)) ?? _acked;
+    } else if (msg.startsWith("TUNE:window=")) {
+      _window = int.tryParse(msg.substring("TUNE:window=".length)) ?? _window;
+    } else if (msg.startsWith("NAK:")) {
+      _nakBlock = int.tryParse(msg.substring(4));
+    } else if (msg == "BUSY") {
+      _error = "device busy with another upload";
+    } else {
+      return;
+    }
+    final credit = _credit;
+    _credit = null;
+    credit?.complete();
+  }
+
+  Future<void> run() async {
+    final started = DateTime.now();
+    final mtuChunk = (device.mtuNow > 0 ? device.mtuNow : 23) - 3;
+
+    await statusChar.setNotifyValue(true);
+    final messages =
+        joinStatusFrames(statusChar.onValueReceived.map((v) => utf8.decode(v, allowMalformed: true))).asBroadcastStream();
+    final subscription = messages.listen(_onStatus);
+    try {
+      // Preparation overlaps the HELLO round trip; the chunk size is refined once the reply is in
+      final preparing = prepareInBackground(firmware, mtuChunk, compress);
+
+      final reply = messages.firstWhere((msg) => msg.startsWith("HELLO:"));
+      final hello = ByteData(otaHelloSize);
+      utf8.encode("HELLO").asMap().forEach((i, b) => hello.setUint8(i, b));
+      hello.setUint8(5, otaProtocolVersion);
+      hello.setUint32(6, firmware.length, Endian.little);
+      hello.setUint32(10, otaFeatureFlowControl | (compress ? otaFeatureCompressed : 0), Endian.little);
+      await otaChar.write(hello.buffer.asUint8List(), withoutResponse: false);
+      final params = parseHelloReply(await reply.timeout(const Duration(seconds: 5)));
+      if (!params.containsKey("chunk")) throw Exception("Device refused the session");
+      _window = params["window"] ?? _window;
+
+      var image = await preparing;
+      final chunkSize = params["chunk"]!.clamp(20, mtuChunk);
+      if (chunkSize != mtuChunk) {
+        image = await prepareInBackground(firmware, chunkSize, compress);
+      }
+      print("📦 Sending ${image.stream.length} bytes in ${image.chunkCount} chunks of $chunkSize "
+          "(window $_window, CRC32 ${image.crc32.toRadixString(16)})");
+
+      await _sendStream(image);
+
+      if (signature != null) {
+        await otaChar.write([...utf8.encode("SIG"), ...signature!], withoutResponse: false);
+      } else if (params.containsKey("sig")) {
+        print("⚠️ Device requires signed images but no signature was given");
+      }
+      // The device answers DONE:ok or DONE:error=<reason> with the byte count and CRC-32 it received
+      final doneReply = messages.firstWhere((msg) => msg.startsWith("DONE:"));
+      await otaChar.write(utf8.encode("DONE"), withoutResponse: false);
+      final outcome = parseDoneReply(await doneReply.timeout(const Duration(seconds: 10)));
+      if (outcome.containsKey("error")) throw Exception("Device rejected the image: ${outcome["error"]}");
+      if (int.tryParse(outcome["crc"] ?? "", radix: 16) != image.crc32) {
+        throw Exception("CRC mismatch: device ${outcome["crc"]}, image ${image.crc32.toRadixString(16)}");
+      }
+
+      final seconds = DateTime.now().difference(started).inMilliseconds / 1000;
+      _progress.add(OtaProgress(image.stream.length, image.imageSize, image.stream.length,
+          image.stream.length / seconds, done: true));
+      print("✅ OTA update completed (${(firmware.length / seconds / 1024).toStringAsFixed(1)} KB/s)");
+    } finally {
+      await subscription.cancel();
+      await _progress.close();
+    }
+  }
+
+  // Write-without-response, at most one device window ahead of the last ACK, no fixed delays
+  Future<void> _sendStream(PreparedImage image) async {
+    final inFlight = Queue<Future<void>>();
+    var i = 0;
+    var resumeAt = 0;
+    var sent = 0;
+    var reportSent = 0;
+    final clock = Stopwatch()..start();
+    var reportAt = clock.elapsed;
+
+    while (i < image.chunkCount) {
+      if (_error != null) throw Exception(_error);
+
+      // Rejected block: resend from its frame (compressed streams first say where that is)
+      final nak = _nakBlock;
+      if (nak != null) {
+        _nakBlock = null;
+        await Future.wait(inFlight);
+        inFlight.clear();
+        _acked = _acked.clamp(0, nak * zblkBlockSize);
+        final resume = image.streamOffset(nak * zblkBlockSize);
+        if (image.compressed) {
+          final index = ByteData(4)..setUint32(0, nak, Endian.little);
+          await otaChar.write([...utf8.encode("SEEK"), ...index.buffer.asUint8List()], withoutResponse: true);
+        }
+        i = image.chunkStarts.lastIndexWhere((start) => start <= resume);
+        resumeAt = sent = resume;
+        continue;
+      }
+
+      // Out of credits: wait for the next ACK (or NAK/TUNE/BUSY)
+      if (max(image.chunkStarts[i], resumeAt) - image.streamOffset(_acked) >= _window) {
+        _credit ??= Completer<void>();
+        await _credit!.future.timeout(const Duration(seconds: 10));
+        continue;
+      }
+
+      final chunk = image.chunk(i++, resumeAt);
+      // A failed write is surfaced by the _error check above, never as an unhandled future error
+      inFlight.add(otaChar.write(chunk, withoutResponse: true).catchError((Object e) {
+        _error ??= "write failed: $e";
+      }));
+      if (inFlight.length >= pipelineDepth) await inFlight.removeFirst();
+      sent += chunk.length;
+
+      final now = clock.elapsed;
+      if (now - reportAt >= progressInterval) {
+        final seconds = (now - reportAt).inMicroseconds / 1e6;
+        _progress.add(OtaProgress(sent, _acked, image.stream.length, (sent - reportSent) / seconds));
+        reportAt = now;
+        reportSent = sent;
+      }
+    }
+    await Future.wait(inFlight);
+    if (_error != null) throw Exception(_error);
+  }
+}
+
+// Kept for callers of the previous example
 Future<void> performOtaTransfer(
   BluetoothDevice d,
   BluetoothCharacteristic otaChar,
+  BluetoothCharacteristic statusChar,
   Uint8List fw,
-) async {
-  final chunkSize = (d.mtuNow > 0 ? d.mtuNow : 23) - 3;
-  print("📦 Sending firmware (${fw.length} bytes) in chunks of $chunkSize...");
-
-  // Step 1: Send OPEN command
-  await otaChar.write(utf8.encode("OPEN"), withoutResponse: false);
-  await Future.delayed(
-    const Duration(milliseconds: 30),
-  ); // Allow ESP32 to process
-
-  // Step 2: Send firmware size
-  final size = ByteData(4)..setUint32(0, fw.length, Endian.little);
-  await otaChar.write(size.buffer.asUint8List(), withoutResponse: false);
-  await Future.delayed(const Duration(milliseconds: 30)); // Prevent packet loss
-
-  // Step 3: Send firmware data
-  for (var i = 0; i < fw.length; i += chunkSize) {
-    final end = (i + chunkSize > fw.length) ? fw.length : i + chunkSize;
-    await otaChar.write(fw.sublist(i, end), withoutResponse: true);
-    await Future.delayed(const Duration(milliseconds: 30));
-    // ↑ 30ms delay after each chunk ensures ESP32 has time to write to flash
-    //   and prevents BLE buffer overflow.
-  }
-
-  // Step 4: Send DONE command
-  await otaChar.write(utf8.encode("DONE"), withoutResponse: false);
-  await Future.delayed(
-    const Duration(milliseconds: 30),
-  ); // Final pause for ESP32
-  print("✅ OTA update completed");
+) {
+  final session = OtaSession(d, otaChar, statusChar, fw);
+  session.progress.listen((p) => print(
+      "   ${(p.fraction * 100).toStringAsFixed(1)}% complete, ${(p.bytesPerSecond / 1024).toStringAsFixed(1)} KB/s"));
+  return session.run();
 }
 
 // Disconnect
@@ -109,13 +402,13 @@ Future<void> runOtaFlow() async {
 
   final result = await connectAndDiscoverOta(dev);
   if (result == null) throw Exception("OTA characteristic not found");
-  final (device, otaChar) = result;
+  final (device, otaChar, statusChar) = result;
 
   final fw = await pickFirmwareBin();
   if (fw == null) throw Exception("No firmware selected");
 
   try {
-    await performOtaTransfer(device, otaChar, fw);
+    await performOtaTransfer(device, otaChar, statusChar, fw);
   } finally {
     await disconnectSafely(device);
   }
@@ -1,154 +1,374 @@
+import android.annotation.SuppressLint
 import android.bluetooth.*
 import android.bluetooth.le.*
 import android.content.Context
+import android.os.Build
 import android.os.ParcelUuid
+import android.os.SystemClock
 import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.CoroutineStart
+import kotlinx.coroutines.Deferred
+import kotlinx.coroutines.async
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.delay
+import kotlinx.coroutines.flow.MutableSharedFlow
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.StateFlow
+import kotlinx.coroutines.flow.first
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.selects.select
 import kotlinx.coroutines.suspendCancellableCoroutine
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.withTimeout
+import kotlinx.coroutines.withTimeoutOrNull
 import java.nio.ByteBuffer
 import java.nio.ByteOrder
 import java.util.*
+import java.util.zip.CRC32
 import kotlin.coroutines.resume
-import kotlin.coroutines.resumeWithException
 
 // ===== UUIDs =====
 val SERVICE_UUID: UUID = UUID.fromString("12345678-1234-5678-9ABC-DEF012345678")
 val OTA_CHAR_UUID: UUID = UUID.fromString("87654321-4321-8765-CBA9-FEDCBA987654")
+val STATUS_CHAR_UUID: UUID = UUID.fromString("AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEEE")
+val CCCD_UUID: UUID = UUID.fromString("00002902-0000-1000-8000-00805f9b34fb")
+
+// ===== HELLO handshake (see README "OTA Protocol") =====
+const val OTA_PROTOCOL_VERSION = 1
+const val OTA_FEATURE_FLOW_CONTROL = 0x00000001
+
+// Chunks queued ahead of the GATT writer; the device window (ACK credits) is the real limit
+const val PIPELINE_DEPTH = 16
+const val THROUGHPUT_REPORT_MS = 500L
+// No ACK credit for this long means the device stopped reading; fail instead of hanging
+const val CREDIT_TIMEOUT_MS = 10000L
 
 // ---- 1) Scan for device ----
+@SuppressLint("MissingPermission")
 suspend fun scanForDeviceOnce(scanner: BluetoothLeScanner, timeoutMs: Long = 8000): BluetoothDevice? =
-    suspendCancellableCoroutine { cont ->
-        val filter = ScanFilter.Builder().setServiceUuid(ParcelUuid(SERVICE_UUID)).build()
-        val settings = ScanSettings.Builder().setScanMode(ScanSettings.SCAN_MODE_LOW_LATENCY).build()
-
-        val cb = object : ScanCallback() {
-            override fun onScanResult(callbackType: Int, result: ScanResult) {
-                scanner.stopScan(this)
-                cont.resume(result.device)
+    withTimeoutOrNull(timeoutMs) {
+        suspendCancellableCoroutine { cont ->
+            val filter = ScanFilter.Builder().setServiceUuid(ParcelUuid(SERVICE_UUID)).build()
+            val settings = ScanSettings.Builder().setScanMode(ScanSettings.SCAN_MODE_LOW_LATENCY).build()
+
+            val cb = object : ScanCallback() {
+                override fun onScanResult(callbackType: Int, result: ScanResult) {
+                    scanner.stopScan(this)
+                    if (cont.isActive) cont.resume(result.device)
+                }
+
+                override fun onScanFailed(errorCode: Int) {
+                    if (cont.isActive) cont.resume(null)
+                    println("❌ Scan failed: $errorCode")
+                }
             }
 
-            override fun onScanFailed(errorCode: Int) {
-                cont.resumeWithException(Exception("Scan failed: $errorCode"))
+            scanner.startScan(listOf(filter), settings, cb)
+            cont.invokeOnCancellation { scanner.stopScan(cb) }
+        }
+    }
+
+// ---- 2) GATT connection with a single callback dispatcher ----
+// Android allows one outstanding GATT operation per connection, so every operation goes
+// through gattOp(): it starts the call under a mutex and waits for the matching callback.
+// A callback only completes the operation of its own kind (and characteristic), so an
+// unsolicited onMtuChanged or a late write callback cannot finish someone else's request.
+// Write-without-response completes as soon as the stack has queued the packet, which is
+// what lets the data pipeline keep the controller's buffers full.
+@SuppressLint("MissingPermission")
+class OtaConnection(private val context: Context, private val device: BluetoothDevice) {
+    lateinit var gatt: BluetoothGatt
+        private set
+    var mtu = 23
+        private set
+    var phy = "1M"
+        private set
+
+    // Status characteristic notifications (HELLO replies, ACK credits, TUNE, BUSY, ...)
+    val status = MutableSharedFlow<String>(extraBufferCapacity = 64)
+    private val statusPieces = StringBuilder()
+    private val connected = CompletableDeferred<Unit>()
+
+    private enum class GattOp { DISCOVER, MTU, PHY, WRITE, DESCRIPTOR }
+    private class PendingOp(val op: GattOp, val uuid: UUID?, val done: CompletableDeferred<Int>)
+
+    private val opLock = Mutex()
+    private var pending: PendingOp? = null
+
+    private val callback = object : BluetoothGattCallback() {
+        override fun onConnectionStateChange(gatt: BluetoothGatt, status: Int, newState: Int) {
+            if (newState == BluetoothProfile.STATE_CONNECTED && status == BluetoothGatt.GATT_SUCCESS) {
+                connected.complete(Unit)
+            } else if (newState == BluetoothProfile.STATE_DISCONNECTED || status != BluetoothGatt.GATT_SUCCESS) {
+                connected.completeExceptionally(Exception("Connection failed: $status"))
+                pending?.done?.completeExceptionally(Exception("Disconnected ($status)"))
             }
         }
 
-        scanner.startScan(listOf(filter), settings, cb)
+        override fun onServicesDiscovered(gatt: BluetoothGatt, status: Int) = complete(GattOp.DISCOVER, null, status)
 
-        cont.invokeOnCancellation { scanner.stopScan(cb) }
+        override fun onMtuChanged(gatt: BluetoothGatt, mtu: Int, status: Int) {
+            if (status == BluetoothGatt.GATT_SUCCESS) this@OtaConnection.mtu = mtu
+            complete(GattOp.MTU, null, status)
+        }
 
-        // Timeout
-        cont.context.job.invokeOnCompletion {
-            scanner.stopScan(cb)
+        override fun onPhyUpdate(gatt: BluetoothGatt, txPhy: Int, rxPhy: Int, status: Int) {
+            if (status == BluetoothGatt.GATT_SUCCESS) phy = if (txPhy == BluetoothDevice.PHY_LE_2M) "2M" else "1M"
+            complete(GattOp.PHY, null, status)
+        }
+
+        override fun onCharacteristicWrite(gatt: BluetoothGatt, c: BluetoothGattCharacteristic, status: Int) =
+            complete(GattOp.WRITE, c.uuid, status)
+
+        override fun onDescriptorWrite(gatt: BluetoothGatt, d: BluetoothGattDescriptor, status: Int) =
+            complete(GattOp.DESCRIPTOR, d.uuid, status)
+
+        override fun onCharacteristicChanged(gatt: BluetoothGatt, c: BluetoothGattCharacteristic, value: ByteArray) {
+            if (c.uuid != STATUS_CHAR_UUID) return
+            // Texts longer than the MTU arrive in pieces; all but the last end with '+'
+            statusPieces.append(String(value, Charsets.UTF_8))
+            if (statusPieces.endsWith("+")) {
+                statusPieces.setLength(statusPieces.length - 1)
+                return
+            }
+            status.tryEmit(statusPieces.toString())
+            statusPieces.setLength(0)
+        }
+
+        @Deprecated("Used before API 33")
+        override fun onCharacteristicChanged(gatt: BluetoothGatt, c: BluetoothGattCharacteristic) {
+            if (Build.VERSION.SDK_INT < Build.VERSION_CODES.TIRAMISU) {
+                @Suppress("DEPRECATION")
+                onCharacteristicChanged(gatt, c, c.value)
+            }
+        }
+
+        private fun complete(op: GattOp, uuid: UUID?, status: Int) {
+            val p = pending ?: return
+            if (p.op == op && (p.uuid == null || p.uuid == uuid)) p.done.complete(status)
         }
     }
 
-// ---- 2) Connect & discover services ----
-suspend fun connectAndDiscover(context: Context, device: BluetoothDevice): BluetoothGatt =
-    suspendCancellableCoroutine { cont ->
-        val callback = object : BluetoothGattCallback() {
-            override fun onConnectionStateChange(gatt: BluetoothGatt, status: Int, newState: Int) {
-                if (status != BluetoothGatt.GATT_SUCCESS) {
-                    cont.resumeWithException(Exception("Connection failed: $status"))
-                    gatt.close()
-                    return
-                }
-                if (newState == BluetoothProfile.STATE_CONNECTED) {
-                    gatt.discoverServices()
-                } else if (newState == BluetoothProfile.STATE_DISCONNECTED) {
-                    cont.resumeWithException(Exception("Disconnected"))
-                    gatt.close()
-                }
+    private class GattBusy : Exception()
+
+    private suspend fun gattOp(op: GattOp, uuid: UUID? = null, timeoutMs: Long = 10000, start: () -> Boolean): Int =
+        opLock.withLock {
+            val done = CompletableDeferred<Int>()
+            pending = PendingOp(op, uuid, done)
+            try {
+                if (!start()) throw Exception("$op failed to initiate")
+                withTimeout(timeoutMs) { done.await() }
+            } finally {
+                pending = null
             }
+        }
+
+    suspend fun connect() {
+        gatt = device.connectGatt(context, false, callback, BluetoothDevice.TRANSPORT_LE)
+        withTimeout(15000) { connected.await() }
 
-            override fun onServicesDiscovered(gatt: BluetoothGatt, status: Int) {
-                if (status == BluetoothGatt.GATT_SUCCESS) {
-                    // Request MTU (optional, Android only)
-                    gatt.requestMtu(247)
-                } else {
-                    cont.resumeWithException(Exception("Service discovery failed"))
-                    gatt.close()
+        // Short connection interval for the transfer; the device may still renegotiate (auto-tuning)
+        gatt.requestConnectionPriority(BluetoothGatt.CONNECTION_PRIORITY_HIGH)
+
+        // 2M PHY roughly doubles the air rate; phones or firmware without it just stay on 1M
+        // (some stacks skip onPhyUpdate when nothing changes, hence the short timeout)
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.O) {
+            runCatching {
+                gattOp(GattOp.PHY, timeoutMs = 2000) {
+                    gatt.setPreferredPhy(BluetoothDevice.PHY_LE_2M_MASK, BluetoothDevice.PHY_LE_2M_MASK,
+                                         BluetoothDevice.PHY_OPTION_NO_PREFERRED)
+                    true
                 }
             }
+        }
 
-            override fun onMtuChanged(gatt: BluetoothGatt, mtu: Int, status: Int) {
-                cont.resume(gatt)
+        val discovered = gattOp(GattOp.DISCOVER, timeoutMs = 15000) { gatt.discoverServices() }
+        if (discovered != BluetoothGatt.GATT_SUCCESS) throw Exception("Service discovery failed: $discovered")
+        gattOp(GattOp.MTU) { gatt.requestMtu(517) }
+
+        val statusChar = characteristic(STATUS_CHAR_UUID)
+        gatt.setCharacteristicNotification(statusChar, true)
+        val cccd = statusChar.getDescriptor(CCCD_UUID) ?: error("Status CCCD not found")
+        val enable = BluetoothGattDescriptor.ENABLE_NOTIFICATION_VALUE
+        gattOp(GattOp.DESCRIPTOR, cccd.uuid) {
+            if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.TIRAMISU) {
+                gatt.writeDescriptor(cccd, enable) == BluetoothStatusCodes.SUCCESS
+            } else {
+                @Suppress("DEPRECATION")
+                cccd.value = enable
+                @Suppress("DEPRECATION")
+                gatt.writeDescriptor(cccd)
             }
         }
+        println("🔗 Connected: MTU $mtu, PHY $phy")
+    }
 
-        val gatt = device.connectGatt(context, false, callback)
-        cont.invokeOnCancellation { gatt.close() }
+    fun characteristic(uuid: UUID): BluetoothGattCharacteristic {
+        val svc = gatt.getService(SERVICE_UUID) ?: error("Service not found")
+        return svc.getCharacteristic(uuid) ?: error("Characteristic $uuid not found")
     }
 
-// ---- 3) Find OTA characteristic ----
-fun findOtaCharacteristic(gatt: BluetoothGatt): BluetoothGattCharacteristic {
-    val svc = gatt.getService(SERVICE_UUID) ?: error("Service not found")
-    return svc.getCharacteristic(OTA_CHAR_UUID) ?: error("OTA characteristic not found")
+    suspend fun write(ch: BluetoothGattCharacteristic, data: ByteArray, withResponse: Boolean) {
+        val type = if (withResponse) BluetoothGattCharacteristic.WRITE_TYPE_DEFAULT
+                   else BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE
+        while (true) {
+            val status = try {
+                gattOp(GattOp.WRITE, ch.uuid) {
+                    if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.TIRAMISU) {
+                        val result = gatt.writeCharacteristic(ch, data, type)
+                        if (result == BluetoothStatusCodes.ERROR_GATT_WRITE_REQUEST_BUSY) throw GattBusy()
+                        result == BluetoothStatusCodes.SUCCESS
+                    } else {
+                        @Suppress("DEPRECATION")
+                        ch.writeType = type
+                        @Suppress("DEPRECATION")
+                        ch.value = data
+                        @Suppress("DEPRECATION")
+                        gatt.writeCharacteristic(ch)
+                    }
+                }
+            } catch (_: GattBusy) {
+                // Stack queue full: it refuses instead of queueing, so back off briefly and retry
+                delay(2)
+                continue
+            }
+            if (status != BluetoothGatt.GATT_SUCCESS) throw Exception("Write failed: $status")
+            return
+        }
+    }
+
+    fun close() {
+        try { gatt.disconnect() } catch (_: Exception) {}
+        try { gatt.close() } catch (_: Exception) {}
+    }
 }
 
-// ---- 4) Write helper (suspend until confirmed) ----
-suspend fun write(
-    gatt: BluetoothGatt,
-    ch: BluetoothGattCharacteristic,
-    data: ByteArray,
-    withResponse: Boolean
-) {
-    val result = CompletableDeferred<Boolean>()
-    val callback = object : BluetoothGattCallback() {
-        override fun onCharacteristicWrite(g: BluetoothGatt, c: BluetoothGattCharacteristic, status: Int) {
-            if (status == BluetoothGatt.GATT_SUCCESS) {
-                result.complete(true)
-            } else {
-                result.completeExceptionally(Exception("Write failed: $status"))
+// Suspends until `offset` is within one window of the last ACK. Only the slow path allocates:
+// it races the credit against a BUSY failure and gives up after CREDIT_TIMEOUT_MS.
+suspend fun awaitCredit(offset: Int, acked: StateFlow<Int>, window: StateFlow<Int>, failure: Deferred<String>) {
+    if (offset - acked.value < window.value) return
+    val waited = withTimeoutOrNull(CREDIT_TIMEOUT_MS) {
+        coroutineScope {
+            val credit = async { acked.first { offset - it < window.value } }
+            select<Unit> {
+                credit.onAwait { }
+                failure.onAwait { credit.cancel(); throw Exception(it) }
             }
         }
     }
+    if (waited == null) throw Exception("No ACK credit for ${CREDIT_TIMEOUT_MS / 1000} s at offset $offset")
+}
 
-    ch.writeType = if (withResponse)
-        BluetoothGattCharacteristic.WRITE_TYPE_DEFAULT
-    else
-        BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE
+// 'HELLO:v=1,mtu=247,chunk=244,...' -> {v=1, mtu=247, chunk=244, ...}
+fun parseStatusFields(reply: String): Map<String, String> =
+    reply.substringAfter(':').split(',').associate { it.substringBefore('=') to it.substringAfter('=', "") }
 
-    ch.value = data
+// ---- 3) OTA transfer ----
+// A producer coroutine queues chunk offsets into a Channel while the device's ACK credits
+// allow (at most `window` bytes unacknowledged), and the writer drains it back to back with
+// write-without-response. No fixed sleeps: the device's flow control paces the link.
+// The writer copies each chunk into one reused buffer: the stack has taken the value by the
+// time the write completes, so nothing is allocated per chunk.
+suspend fun performOtaTransfer(
+    conn: OtaConnection,
+    firmware: ByteArray,
+    signature: ByteArray? = null,
+    onThroughput: (sent: Int, total: Int, bytesPerSec: Double) -> Unit = { sent, total, bps ->
+        println("   ${sent * 100 / total}% complete, ${"%.1f".format(bps / 1024)} KB/s")
+    }
+) = coroutineScope {
+    val ota = conn.characteristic(OTA_CHAR_UUID)
+    val acked = MutableStateFlow(0)
+    val window = MutableStateFlow(4096)
+    val hello = CompletableDeferred<Map<String, String>>()
+    val done = CompletableDeferred<Map<String, String>>()
+    val failure = CompletableDeferred<String>()
 
-    if (!gatt.writeCharacteristic(ch)) {
-        throw Exception("writeCharacteristic failed to initiate")
+    // Undispatched so the subscription exists before HELLO goes out
+    val statusJob = launch(start = CoroutineStart.UNDISPATCHED) {
+        conn.status.collect { msg ->
+            when {
+                msg.startsWith("HELLO:") -> hello.complete(parseStatusFields(msg))
+                msg.startsWith("DONE:") -> done.complete(parseStatusFields(msg))
+                msg.startsWith("ACK:") -> acked.value = msg.substring(4).toInt()
+                msg.startsWith("TUNE:window=") -> window.value = msg.substringAfter('=').toInt()
+                // Another central holds the upload (the device allows observers alongside it)
+                msg == "BUSY" -> failure.complete("device busy with another upload")
+            }
+        }
     }
 
-    result.await()
+    // HELLO: one write replaces OPEN + size, the reply carries the link parameters
+    val started = SystemClock.elapsedRealtime()
+    val helloMsg = ByteBuffer.allocate(14).order(ByteOrder.LITTLE_ENDIAN)
+        .put("HELLO".toByteArray(Charsets.US_ASCII))
+        .put(OTA_PROTOCOL_VERSION.toByte())
+        .putInt(firmware.size)
+        .putInt(OTA_FEATURE_FLOW_CONTROL)
+        .array()
+    conn.write(ota, helloMsg, withResponse = true)
+    val params = withTimeout(5000) { hello.await() }
+    params["error"]?.let { throw Exception("Device refused the session: $it") }
+    println("🤝 Session setup ${SystemClock.elapsedRealtime() - started} ms: $params")
 
-    // Add pacing delay after each write to prevent ESP32 OTA packet loss
-    delay(30) // 30 ms is safe; adjust if stable at lower values
-}
+    val chunkSize = minOf(params["chunk"]?.toIntOrNull() ?: 20, conn.mtu - 3)
+    params["window"]?.toIntOrNull()?.let { window.value = it }
+    println("📦 Sending ${firmware.size} bytes in chunks of $chunkSize (window ${window.value})")
 
-// ---- 5) OTA transfer ----
-suspend fun performOtaTransfer(gatt: BluetoothGatt, ch: BluetoothGattCharacteristic, firmware: ByteArray) {
-    val payload = (gatt.mtu - 3).coerceAtLeast(20)
-    println("📦 Sending ${firmware.size} bytes in chunks of $payload")
-
-    // OPEN
-    write(gatt, ch, "OPEN".toByteArray(Charsets.UTF_8), withResponse = true)
-
-    // SIZE
-    val sizeBytes = ByteBuffer.allocate(4).order(ByteOrder.LITTLE_ENDIAN).putInt(firmware.size).array()
-    write(gatt, ch, sizeBytes, withResponse = true)
-
-    // DATA
-    var off = 0
-    while (off < firmware.size) {
-        val end = (off + payload).coerceAtMost(firmware.size)
-        write(gatt, ch, firmware.copyOfRange(off, end), withResponse = false)
-        off = end
-         // Add pacing delay after each write to prevent ESP32 OTA packet loss
-    delay(30) // 30 ms is safe; adjust if stable at lower values
+    val offsets = Channel<Int>(PIPELINE_DEPTH)
+    launch {
+        var offset = 0
+        while (offset < firmware.size) {
+            // Wait for credits: keep at most one window of unacknowledged data in flight
+            awaitCredit(offset, acked, window, failure)
+            offsets.send(offset)
+            offset += chunkSize
+        }
+        offsets.close()
     }
 
-    // DONE
-    write(gatt, ch, "DONE".toByteArray(Charsets.UTF_8), withResponse = true)
-    println("✅ OTA update completed")
-}
+    val buffer = ByteArray(chunkSize)
+    var sent = 0
+    var reportAt = SystemClock.elapsedRealtime()
+    var reportSent = 0
+    for (offset in offsets) {
+        if (failure.isCompleted) throw Exception(failure.await())
+        val length = minOf(chunkSize, firmware.size - offset)
+        // The last chunk is usually short and gets an array of its own
+        val chunk = if (length == chunkSize) buffer else ByteArray(length)
+        System.arraycopy(firmware, offset, chunk, 0, length)
+        conn.write(ota, chunk, withResponse = false)
+        sent += length
+        val now = SystemClock.elapsedRealtime()
+        if (now - reportAt >= THROUGHPUT_REPORT_MS || sent == firmware.size) {
+            onThroughput(sent, firmware.size, (sent - reportSent) * 1000.0 / maxOf(now - reportAt, 1))
+            reportAt = now
+            reportSent = sent
+        }
+    }
 
-// ---- 6) Cleanup ----
-fun disconnectSafely(gatt: BluetoothGatt) {
-    try { gatt.disconnect() } catch (_: Exception) {}
-    try { gatt.close() } catch (_: Exception) {}
+    // Signed images: signature (from sign_firmware.py) goes after the last data byte
+    if (signature != null) {
+        conn.write(ota, "SIG".toByteArray(Charsets.US_ASCII) + signature, withResponse = true)
+    } else if ("sig" in params) {
+        println("⚠️ Device requires signed images but no signature was given")
+    }
+
+    // The device answers DONE:ok or DONE:error=<reason> with the byte count and CRC-32 it received
+    conn.write(ota, "DONE".toByteArray(Charsets.US_ASCII), withResponse = true)
+    val outcome = withTimeout(10000) { done.await() }
+    statusJob.cancel()
+    outcome["error"]?.let { throw Exception("Device rejected the image: $it") }
+    val crc = CRC32().apply { update(firmware) }.value
+    val deviceCrc = outcome["crc"]?.removePrefix("0x")?.toLongOrNull(16)
+    if (deviceCrc != crc) throw Exception("CRC mismatch: device ${outcome["crc"]}, image 0x${crc.toString(16)}")
+    val elapsed = SystemClock.elapsedRealtime() - started
+    println("✅ OTA update completed (${"%.1f".format(firmware.size * 1000.0 / elapsed / 1024)} KB/s average, CRC confirmed)")
 }
+
+// ---- 4) Usage ----
+// val device = scanForDeviceOnce(adapter.bluetoothLeScanner) ?: error("No OTA device found")
+// val conn = OtaConnection(context, device)
+// try { conn.connect(); performOtaTransfer(conn, firmware) } finally { conn.close() }
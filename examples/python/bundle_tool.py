@@ -0,0 +1,115 @@
+"""
+Multi-image bundles for OTA_FEATURE_BUNDLE sessions (see README "OTA Protocol")
+
+A bundle is a manifest ("OTAB", version, item count, 2 reserved bytes, then per
+item the target name NUL-padded to 12 bytes, size u32 LE and SHA-256) followed by
+the payloads in manifest order. Target "app" is the application; any other name
+is a data target written to the inactive one of the partitions <name>_0/<name>_1
+(co-processor images included: the app flashes them from getBundlePartition()).
+
+  python bundle_tool.py build release.bundle app=firmware.bin assets=assets.bin
+  python bundle_tool.py compare app=firmware.bin assets=assets.bin [connect_s] [reboot_s]
+
+compare times the payloads through the pull-mode device emulator (pull_emulator.py),
+once as a single bundle session and once as one session per payload, adding the
+per-session connect/HELLO and reboot costs (defaults 2.0 s and 3.0 s; take real
+values from the session history or a link test).
+"""
+
+import asyncio
+import hashlib
+import struct
+import sys
+import time
+
+MAGIC = b"OTAB"
+VERSION = 1
+MAX_ITEMS = 4
+NAME_SIZE = 12
+
+
+def build(items):
+    """items: [(target, payload)] -> bundle bytes."""
+    if not 0 < len(items) <= MAX_ITEMS:
+        raise ValueError(f"1..{MAX_ITEMS} payloads per bundle")
+    manifest = MAGIC + struct.pack("<BBH", VERSION, len(items), 0)
+    for target, payload in items:
+        if not 0 < len(target) <= NAME_SIZE or not payload:
+            raise ValueError(f"bad target or empty payload: {target}")
+        manifest += target.encode().ljust(NAME_SIZE, b"\0") + struct.pack("<I", len(payload))
+        manifest += hashlib.sha256(payload).digest()
+    return manifest + b"".join(payload for _, payload in items)
+
+
+def parse(bundle):
+    """Mirror of BLEOtaUpdate::parseBundleManifest(); returns [(target, payload)]."""
+    magic, version, count, _ = struct.unpack_from("<4sBBH", bundle)
+    if magic != MAGIC or version != VERSION or not 0 < count <= MAX_ITEMS:
+        raise ValueError("not a bundle")
+    offset, entries = 8 + count * (NAME_SIZE + 36), []
+    for i in range(count):
+        entry = bundle[8 + i * (NAME_SIZE + 36):8 + (i + 1) * (NAME_SIZE + 36)]
+        target = entry[:NAME_SIZE].rstrip(b"\0").decode()
+        size = struct.unpack_from("<I", entry, NAME_SIZE)[0]
+        payload = bundle[offset:offset + size]
+        if hashlib.sha256(payload).digest() != entry[NAME_SIZE + 4:]:
+            raise ValueError(f"digest mismatch for {target}")
+        entries.append((target, payload))
+        offset += size
+    if offset != len(bundle):
+        raise ValueError("payloads do not add up to the bundle size")
+    return entries
+
+
+def read_items(args):
+    items = []
+    for arg in args:
+        target, _, path = arg.partition("=")
+        with open(path, "rb") as f:
+            items.append((target, f.read()))
+    return items
+
+
+async def timed_transfer(data):
+    from pull_emulator import EmulatedDevice
+    from pull_transfer import PullSender
+    sender = None
+    device = EmulatedDevice(len(data), notify=lambda msg: sender.on_status(msg))
+    sender = PullSender(device.write, data, chunk_size=244)
+    started = time.monotonic()
+    await asyncio.gather(device.run(), sender.run())
+    if bytes(device.image) != data:
+        raise RuntimeError("emulated transfer corrupted the data")
+    return time.monotonic() - started
+
+
+async def compare(items, connect_s, reboot_s):
+    bundle = build(items)
+    bundle_s = connect_s + await timed_transfer(bundle) + reboot_s
+    sequential_s = 0
+    for target, payload in items:
+        session_s = connect_s + await timed_transfer(payload) + reboot_s
+        print(f"  {target}: {len(payload)} bytes, {session_s:.2f} s as its own session")
+        sequential_s += session_s
+    print(f"bundle: {len(bundle)} bytes, {bundle_s:.2f} s in one session; "
+          f"sequential: {sequential_s:.2f} s in {len(items)} sessions "
+          f"({sequential_s - bundle_s:.2f} s saved, {len(items) - 1} fewer reboots)")
+
+
+def main():
+    if len(sys.argv) >= 4 and sys.argv[1] == "build":
+        bundle = build(read_items(sys.argv[3:]))
+        parse(bundle)
+        with open(sys.argv[2], "wb") as f:
+            f.write(bundle)
+        print(f"Wrote {sys.argv[2]} ({len(bundle)} bytes)")
+    elif len(sys.argv) >= 3 and sys.argv[1] == "compare":
+        paths = [arg for arg in sys.argv[2:] if "=" in arg]
+        costs = [float(arg) for arg in sys.argv[2:] if "=" not in arg] + [2.0, 3.0]
+        asyncio.run(compare(read_items(paths), costs[0], costs[1]))
+    else:
+        print(__doc__)
+
+
+if __name__ == "__main__":
+    main()
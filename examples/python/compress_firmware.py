@@ -0,0 +1,105 @@
+"""
+Block-compressed container for OTA_FEATURE_COMPRESSED sessions (codec "zblk", see README "OTA Protocol")
+
+The image is cut into 4096-byte blocks and each block is compressed on its own
+(raw deflate with a 4 KB window, or stored when that is not smaller), so the
+device decodes every block into one non-wrapping 4 KB buffer and a transfer can
+restart at any block boundary. Each frame on the wire is an 8-byte header
+(compressed size u16, method u8, reserved u8, CRC32 of the decoded block u32,
+little endian) followed by the payload.
+
+The .zblk file is a 16-byte header ("OTAZ", version, log2 block size, reserved
+u16, image size u32, block count u32), an index of 12 bytes per block
+(uncompressed offset u32, compressed size u16, method u8, reserved u8, CRC32
+u32) and the frames. ota_client.py with COMPRESSED = True builds the same
+container in memory.
+
+  python compress_firmware.py firmware.bin    # writes firmware.bin.zblk, prints the ratio cost
+"""
+
+import binascii
+import struct
+import sys
+import zlib
+
+BLOCK_SIZE = 4096
+WINDOW_BITS = 12  # Back-references never leave the block, so 4 KB is the whole window
+STORED, DEFLATE = 0, 1
+FRAME_HEADER = "<HBBI"
+INDEX_ENTRY = "<IHBBI"
+FILE_HEADER = "<4sBBHII"
+
+
+def _deflate(block):
+    encoder = zlib.compressobj(9, zlib.DEFLATED, -WINDOW_BITS, 9)
+    return encoder.compress(block) + encoder.flush()
+
+
+def build(image, block_size=BLOCK_SIZE):
+    """Return (index, frames): one (offset, size, method, crc) entry and one frame per block."""
+    index, frames = [], []
+    for offset in range(0, len(image), block_size):
+        block = image[offset:offset + block_size]
+        payload, method = _deflate(block), DEFLATE
+        if len(payload) >= len(block):
+            payload, method = block, STORED
+        crc = binascii.crc32(block)
+        index.append((offset, len(payload), method, crc))
+        frames.append(struct.pack(FRAME_HEADER, len(payload), method, 0, crc) + payload)
+    return index, frames
+
+
+def frame_offsets(frames):
+    """Stream offset of every frame, plus the stream length; used to seek to a block."""
+    offsets = [0]
+    for frame in frames:
+        offsets.append(offsets[-1] + len(frame))
+    return offsets
+
+
+def decode(frames, image_size, block_size=BLOCK_SIZE):
+    """Mirror of the device decoder: every frame on its own, checked against its CRC."""
+    image = bytearray()
+    for number, frame in enumerate(frames):
+        size, method, _, crc = struct.unpack_from(FRAME_HEADER, frame)
+        payload = frame[struct.calcsize(FRAME_HEADER):]
+        block = payload if method == STORED else zlib.decompressobj(-WINDOW_BITS).decompress(payload)
+        if len(payload) != size or len(block) != min(block_size, image_size - len(image)) or \
+                binascii.crc32(block) != crc:
+            raise ValueError(f"frame {number} does not decode")
+        image += block
+    return bytes(image)
+
+
+def write(path, image, index, frames):
+    with open(path, "wb") as f:
+        f.write(struct.pack(FILE_HEADER, b"OTAZ", 1, BLOCK_SIZE.bit_length() - 1, 0, len(image), len(index)))
+        for entry in index:
+            f.write(struct.pack(INDEX_ENTRY, entry[0], entry[1], entry[2], 0, entry[3]))
+        for frame in frames:
+            f.write(frame)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+    index, frames = build(image)
+    if decode(frames, len(image)) != image:
+        raise SystemExit("round trip failed")
+    write(sys.argv[1] + ".zblk", image, index, frames)
+
+    # What block independence costs against compressing the image as one stream
+    stream = sum(len(frame) for frame in frames)
+    whole = len(zlib.compress(image, 9))
+    stored = sum(1 for entry in index if entry[2] == STORED)
+    print(f"{sys.argv[1]}: {len(image)} -> {stream} bytes on the wire ({100 * stream / len(image):.1f}%), "
+          f"{len(index)} blocks ({stored} stored)")
+    print(f"whole-stream deflate: {whole} bytes ({100 * whole / len(image):.1f}%), "
+          f"block container costs {stream - whole} bytes ({100 * (stream - whole) / whole:+.1f}%)")
+
+
+if __name__ == "__main__":
+    main()
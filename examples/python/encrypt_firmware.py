@@ -0,0 +1,47 @@
+"""
+Encrypt firmware images for BLEOtaUpdate::setEncryptionKey() (AES-256-CTR)
+Requires: cryptography
+Install: pip install cryptography
+
+  python encrypt_firmware.py keygen device_key.bin             # prints the C array for the sketch
+  python encrypt_firmware.py encrypt device_key.bin firmware.bin    # writes firmware.bin.enc
+
+firmware.bin.enc is the 16-byte IV followed by the ciphertext; ota_client.py
+with ENCRYPTED = True sends the IV in HELLO and streams the ciphertext. Sign
+the plaintext (sign_firmware.py) before encrypting: the device verifies the
+signature over the decrypted image.
+"""
+
+import os
+import sys
+from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+
+
+def keygen(key_file):
+    key = os.urandom(32)
+    with open(key_file, "wb") as f:
+        f.write(key)
+    rows = [", ".join(f"0x{b:02x}" for b in key[i:i + 16]) for i in range(0, len(key), 16)]
+    print(f"Wrote {key_file}. Add this to the sketch and call bleOta.setEncryptionKey(OTA_DEVICE_KEY, 32):\n")
+    print("const uint8_t OTA_DEVICE_KEY[32] = {\n  " + ",\n  ".join(rows) + "\n};")
+
+
+def encrypt(key_file, firmware_file):
+    with open(key_file, "rb") as f:
+        key = f.read()
+    with open(firmware_file, "rb") as f:
+        image = f.read()
+    iv = os.urandom(16)  # Initial counter block; never reuse one with the same key
+    encryptor = Cipher(algorithms.AES(key), modes.CTR(iv)).encryptor()
+    with open(firmware_file + ".enc", "wb") as f:
+        f.write(iv + encryptor.update(image) + encryptor.finalize())
+    print(f"Encrypted {firmware_file} ({len(image)} bytes) -> {firmware_file}.enc")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) == 3 and sys.argv[1] == "keygen":
+        keygen(sys.argv[2])
+    elif len(sys.argv) == 4 and sys.argv[1] == "encrypt":
+        encrypt(sys.argv[2], sys.argv[3])
+    else:
+        print(__doc__)
@@ -0,0 +1,82 @@
+"""
+Merkle tree for OTA_FEATURE_MERKLE sessions (see README "OTA Protocol")
+
+Leaves are SHA-256(0x00 || block) over 4096-byte blocks of the image as sent
+(the ciphertext for encrypted images), nodes are SHA-256(0x01 || left || right),
+and an odd node at the end of a level is promoted unchanged.
+
+  python merkle_tree.py firmware.bin    # prints the root and verifies every path
+"""
+
+import hashlib
+import sys
+
+BLOCK_SIZE = 4096
+
+
+def _leaf(block):
+    return hashlib.sha256(b"\x00" + block).digest()
+
+
+def _node(left, right):
+    return hashlib.sha256(b"\x01" + left + right).digest()
+
+
+def build(image, block_size=BLOCK_SIZE):
+    """Return the tree as a list of levels, leaves first; levels[-1][0] is the root."""
+    level = [_leaf(image[i:i + block_size]) for i in range(0, max(len(image), 1), block_size)]
+    levels = [level]
+    while len(level) > 1:
+        level = [_node(level[i], level[i + 1]) if i + 1 < len(level) else level[i]
+                 for i in range(0, len(level), 2)]
+        levels.append(level)
+    return levels
+
+
+def auth_path(levels, index):
+    """Sibling hashes from the leaf up, skipping levels where the node is promoted."""
+    path = []
+    for level in levels[:-1]:
+        sibling = index ^ 1
+        if sibling < len(level):
+            path.append(level[sibling])
+        index //= 2
+    return path
+
+
+def verify(block, index, path, root, block_count):
+    """Mirror of BLEOtaUpdate::verifyMerkleBlock()."""
+    digest, used, count = _leaf(block), 0, block_count
+    while count > 1:
+        if index % 2 == 1 or index + 1 < count:
+            if used == len(path):
+                return False
+            sibling = path[used]
+            digest = _node(sibling, digest) if index % 2 == 1 else _node(digest, sibling)
+            used += 1
+        index //= 2
+        count = (count + 1) // 2
+    return used == len(path) and digest == root
+
+
+def path_message(levels, index):
+    """The PATH write that precedes block `index`."""
+    return b"PATH" + index.to_bytes(4, "little") + b"".join(auth_path(levels, index))
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+    levels = build(image)
+    root = levels[-1][0]
+    blocks = len(levels[0])
+    ok = all(verify(image[i * BLOCK_SIZE:(i + 1) * BLOCK_SIZE], i, auth_path(levels, i), root, blocks)
+             for i in range(blocks))
+    print(f"root {root.hex()}, {blocks} blocks, depth {len(levels) - 1}, paths {'ok' if ok else 'BROKEN'}")
+
+
+if __name__ == "__main__":
+    main()
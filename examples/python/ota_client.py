@@ -5,56 +5,451 @@ Install: pip install bleak
 """
 
 import asyncio
+import binascii
+import os
+import struct
+import time
 from bleak import BleakClient, BleakScanner
+import compress_firmware
+import merkle_tree
+import pull_transfer
+import wifi_transfer
 
 # Replace with your ESP32's BLE name and UUIDs
 DEVICE_NAME = "ESP32_OTA"
 OTA_SERVICE_UUID = "12345678-1234-5678-9ABC-DEF012345678"
 OTA_CHARACTERISTIC_UUID = "87654321-4321-8765-CBA9-FEDCBA987654"
+COMMAND_CHARACTERISTIC_UUID = "11111111-2222-3333-4444-555555555555"
+STATUS_CHARACTERISTIC_UUID = "AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEEE"
+HISTORY_CHARACTERISTIC_UUID = "AAAAAAAA-BBBB-CCCC-DDDD-EEEEEEEEEEE1"
+
+# HELLO handshake (see README "OTA Protocol")
+OTA_PROTOCOL_VERSION = 1
+OTA_FEATURE_FLOW_CONTROL = 0x00000001
+OTA_FEATURE_LONG_WRITE = 0x00000002
+OTA_FEATURE_SINK = 0x00000004
+OTA_FEATURE_ENCRYPTED = 0x00000008
+OTA_FEATURE_MERKLE = 0x00000010
+OTA_FEATURE_COMPRESSED = 0x00000020
+OTA_FEATURE_PULL = 0x00000040
+OTA_FEATURE_WIFI = 0x00000080
+OTA_FEATURE_BUNDLE = 0x00000100
+OTA_FEATURE_RESUME = 0x00000200
+
+# Send data as ATT long writes (prepared writes of up to lw= bytes) instead of
+# MTU-sized write-without-response packets; compare the reported KB/s of both
+USE_LONG_WRITES = False
+
+# Link-only test: run the full protocol but have the device discard the data,
+# and measure command/status round trips (0 to skip the echo test)
+LINK_TEST = False
+ECHO_COUNT = 0
+
+# After a link test, download the device's event trace (firmware built with
+# -DBLE_OTA_TRACE=1) and convert it with trace_to_chrome.py
+DUMP_TRACE = False
+TRACE_FILE = "ota_trace.txt"
+
+# Print the device's stored session history before updating
+SHOW_HISTORY = False
+OTA_RECORD_FORMAT = "<7I4H4B"  # struct OtaSessionRecord
+OTA_OUTCOMES = ["IDLE", "RECEIVING", "COMPLETED", "ERROR", "ABORTED"]
 
 # Path to the firmware binary
 FIRMWARE_FILE = "firmware.bin"
 
+# Send FIRMWARE_FILE + ".enc" from encrypt_firmware.py (IV + AES-CTR ciphertext)
+ENCRYPTED = False
+
+# Authenticate every 4 KB block against a Merkle root (merkle_tree.py); the device
+# rejects bad blocks on arrival with NAK:<block> and the client resends from there
+MERKLE = False
+
+# Send FIRMWARE_FILE as a block-compressed container (compress_firmware.py); a
+# bad frame is answered NAK:<block> and the client seeks back to that block
+COMPRESSED = False
+
+# Let the device drive the transfer: it requests ranges (REQ:<offset>,<length>)
+# as its buffers free up and re-requests gaps itself (try pull_emulator.py first)
+PULL = False
+
+# Send the image over Wi-Fi (HTTP PUT) when the device offers it (BLE_OTA_WIFI builds with
+# setWifiDataPath(true)); BLE carries the control messages and takes over if TCP fails
+WIFI = False
+
+# Ask the device to hold the session if the link drops (OTA_RESUME_HOLD_MS, 30 s by default);
+# running the client again within that time continues from the resume= offset in the reply
+RESUME = False
+
+# Send a multi-image bundle (bundle_tool.py build) instead of FIRMWARE_FILE; the device
+# verifies each payload (BUNDLE:item=<n>/<count>,...) and switches all of them together
+BUNDLE_FILE = None
+
+# Download an object instead of updating (device needs bleOta.setBulkReadEnabled(true) and
+# bonding, the client pairs first): "coredump", "log" or "part:<app partition label>",
+# optionally with ",<offset>,<length>"
+READ_OBJECT = None
+READ_FILE = "ota_read.bin"
+
+# Advertised OTA info (enable with bleOta.setAdvertiseOtaInfo(true) on the device)
+ADV_COMPANY_ID = 0xFFFF
+TARGET_VERSION = None  # e.g. (1, 2, 0) to skip devices already on this version
+
+
+def parse_ota_adv(adv):
+    """Decode the OTA manufacturer data record from the scan response, or None."""
+    record = adv.manufacturer_data.get(ADV_COMPANY_ID) if adv else None
+    if not record or len(record) < 13 or record[0] != 1:
+        return None
+    return {
+        "version": tuple(record[1:4]),
+        "hash_prefix": record[4:8].hex(),
+        "state": record[8],
+        "slot_kb": int.from_bytes(record[9:11], "little"),
+        "caps": int.from_bytes(record[11:13], "little"),
+    }
+
+async def print_session_history(client):
+    data = await client.read_gatt_char(HISTORY_CHARACTERISTIC_UUID)
+    size = struct.calcsize(OTA_RECORD_FORMAT)
+    for offset in range(0, len(data) - size + 1, size):
+        (start, uptime_ms, duration_ms, nbytes, avg_bps, peak_bps, features,
+         stalls, retries, mtu, interval, outcome, error, version, flags) = struct.unpack_from(OTA_RECORD_FORMAT, data, offset)
+        when = time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(start)) if start else f"uptime {uptime_ms / 1000:.0f}s"
+        print(f"   {when}: {OTA_OUTCOMES[outcome]} (error {error}), {nbytes} bytes in {duration_ms} ms, "
+              f"avg {avg_bps / 1024:.1f} KB/s, peak {peak_bps / 1024:.1f} KB/s, {stalls} stalls, "
+              f"{retries} retries, MTU {mtu}, interval {interval * 1.25:.2f} ms, flags 0x{flags:02x}")
+
+
+class StatusFrames:
+    """Joins status texts the device split to fit the MTU: every piece but the last ends with '+'."""
+
+    def __init__(self):
+        self.pending = ""
+
+    def feed(self, payload):
+        """Returns the whole message, or None while pieces are still missing."""
+        msg = self.pending + payload.decode(errors="replace")
+        if msg.endswith("+"):
+            self.pending = msg[:-1]
+            return None
+        self.pending = ""
+        return msg
+
+
+def parse_status_fields(reply):
+    """'HELLO:v=1,mtu=247,chunk=244,...' -> {'v': 1, 'mtu': 247, 'chunk': 244, ...}"""
+    params = {}
+    for field in reply.partition(":")[2].split(","):
+        key, _, value = field.partition("=")
+        try:
+            params[key] = int(value, 0)
+        except ValueError:
+            params[key] = value
+    return params
+
+
+async def bulk_read(client, request, path):
+    """#READ: the device notifies offset + data on the OTA characteristic, we #RACK every half window."""
+    loop = asyncio.get_running_loop()
+    begin, end = loop.create_future(), loop.create_future()
+    data = bytearray()
+    state = {"size": None, "window": 8192, "acked": 0, "gap": None}
+
+    def rack(offset, gap=False):
+        command = f"#RACK:{offset}{',gap' if gap else ''}".encode()
+        loop.create_task(client.write_gatt_char(COMMAND_CHARACTERISTIC_UUID, command, response=False))
+
+    frames = StatusFrames()
+
+    def on_status(_, payload):
+        msg = frames.feed(payload)
+        if msg is None:
+            return
+        if msg.startswith("READ:end") and not end.done():
+            end.set_result(parse_status_fields(msg))
+        elif msg.startswith("READ:") and not begin.done():
+            begin.set_result(parse_status_fields(msg))
+
+    def on_data(_, payload):
+        offset = int.from_bytes(payload[:4], "little")
+        if offset != len(data):
+            # Report each gap once; the device resends from the first missing byte
+            if offset > len(data) and state["gap"] != len(data):
+                state["gap"] = len(data)
+                rack(len(data), gap=True)
+            return
+        data.extend(payload[4:])
+        if len(data) - state["acked"] >= state["window"] // 2 or len(data) == state["size"]:
+            state["acked"] = len(data)
+            rack(len(data))
+
+    await client.start_notify(STATUS_CHARACTERISTIC_UUID, on_status)
+    await client.start_notify(OTA_CHARACTERISTIC_UUID, on_data)
+    await client.write_gatt_char(COMMAND_CHARACTERISTIC_UUID, f"#READ:{request}".encode(), response=True)
+    params = await asyncio.wait_for(begin, timeout=5)
+    if "error" in params:
+        print(f"❌ Device refused the read: {params['error']}")
+        return
+    state["size"], state["window"] = params["size"], params.get("window", state["window"])
+    print(f"📥 Reading {request} ({params['size']} bytes)...")
+    result = await asyncio.wait_for(end, timeout=max(30, params["size"] / 2000))
+    crc_ok = result["crc"] == binascii.crc32(data)
+    with open(path, "wb") as f:
+        f.write(data)
+    print(f"📶 Read {result['bytes']} bytes: {result['Bps'] / 1024:.1f} KB/s on device, "
+          f"{result['resent']} resends, CRC {'ok' if crc_ok else 'MISMATCH'} -> {path}")
+
+
+async def send_over_wifi(ready, data, closed):
+    """Bulk data over HTTP; returns the offset BLE has to continue from (len(data) when done)."""
+    # loop() brings the endpoint up after HELLO and reports it, or WIFI:closed when it could not
+    done, _ = await asyncio.wait((ready, closed), timeout=10, return_when=asyncio.FIRST_COMPLETED)
+    if ready not in done:
+        print("⚠️  Device did not open the Wi-Fi endpoint, staying on BLE")
+        return 0
+    params = ready.result()
+    host, _, port = params["wifi"].rpartition(":")
+    if "ssid" in params and not wifi_transfer.join_access_point(params["ssid"], params["psk"]):
+        print("⚠️  Could not join the device's access point, staying on BLE")
+        return 0
+    started = time.monotonic()
+    try:
+        offset = await wifi_transfer.put_image(
+            host, int(port), data, str(params["token"]), progress=lambda n: print(f"   {n / len(data) * 100:.1f}% complete (Wi-Fi)", end="\r"))
+    except (OSError, asyncio.TimeoutError) as error:
+        # The device reports how far the stream got before BLE takes over
+        try:
+            offset = (await asyncio.wait_for(closed, timeout=5))["offset"]
+        except asyncio.TimeoutError:
+            offset = 0
+        print(f"\n⚠️  Wi-Fi transfer failed ({error}), continuing over BLE from {offset}")
+        return offset
+    elapsed = time.monotonic() - started
+    print(f"\n📡 {offset} bytes over Wi-Fi in {elapsed:.1f} s ({offset / elapsed / 1024:.1f} KB/s)")
+    return offset
+
+
 async def ota_update():
     print(f"🔍 Scanning for {DEVICE_NAME}...")
-    devices = await BleakScanner.discover()
-    target_device = next((d for d in devices if DEVICE_NAME in d.name), None)
+    devices = await BleakScanner.discover(return_adv=True)
+    target_device = next((d for d, _ in devices.values() if d.name and DEVICE_NAME in d.name), None)
 
     if not target_device:
         print(f"❌ Device '{DEVICE_NAME}' not found. Make sure it's in OTA mode.")
         return
 
     print(f"✅ Found {target_device.name} [{target_device.address}]")
+
+    info = parse_ota_adv(devices[target_device.address][1])
+    if info:
+        print(f"ℹ️  Firmware v{'.'.join(map(str, info['version']))} ({info['hash_prefix']}), "
+              f"slot {info['slot_kb']} KB")
+        if TARGET_VERSION and info["version"] >= TARGET_VERSION:
+            print("✅ Device is already up to date")
+            return
     
     async with BleakClient(target_device.address) as client:
         print("🔗 Connecting...")
-        if not await client.is_connected():
+        if not client.is_connected:
             print("❌ Failed to connect")
             return
         print("✅ Connected")
 
+        if SHOW_HISTORY:
+            print("📜 Session history (newest first):")
+            await print_session_history(client)
+
+        if READ_OBJECT:
+            await client.pair()  # The device only serves reads over an encrypted link
+            await bulk_read(client, READ_OBJECT, READ_FILE)
+            return
+
         # Read firmware
+        image_file = BUNDLE_FILE or (FIRMWARE_FILE + ".enc" if ENCRYPTED else FIRMWARE_FILE)
         try:
-            with open(FIRMWARE_FILE, "rb") as f:
+            with open(image_file, "rb") as f:
                 firmware_data = f.read()
         except FileNotFoundError:
-            print(f"❌ Firmware file '{FIRMWARE_FILE}' not found.")
-            return
-
-        print(f"📦 Sending firmware ({len(firmware_data)} bytes)...")
-        chunk_size = 512  # Adjust based on your ESP32 config
-        for i in range(0, len(firmware_data), chunk_size):
-            chunk = firmware_data[i:i+chunk_size]
-            await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, chunk)
-            
-            # Delay after each chunk to avoid packet loss / buffer overflow on ESP32
-            await asyncio.sleep(0.03)  # 30 milliseconds delay
-        
-        
-           progress = (i + chunk_size) / len(firmware_data) * 100
-            print(f"   {progress:.1f}% complete", end="\r")
-        
-        print("\n✅ OTA update complete")
+            print(f"❌ Firmware file '{image_file}' not found.")
+            return
+        iv = b""
+        if ENCRYPTED:
+            iv, firmware_data = firmware_data[:16], firmware_data[16:]
+
+        # The wire stream: the image itself, or its zblk frames; ACKs count decoded bytes
+        block = compress_firmware.BLOCK_SIZE if COMPRESSED else merkle_tree.BLOCK_SIZE
+        stream, offsets = firmware_data, None
+        if COMPRESSED:
+            frames = compress_firmware.build(firmware_data)[1]
+            stream, offsets = b"".join(frames), compress_firmware.frame_offsets(frames)
+            print(f"🗜️  {len(firmware_data)} bytes compressed to {len(stream)} in {len(frames)} blocks")
+
+        def stream_offset(image_offset):
+            return offsets[min(image_offset // block, len(offsets) - 1)] if offsets else image_offset
+
+        # Status notifications: replies (HELLO/TEST/RTT/DONE), flow-control ACKs and echo pings
+        loop = asyncio.get_running_loop()
+        replies = {tag: loop.create_future() for tag in ("HELLO:", "TEST:", "RTT:", "DONE:", "WIFI:ready", "WIFI:closed")}
+        trace_lines = []
+        trace_done = loop.create_future()
+        acked = 0
+        window = 4096
+        ack_event = asyncio.Event()
+        nak_block = None
+
+        async def write_data(payload):
+            await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, payload, response=long_writes)
+
+        long_writes = False
+        puller = pull_transfer.PullSender(write_data, stream, 20) if PULL else None
+
+        frames = StatusFrames()
+
+        def on_status(_, data):
+            nonlocal acked, window, nak_block
+            msg = frames.feed(data)
+            if msg is None:
+                return
+            if puller and puller.on_status(msg):
+                pass
+            elif msg.startswith("ACK:"):
+                acked = int(msg[4:])
+                ack_event.set()
+            elif msg.startswith("NAK:"):
+                nak_block = int(msg[4:])
+                ack_event.set()
+            elif msg.startswith("TUNE:window="):
+                window = int(msg[len("TUNE:window="):])
+            elif msg.startswith("PING:"):
+                pong = ("#PONG:" + msg[5:]).encode()
+                loop.create_task(client.write_gatt_char(COMMAND_CHARACTERISTIC_UUID, pong, response=False))
+            elif msg.startswith("BUNDLE:"):
+                print(f"\n🧩 {msg[7:]}")
+            elif msg.startswith("TRACE:"):
+                trace_lines.append(msg)
+                if msg in ("TRACE:end", "TRACE:disabled", "TRACE:error=mtu") and not trace_done.done():
+                    trace_done.set_result(None)
+            for tag, reply in replies.items():
+                if msg.startswith(tag) and not reply.done():
+                    reply.set_result(parse_status_fields(msg))
+
+        await client.start_notify(STATUS_CHARACTERISTIC_UUID, on_status)
+
+        if ECHO_COUNT:
+            await client.write_gatt_char(COMMAND_CHARACTERISTIC_UUID, f"#ECHO:{ECHO_COUNT}".encode(), response=True)
+            rtt = await asyncio.wait_for(replies["RTT:"], timeout=ECHO_COUNT * 2)
+            print(f"⏱️  RTT p50 {rtt['p50'] / 1000:.1f} ms, p90 {rtt['p90'] / 1000:.1f} ms, "
+                  f"p99 {rtt['p99'] / 1000:.1f} ms, lost {rtt['lost']}/{ECHO_COUNT}")
+
+        # HELLO: one write replaces OPEN + size, the reply carries the link parameters
+        started = time.monotonic()
+        features = OTA_FEATURE_FLOW_CONTROL | (OTA_FEATURE_LONG_WRITE if USE_LONG_WRITES else 0)
+        features |= OTA_FEATURE_SINK if LINK_TEST else 0
+        features |= OTA_FEATURE_ENCRYPTED if ENCRYPTED else 0
+        features |= OTA_FEATURE_MERKLE if MERKLE else 0
+        features |= OTA_FEATURE_COMPRESSED if COMPRESSED else 0
+        features |= OTA_FEATURE_PULL if PULL else 0
+        features |= OTA_FEATURE_WIFI if WIFI else 0
+        features |= OTA_FEATURE_BUNDLE if BUNDLE_FILE else 0
+        features |= OTA_FEATURE_RESUME if RESUME else 0
+        tree = merkle_tree.build(firmware_data) if MERKLE else None
+        root = tree[-1][0] if MERKLE else b""
+        hello = b"HELLO" + struct.pack("<BII", OTA_PROTOCOL_VERSION, len(firmware_data), features) + iv + root
+        await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, hello, response=True)
+        params = await asyncio.wait_for(replies["HELLO:"], timeout=5)
+        if "error" in params:
+            print(f"❌ Device refused the session: {params['error']}")
+            return
+        print(f"🤝 Session setup {1000 * (time.monotonic() - started):.0f} ms: {params}")
+
+        chunk_size = min(params.get("chunk", 20), client.mtu_size - 3)
+        long_writes = "lw" in params
+        if long_writes:
+            chunk_size = params["lw"]
+        window = params.get("window", window)
+        print(f"📦 Sending firmware ({len(stream)} bytes) in chunks of {chunk_size}...")
+        resent = 0
+        # A held session continues at an image offset; zblk resumes at that block's frame
+        acked = params.get("resume", 0)
+        start = stream_offset(acked) if acked < len(firmware_data) else len(stream)
+        if acked:
+            print(f"↩️  Resuming the held session at {acked} bytes")
+        if params.get("feat", 0) & OTA_FEATURE_WIFI:
+            start = acked = await send_over_wifi(replies["WIFI:ready"], stream, replies["WIFI:closed"])
+        if PULL:
+            puller.chunk_size = chunk_size - pull_transfer.OFFSET_SIZE
+            await puller.run(progress=lambda offset: print(f"   {offset / len(stream) * 100:.1f}% complete", end="\r"))
+            resent = puller.repairs
+        else:
+            i = start
+            while i < len(stream):
+                # Pace by device ACKs instead of fixed delays
+                while i - stream_offset(acked) >= window and nak_block is None:
+                    ack_event.clear()
+                    await asyncio.wait_for(ack_event.wait(), timeout=10)
+
+                if nak_block is not None:
+                    resent += 1
+                    acked = min(acked, nak_block * block)
+                    i = stream_offset(nak_block * block)
+                    if COMPRESSED:
+                        # The device drops everything until it sees where the resent frames start
+                        seek = b"SEEK" + nak_block.to_bytes(4, "little")
+                        await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, seek, response=long_writes)
+                    nak_block = None
+
+                end = min(i + chunk_size, len(stream))
+                if MERKLE:
+                    # Each block is announced with its authentication path and never straddled. The
+                    # path (8 + 32 bytes per level, 296 up to a 2 MB image) is longer than MTU - 3, so it
+                    # always goes as a write with response, which the stack turns into a long write
+                    if i % block == 0:
+                        path = merkle_tree.path_message(tree, i // block)
+                        await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, path, response=True)
+                    end = min(end, (i // block + 1) * block)
+                await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, stream[i:end], response=long_writes)
+                i = end
+
+                progress = i / len(stream) * 100
+                print(f"   {progress:.1f}% complete", end="\r")
+        if resent:
+            print(f"\n🔁 {resent} {'ranges' if PULL else 'blocks'} re-requested by the device")
+
+        # Signed images: signature (from sign_firmware.py) goes after the last data byte
+        signature_file = (BUNDLE_FILE or FIRMWARE_FILE) + ".sig"
+        if os.path.exists(signature_file):
+            with open(signature_file, "rb") as f:
+                await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, b"SIG" + f.read(), response=True)
+        elif "sig" in params:
+            print(f"\n⚠️  Device requires signed images but {signature_file} is missing")
+
+        await client.write_gatt_char(OTA_CHARACTERISTIC_UUID, b"DONE", response=True)
+        elapsed = time.monotonic() - started
+
+        if LINK_TEST:
+            result = await asyncio.wait_for(replies["TEST:"], timeout=5)
+            crc_ok = result["crc"] == binascii.crc32(firmware_data)
+            print(f"\n📶 Link test: {result['Bps'] / 1024:.1f} KB/s on device, "
+                  f"{len(stream) / elapsed / 1024:.1f} KB/s end to end, "
+                  f"lost {result['lost']} bytes, CRC {'ok' if crc_ok else 'MISMATCH'}")
+            if DUMP_TRACE:
+                await client.write_gatt_char(COMMAND_CHARACTERISTIC_UUID, b"#TRACE", response=True)
+                await asyncio.wait_for(trace_done, timeout=30)
+                with open(TRACE_FILE, "w") as f:
+                    f.write("\n".join(trace_lines) + "\n")
+                print(f"🧵 Trace saved to {TRACE_FILE} ({len(trace_lines)} lines)")
+            return
+
+        # The CRC covers the data as sent: ciphertext when encrypted, the bundle, or the image zblk inflates to
+        outcome = await asyncio.wait_for(replies["DONE:"], timeout=10)
+        if "error" in outcome:
+            print(f"\n❌ Device rejected the image: {outcome['error']}")
+        elif outcome["crc"] != binascii.crc32(firmware_data):
+            print(f"\n❌ CRC mismatch: device {outcome['crc']:08x}, image {binascii.crc32(firmware_data):08x}")
+        else:
+            print(f"\n✅ OTA update complete ({len(stream) / elapsed / 1024:.1f} KB/s on the wire, "
+                  f"{len(firmware_data) / elapsed / 1024:.1f} KB/s of image, CRC {outcome['crc']:08x} confirmed)")
 
 if __name__ == "__main__":
     asyncio.run(ota_update())
@@ -0,0 +1,111 @@
+"""
+Host-side emulator of the device end of a pull session, for trying pull_transfer.py without hardware
+
+EmulatedDevice mirrors BLEOtaUpdate's pull logic (requestNextRange, acceptPulledData with its
+immediate gap repair, and the OTA_PULL_RETRY_MS backstop in loop()) over a lossy in-process
+link with flash-erase stalls.
+
+  python pull_emulator.py [image size] [loss rate]    # e.g. 300000 0.02
+"""
+
+import asyncio
+import os
+import random
+import sys
+import time
+
+from pull_transfer import OFFSET_SIZE, PullSender
+
+SECTOR_SIZE = 4096
+
+
+class EmulatedDevice:
+    def __init__(self, size, window=8192, retry_s=0.5, erase_s=0.02, loss=0.0, link_s=0.001, notify=None):
+        self.size = size
+        self.window = window
+        self.retry_s = retry_s
+        self.erase_s = erase_s
+        self.loss = loss
+        self.link_s = link_s  # Per-write air time
+        self.notify = notify
+        self.image = bytearray()
+        self.requested = 0
+        self.repaired_at = None  # Offset of the last gap repair; one per gap
+        self.activity = time.monotonic()
+        self.inbox = asyncio.Queue()
+        self.stats = {"requests": 0, "repairs": 0, "dropped": 0, "lost": 0}
+
+    async def write(self, payload):
+        """Client side of the link: writes are serialised and some never arrive."""
+        await asyncio.sleep(self.link_s)
+        if random.random() < self.loss:
+            self.stats["lost"] += 1
+            return
+        self.inbox.put_nowait(payload)
+
+    def request_next_range(self):
+        self.activity = time.monotonic()
+        self.requested = max(self.requested, len(self.image))
+        received = len(self.image)
+        if received == self.size:
+            self.notify(f"REQ:{self.size},0")
+            return
+        if self.requested - received > self.window // 2 or self.requested >= self.size:
+            return
+        length = min(self.window - (self.requested - received), self.size - self.requested)
+        self.stats["requests"] += 1
+        self.notify(f"REQ:{self.requested},{length}")
+        self.requested += length
+
+    async def accept(self, payload):
+        offset = int.from_bytes(payload[:OFFSET_SIZE], "little")
+        data = payload[OFFSET_SIZE:]
+        received = len(self.image)
+        if offset != received or len(data) > self.requested - received:
+            self.stats["dropped"] += len(data)
+            if received < offset < self.requested and self.repaired_at != received:
+                # A write went missing: ask again from the gap right away
+                self.repaired_at = received
+                self.repair()
+            return
+        self.image += data
+        if received // SECTOR_SIZE != len(self.image) // SECTOR_SIZE:
+            await asyncio.sleep(self.erase_s)  # Update erases the next sector while the link waits
+        self.request_next_range()
+
+    async def run(self):
+        self.request_next_range()
+        while len(self.image) < self.size:
+            try:
+                payload = await asyncio.wait_for(self.inbox.get(), timeout=self.retry_s / 4)
+                await self.accept(payload)
+            except asyncio.TimeoutError:
+                pass
+            if len(self.image) < self.size and time.monotonic() - self.activity > self.retry_s:
+                self.repair()
+
+    def repair(self):
+        self.stats["repairs"] += 1
+        self.requested = len(self.image)
+        self.request_next_range()
+
+
+async def main(size, loss):
+    image = os.urandom(size)
+    sender = None
+    device = EmulatedDevice(size, loss=loss, notify=lambda msg: sender.on_status(msg))
+    sender = PullSender(device.write, image, chunk_size=244)
+
+    started = time.monotonic()
+    await asyncio.gather(device.run(), sender.run())
+    elapsed = time.monotonic() - started
+    ok = bytes(device.image) == image
+    print(f"{size} bytes in {elapsed:.2f} s, image {'ok' if ok else 'CORRUPT'}; device {device.stats}, "
+          f"client saw {sender.requests} requests ({sender.repairs} repairs)")
+    return ok
+
+
+if __name__ == "__main__":
+    size = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    loss = float(sys.argv[2]) if len(sys.argv) > 2 else 0.01
+    sys.exit(0 if asyncio.run(main(size, loss)) else 1)
@@ -0,0 +1,58 @@
+"""
+Client side of OTA_FEATURE_PULL sessions (see README "OTA Protocol")
+
+The device asks for data with REQ:<offset>,<length> status notifications and
+ends with REQ:<size>,0. Every data write starts with its offset (4 bytes LE).
+A request below the end of the ranges already asked for is a repair: the
+device lost or dropped something, so everything queued before it is void.
+Used by ota_client.py with PULL = True and exercised by pull_emulator.py.
+"""
+
+import asyncio
+import collections
+
+OFFSET_SIZE = 4
+
+
+class PullSender:
+    def __init__(self, write, data, chunk_size):
+        self.write = write  # async write(payload)
+        self.data = data
+        self.chunk_size = chunk_size - OFFSET_SIZE
+        self.pending = collections.deque()
+        self.requested_end = 0
+        self.event = asyncio.Event()
+        self.requests = 0
+        self.repairs = 0
+
+    def on_status(self, msg):
+        """Feed every status notification; returns True for REQ: messages."""
+        if not msg.startswith("REQ:"):
+            return False
+        offset, length = (int(field) for field in msg[4:].split(","))
+        if offset < self.requested_end:
+            self.repairs += 1
+            self.pending.clear()
+        self.pending.append((offset, length))
+        self.requested_end = offset + length
+        self.requests += 1
+        self.event.set()
+        return True
+
+    async def run(self, timeout=10, progress=None):
+        """Serve requests until the device has the whole image."""
+        while True:
+            while not self.pending:
+                self.event.clear()
+                await asyncio.wait_for(self.event.wait(), timeout=timeout)
+            offset, length = self.pending.popleft()
+            if length == 0:
+                return
+            repairs = self.repairs
+            end = offset + length
+            while offset < end and repairs == self.repairs:
+                chunk_end = min(offset + self.chunk_size, end)
+                await self.write(offset.to_bytes(OFFSET_SIZE, "little") + self.data[offset:chunk_end])
+                offset = chunk_end
+                if progress:
+                    progress(offset)
@@ -0,0 +1,53 @@
+"""
+Sign firmware images for BLEOtaUpdate::setSigningKey() (ECDSA P-256 over SHA-256)
+Requires: cryptography
+Install: pip install cryptography
+
+  python sign_firmware.py keygen signing_key.pem     # prints the C array for the sketch
+  python sign_firmware.py sign signing_key.pem firmware.bin   # writes firmware.bin.sig
+
+ota_client.py sends firmware.bin.sig automatically when it exists.
+Keep the private key off the devices and out of the repository.
+"""
+
+import sys
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.primitives.asymmetric.utils import decode_dss_signature
+
+
+def public_key_array(private_key):
+    point = private_key.public_key().public_bytes(serialization.Encoding.X962,
+                                                  serialization.PublicFormat.UncompressedPoint)
+    rows = [", ".join(f"0x{b:02x}" for b in point[i:i + 13]) for i in range(0, len(point), 13)]
+    return "const uint8_t OTA_SIGNING_KEY[65] = {\n  " + ",\n  ".join(rows) + "\n};"
+
+
+def keygen(key_file):
+    private_key = ec.generate_private_key(ec.SECP256R1())
+    with open(key_file, "wb") as f:
+        f.write(private_key.private_bytes(serialization.Encoding.PEM,
+                                          serialization.PrivateFormat.PKCS8,
+                                          serialization.NoEncryption()))
+    print(f"Wrote {key_file}. Add this to the sketch and call bleOta.setSigningKey(OTA_SIGNING_KEY, 65):\n")
+    print(public_key_array(private_key))
+
+
+def sign(key_file, firmware_file):
+    with open(key_file, "rb") as f:
+        private_key = serialization.load_pem_private_key(f.read(), password=None)
+    with open(firmware_file, "rb") as f:
+        image = f.read()
+    r, s = decode_dss_signature(private_key.sign(image, ec.ECDSA(hashes.SHA256())))
+    with open(firmware_file + ".sig", "wb") as f:
+        f.write(r.to_bytes(32, "big") + s.to_bytes(32, "big"))
+    print(f"Signed {firmware_file} ({len(image)} bytes) -> {firmware_file}.sig")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) == 3 and sys.argv[1] == "keygen":
+        keygen(sys.argv[2])
+    elif len(sys.argv) == 4 and sys.argv[1] == "sign":
+        sign(sys.argv[2], sys.argv[3])
+    else:
+        print(__doc__)
@@ -0,0 +1,101 @@
+"""
+Convert a BLE OTA event trace to Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+
+The input is any text containing the device's TRACE: lines: a Serial log after
+bleOta.dumpTrace(Serial), or the file written by ota_client.py with DUMP_TRACE.
+Usage: python trace_to_chrome.py ota_trace.txt [trace.json]
+"""
+
+import json
+import sys
+
+# enum class OtaTraceEvent (BLEOtaUpdate.h)
+EVENTS = {
+    1: "CONNECT", 2: "DISCONNECT", 3: "CONN_PARAMS", 4: "MTU", 5: "GATT_WRITE",
+    6: "LONG_WRITE_FRAGMENT", 7: "FLASH_WRITE_BEGIN", 8: "FLASH_WRITE_END",
+    9: "BUFFER_FLUSH", 10: "ERASE_BEGIN", 11: "ERASE_END", 12: "PROGRAM_BEGIN",
+    13: "PROGRAM_END", 14: "NOTIFY", 15: "CALLBACK_BEGIN", 16: "CALLBACK_END",
+    17: "SESSION_BEGIN", 18: "SESSION_END", 19: "SECTOR_SKIPPED",
+}
+CALLBACKS = {1: "progress", 2: "status", 3: "command", 4: "connection"}
+STATUSES = ["IDLE", "RECEIVING", "COMPLETED", "ERROR", "ABORTED"]
+
+# *_BEGIN/*_END pairs become duration slices, everything else an instant event
+SLICES = {"FLASH_WRITE": "Update.write", "ERASE": "erase", "PROGRAM": "program", "CALLBACK": "callback"}
+
+
+def read_records(lines):
+    """Yield (mhz, cycles, core, event, arg) for each record in the TRACE: lines."""
+    mhz = 240
+    for line in lines:
+        line = line.strip()
+        start = line.find("TRACE:")
+        if start < 0:
+            continue
+        payload = line[start + len("TRACE:"):]
+        if payload.startswith("begin"):
+            fields = dict(f.split("=", 1) for f in payload.split(",")[1:])
+            mhz = int(fields.get("mhz", mhz))
+            if int(fields.get("lost", 0)):
+                print(f"note: ring wrapped, {fields['lost']} older events were overwritten", file=sys.stderr)
+            continue
+        if payload in ("end", "disabled", "error=mtu"):
+            if payload == "disabled":
+                print("note: device was built without BLE_OTA_TRACE", file=sys.stderr)
+            elif payload == "error=mtu":
+                print("note: MTU too small for a trace record, negotiate a larger one", file=sys.stderr)
+            continue
+        for i in range(0, len(payload) - 15, 16):
+            cycles = int(payload[i:i + 8], 16)
+            event_arg = int(payload[i + 8:i + 16], 16)
+            yield mhz, cycles, event_arg >> 31, (event_arg >> 24) & 0x7F, event_arg & 0xFFFFFF
+
+
+def to_chrome(lines):
+    events = []
+    last_cycles = {}  # Per core: the cycle counters are 32-bit and core-local
+    wraps = {}
+    for mhz, cycles, core, event, arg in read_records(lines):
+        if core in last_cycles and cycles < last_cycles[core]:
+            wraps[core] = wraps.get(core, 0) + 1
+        last_cycles[core] = cycles
+        ts = (cycles + (wraps.get(core, 0) << 32)) / mhz  # Microseconds
+
+        name = EVENTS.get(event, f"event{event}")
+        base, _, edge = name.rpartition("_")
+        record = {"ts": ts, "pid": 1, "tid": core, "args": {"arg": arg}}
+        if base in SLICES and edge in ("BEGIN", "END"):
+            record["name"] = CALLBACKS.get(arg, str(arg)) if base == "CALLBACK" else SLICES[base]
+            record["ph"] = "B" if edge == "BEGIN" else "E"
+        else:
+            record["name"] = name
+            record["ph"] = "i"
+            record["s"] = "t"
+            if event == 18 and arg < len(STATUSES):
+                record["args"]["status"] = STATUSES[arg]
+        events.append(record)
+
+    # Timestamps start at the first event on each core; cores are not mutually synchronised
+    first = {}
+    for record in events:
+        first.setdefault(record["tid"], record["ts"])
+        record["ts"] -= first[record["tid"]]
+    metadata = [{"name": "thread_name", "ph": "M", "pid": 1, "tid": core, "args": {"name": f"core {core}"}}
+                for core in sorted(first)]
+    return {"traceEvents": metadata + events, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return
+    with open(sys.argv[1], errors="replace") as f:
+        trace = to_chrome(f)
+    out = sys.argv[2] if len(sys.argv) > 2 else "trace.json"
+    with open(out, "w") as f:
+        json.dump(trace, f)
+    print(f"Wrote {len(trace['traceEvents'])} events to {out}")
+
+
+if __name__ == "__main__":
+    main()
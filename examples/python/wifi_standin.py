@@ -0,0 +1,96 @@
+"""
+Local stand-in for the device's Wi-Fi data path, for trying wifi_transfer.py on a Linux host
+
+StandinDevice serves PUT /ota like BLEOtaUpdate::serviceWifiDataPath(): the X-OTA-Token header must
+match the session token, the Content-Length must equal what is still missing, the reply reports offset=<n>, and a stream that ends early leaves the
+offset where the data stopped (the device notifies WIFI:closed,offset=<n> over BLE). A drop can be
+injected to exercise the BLE fallback, which is simulated here by appending the rest directly.
+
+  python wifi_standin.py [image size] [drop after bytes]    # e.g. 2000000 700000
+"""
+
+import asyncio
+import binascii
+import os
+import secrets
+import sys
+import time
+
+from wifi_transfer import put_image
+
+HEADER_MAX = 512
+
+
+class StandinDevice:
+    def __init__(self, size, drop_after=None):
+        self.size = size
+        self.token = secrets.token_hex(8)  # What WIFI:ready would carry
+        self.drop_after = drop_after
+        self.image = bytearray()
+        self.closed_at = None  # What the device would report as WIFI:closed,offset=
+
+    async def handle(self, reader, writer):
+        head = await reader.readuntil(b"\r\n\r\n")
+        if len(head) > HEADER_MAX:
+            return await self.respond(writer, "431 Request Header Fields Too Large")
+        lines = head.decode().lower().split("\r\n")
+        length = next((int(l.split(":", 1)[1]) for l in lines if l.startswith("content-length:")), 0)
+        token = next((l.split(":", 1)[1].strip() for l in lines if l.startswith("x-ota-token:")), "")
+        if token != self.token:
+            return await self.respond(writer, "403 Forbidden")
+        if not lines[0].startswith("put /ota ") or length == 0 or length != self.size - len(self.image):
+            return await self.respond(writer, "409 Conflict")
+
+        while length > 0:
+            data = await reader.read(min(512, length))
+            if not data:
+                break
+            if self.drop_after is not None and len(self.image) + len(data) > self.drop_after:
+                self.image += data[:self.drop_after - len(self.image)]
+                self.drop_after = None
+                writer.transport.abort()  # Link lost mid-stream
+                self.closed_at = len(self.image)
+                return
+            self.image += data
+            length -= len(data)
+        if length:
+            self.closed_at = len(self.image)
+            writer.close()
+            return
+        await self.respond(writer, "200 OK")
+
+    async def respond(self, writer, status):
+        writer.write(f"HTTP/1.1 {status}\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+                     f"offset={len(self.image)}\n".encode())
+        await writer.drain()
+        writer.close()
+
+
+async def main(size, drop_after):
+    image = os.urandom(size)
+    device = StandinDevice(size, drop_after)
+    server = await asyncio.start_server(device.handle, "127.0.0.1", 0)
+    port = server.sockets[0].getsockname()[1]
+
+    started = time.monotonic()
+    try:
+        offset = await put_image("127.0.0.1", port, image, device.token)
+    except (OSError, asyncio.TimeoutError) as error:
+        await asyncio.sleep(0.1)
+        offset = device.closed_at
+        print(f"Wi-Fi stream failed ({error.__class__.__name__}) at {offset} bytes, falling back to BLE")
+        device.image += image[offset:]  # Stands in for the BLE transfer from the reported offset
+    elapsed = time.monotonic() - started
+    server.close()
+    await server.wait_closed()
+
+    ok = bytes(device.image) == image
+    print(f"{size} bytes in {elapsed:.2f} s ({size / elapsed / 1024 / 1024:.1f} MB/s), "
+          f"image {'ok' if ok else 'CORRUPT'}, crc 0x{binascii.crc32(device.image):08x}")
+    return ok
+
+
+if __name__ == "__main__":
+    size = int(sys.argv[1]) if len(sys.argv) > 1 else 2000000
+    drop_after = int(sys.argv[2]) if len(sys.argv) > 2 else None
+    sys.exit(0 if asyncio.run(main(size, drop_after)) else 1)
@@ -0,0 +1,50 @@
+"""
+Wi-Fi data path for OTA_FEATURE_WIFI sessions (see README "OTA Protocol")
+
+After granting the flag in HELLO the device notifies WIFI:ready,wifi=<ip>:<port>,
+token=<t>, plus ssid= and psk= when it opened a temporary SoftAP that this host
+has to join first (only over an encrypted link), or WIFI:closed when it could
+not. The image body is sent as one HTTP PUT to /ota carrying the token in
+X-OTA-Token; BLE stays the control channel (SIG, DONE) and takes over from the
+returned offset when the TCP stream fails.
+Used by ota_client.py with WIFI = True and exercised by wifi_standin.py.
+"""
+
+import asyncio
+import shutil
+import subprocess
+
+
+def join_access_point(ssid, psk):
+    """Join the device's SoftAP with NetworkManager when available; True once connected."""
+    if not shutil.which("nmcli"):
+        print(f"Join Wi-Fi '{ssid}' (password {psk}) on this host, then retry")
+        return False
+    result = subprocess.run(["nmcli", "dev", "wifi", "connect", ssid, "password", psk],
+                            capture_output=True, text=True, timeout=30)
+    return result.returncode == 0
+
+
+async def put_image(host, port, data, token, offset=0, chunk_size=16384, timeout=10, progress=None):
+    """PUT data[offset:] to the device; returns the offset it reports (len(data) on success).
+
+    Raises OSError / asyncio.TimeoutError when the connection fails before a reply.
+    """
+    reader, writer = await asyncio.wait_for(asyncio.open_connection(host, port), timeout=timeout)
+    try:
+        body = data[offset:]
+        writer.write(f"PUT /ota HTTP/1.1\r\nHost: {host}\r\nContent-Length: {len(body)}\r\n"
+                     f"X-OTA-Token: {token}\r\nContent-Type: application/octet-stream\r\n\r\n".encode())
+        for start in range(0, len(body), chunk_size):
+            writer.write(body[start:start + chunk_size])
+            await asyncio.wait_for(writer.drain(), timeout=timeout)
+            if progress:
+                progress(offset + min(start + chunk_size, len(body)))
+        reply = await asyncio.wait_for(reader.read(), timeout=timeout)
+    finally:
+        writer.close()
+    status, _, rest = reply.decode(errors="replace").partition("\r\n")
+    for line in rest.splitlines():
+        if line.startswith("offset="):
+            return int(line[len("offset="):])
+    raise OSError(f"unexpected reply: {status}")